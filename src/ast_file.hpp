@@ -0,0 +1,799 @@
+#pragma once
+
+#include <cctype>
+#include <cerrno>
+#include <charconv>      // For checking integer literals
+#include <cstdint>
+#include <cstdio>        // For rename
+#include <cstring>       // For memcpy
+#include <mutex>         // For building function bodies from worker threads
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map> // For sharing repeated strings
+#include <variant>
+#include <vector>
+#include <fcntl.h>       // For open
+#include <sys/mman.h>    // For mmap
+#include <sys/stat.h>    // For fstat
+#include <unistd.h>
+
+#include "parser.hpp"
+
+// ============================= AST FILES =============================
+
+// A parsed program saved to disk so it can be compiled again without tokenizing or parsing. The file is position
+// independent: items refer to each other by byte offsets from the start of the file, never by pointer, so it can
+// be mapped anywhere. It is a sequence of little-endian 64-bit words, one of:
+//  - header: magic, format version, offset of the program record
+//  - record: kind in the low 32 bits and flags in the high 32 bits, then three fields, each an offset to another
+//            item or a number
+//  - list:   item count, then the offset of each item
+//  - string: byte count, then the bytes padded to a whole word
+// Offset 0 is the header, so in a field it stands for "none", e.g. an if without an else.
+//
+// Loading maps the file and keeps it mapped for as long as the tree is used: names, literals and import paths are
+// read in place from their string items and never copied. Loading turns only the records outside functions into
+// nodes. A function's body is built when something first asks for it (node_statement_fn::body): the generator's
+// worker for that function, the interpreter as it compiles it, and never if nothing does. The work of loading a
+// large program is thus spread over the threads generating it rather than done up front on one, and a corrupt
+// body is only found when it is reached.
+
+constexpr uint64_t ast_magic = 0x5453414b52455551; // "QUERKAST"
+constexpr uint64_t ast_version = 1;
+
+// Kind of a record, and what its fields hold
+enum class ast_kind : uint32_t {
+    program,     // statement list, import list of strings or 0
+    exit,        // expr
+    let,         // ident, expr
+    scope,       // statement list
+    if_,         // expr, scope, else scope or 0
+    return_,     // expr
+    fn,          // ident, parameter list of strings, scope
+    array,       // ident, size; flags: 1 if static
+    assign,      // ident, index expr or 0, expr
+    while_,      // expr, scope
+    match,       // expr, arm list
+    arm,         // value, scope; flags: 1 if it has a value, 0 for '_'
+    int_lit,     // digits
+    identifier,  // name
+    parentheses, // expr
+    call,        // ident, argument list of exprs; flags: 1 for a tail call
+    index,       // ident, index expr
+    not_,        // expr
+    add,         // lhs, rhs, and likewise for the other binary operators
+    multiply,
+    minus,
+    divide,
+    modulus,
+    compare, // flags: compare_op
+    and_,
+    or_
+};
+
+// Serialises a program into the words of an AST file. Trees of any depth are walked on an explicit stack.
+class ast_writer {
+  public:
+    inline explicit ast_writer(const node_program &prog) {
+        m_words = {ast_magic, ast_version, 0};
+        uint64_t program = add_record(ast_kind::program);
+        m_words[2] = program * 8;
+        add_statements(program + 1, prog.stmts.size(), [&](size_t i) { return prog.stmts[i]; });
+        if (!prog.imports.empty()) {
+            uint64_t imports = add_list(prog.imports.size());
+            m_words[program + 2] = imports * 8;
+            for (size_t i = 0; i < prog.imports.size(); ++i) {
+                m_words[imports + 1 + i] = add_string(prog.imports[i]);
+            }
+        }
+        run();
+    }
+
+    // Writes the file, returning false on failure. It is written beside path and renamed over it, so a compilation
+    // that still has the old file mapped keeps reading it instead of finding it truncated.
+    inline bool write_to(const std::string &path) const {
+        std::string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        const char *data = reinterpret_cast<const char *>(m_words.data());
+        size_t size = m_words.size() * 8;
+        while (size > 0) {
+            ssize_t n = write(fd, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                close(fd);
+                unlink(temporary.c_str());
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        if (close(fd) != 0 || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    enum class node_kind { statement, scope, expr };
+
+    // Node whose record is still to be written, and the word its offset goes into
+    struct pending {
+        node_kind kind;
+        const void *node;
+        uint64_t slot;
+    };
+
+    // Appends a record with zeroed fields, returning its word index
+    inline uint64_t add_record(ast_kind kind, uint32_t flags = 0) {
+        uint64_t index = m_words.size();
+        m_words.push_back(static_cast<uint64_t>(kind) | static_cast<uint64_t>(flags) << 32);
+        m_words.insert(m_words.end(), 3, 0);
+        return index;
+    }
+
+    // Appends a list of count zeroed offsets, returning its word index
+    inline uint64_t add_list(size_t count) {
+        uint64_t index = m_words.size();
+        m_words.push_back(count);
+        m_words.insert(m_words.end(), count, 0);
+        return index;
+    }
+
+    // Byte offset of a string, written once however often it is used
+    inline uint64_t add_string(std::string_view text) {
+        auto it = m_strings.find(text);
+        if (it != m_strings.end()) {
+            return it->second;
+        }
+        uint64_t index = m_words.size();
+        m_words.push_back(text.size());
+        m_words.insert(m_words.end(), (text.size() + 7) / 8, 0);
+        memcpy(&m_words[index + 1], text.data(), text.size());
+        m_strings.emplace(text, index * 8);
+        return index * 8;
+    }
+
+    inline uint64_t add_string(const token &tok) {
+        return add_string(tok.value.value());
+    }
+
+    // Queues the statements get(0) ... get(count - 1) for a new list whose offset goes into slot
+    template <typename Get> inline void add_statements(uint64_t slot, size_t count, Get &&get) {
+        uint64_t list = add_list(count);
+        m_words[slot] = list * 8;
+        for (size_t i = count; i-- > 0;) {
+            m_pending.push_back({node_kind::statement, get(i), list + 1 + i});
+        }
+    }
+
+    inline void queue(node_kind kind, const void *node, uint64_t slot) {
+        if (node != nullptr) {
+            m_pending.push_back({kind, node, slot});
+        }
+    }
+
+    inline void queue_expr(const node_expr *expr, uint64_t slot) {
+        queue(node_kind::expr, expr, slot);
+    }
+
+    inline void queue_scope(const node_scope *scope, uint64_t slot) {
+        queue(node_kind::scope, scope, slot);
+    }
+
+    inline void run() {
+        while (!m_pending.empty()) {
+            pending next = m_pending.back();
+            m_pending.pop_back();
+            uint64_t record;
+            if (next.kind == node_kind::statement) {
+                record = write_statement(*static_cast<const node_statement *>(next.node));
+            } else if (next.kind == node_kind::scope) {
+                record = write_scope(static_cast<const node_scope *>(next.node));
+            } else {
+                record = write_expr(static_cast<const node_expr *>(next.node));
+            }
+            m_words[next.slot] = record * 8;
+        }
+    }
+
+    inline uint64_t write_scope(const node_scope *scope) {
+        uint64_t record = add_record(ast_kind::scope);
+        add_statements(record + 1, scope->stmts.size(), [&](size_t i) { return scope->stmts[i]; });
+        return record;
+    }
+
+    inline uint64_t write_statement(const node_statement &stmt) {
+        struct statement_visitor {
+            ast_writer *writer;
+
+            uint64_t operator()(const node_statement_exit &stmt_exit) const {
+                uint64_t record = writer->add_record(ast_kind::exit);
+                writer->queue_expr(stmt_exit.expr, record + 1);
+                return record;
+            }
+
+            uint64_t operator()(const node_statement_let &stmt_let) const {
+                uint64_t record = writer->add_record(ast_kind::let);
+                writer->m_words[record + 1] = writer->add_string(stmt_let.ident);
+                writer->queue_expr(stmt_let.expr, record + 2);
+                return record;
+            }
+
+            uint64_t operator()(const node_scope *scope) const {
+                return writer->write_scope(scope);
+            }
+
+            uint64_t operator()(const node_statement_if *stmt_if) const {
+                uint64_t record = writer->add_record(ast_kind::if_);
+                writer->queue_expr(stmt_if->expr, record + 1);
+                writer->queue_scope(stmt_if->scope, record + 2);
+                writer->queue_scope(stmt_if->else_scope, record + 3);
+                return record;
+            }
+
+            uint64_t operator()(const node_statement_return *stmt_return) const {
+                uint64_t record = writer->add_record(ast_kind::return_);
+                writer->queue_expr(stmt_return->expr, record + 1);
+                return record;
+            }
+
+            uint64_t operator()(const node_statement_fn *stmt_fn) const {
+                uint64_t record = writer->add_record(ast_kind::fn);
+                writer->m_words[record + 1] = writer->add_string(stmt_fn->ident);
+                uint64_t params = writer->add_list(stmt_fn->params.size());
+                writer->m_words[record + 2] = params * 8;
+                for (size_t i = 0; i < stmt_fn->params.size(); ++i) {
+                    writer->m_words[params + 1 + i] = writer->add_string(stmt_fn->params[i]);
+                }
+                writer->queue_scope(stmt_fn->body(), record + 3);
+                return record;
+            }
+
+            uint64_t operator()(const node_statement_array *stmt_array) const {
+                uint64_t record = writer->add_record(ast_kind::array, stmt_array->is_static ? 1 : 0);
+                writer->m_words[record + 1] = writer->add_string(stmt_array->ident);
+                writer->m_words[record + 2] = stmt_array->size;
+                return record;
+            }
+
+            uint64_t operator()(const node_statement_assign *stmt_assign) const {
+                uint64_t record = writer->add_record(ast_kind::assign);
+                writer->m_words[record + 1] = writer->add_string(stmt_assign->ident);
+                writer->queue_expr(stmt_assign->index, record + 2);
+                writer->queue_expr(stmt_assign->expr, record + 3);
+                return record;
+            }
+
+            uint64_t operator()(const node_statement_while *stmt_while) const {
+                uint64_t record = writer->add_record(ast_kind::while_);
+                writer->queue_expr(stmt_while->expr, record + 1);
+                writer->queue_scope(stmt_while->scope, record + 2);
+                return record;
+            }
+
+            uint64_t operator()(const node_statement_match *stmt_match) const {
+                uint64_t record = writer->add_record(ast_kind::match);
+                writer->queue_expr(stmt_match->expr, record + 1);
+                uint64_t arms = writer->add_list(stmt_match->arms.size());
+                writer->m_words[record + 2] = arms * 8;
+                for (size_t i = 0; i < stmt_match->arms.size(); ++i) {
+                    const node_match_arm &arm = stmt_match->arms[i];
+                    uint64_t arm_record = writer->add_record(ast_kind::arm, arm.value.has_value() ? 1 : 0);
+                    writer->m_words[arms + 1 + i] = arm_record * 8;
+                    writer->m_words[arm_record + 1] = static_cast<uint64_t>(arm.value.value_or(0));
+                    writer->queue_scope(arm.scope, arm_record + 2);
+                }
+                return record;
+            }
+        };
+
+        return std::visit(statement_visitor{.writer = this}, stmt.var);
+    }
+
+    inline uint64_t write_expr(const node_expr *expr) {
+        if (auto bin_expr = std::get_if<node_binary_expr *>(&expr->var)) {
+            return std::visit(
+                [&](const auto *node) {
+                    using node_type = std::remove_cv_t<std::remove_pointer_t<decltype(node)>>;
+                    uint64_t record;
+                    if constexpr (std::is_same_v<node_type, node_binary_expr_compare>) {
+                        record = add_record(ast_kind::compare, static_cast<uint32_t>(node->op));
+                    } else {
+                        record = add_record(binary_kind<node_type>());
+                    }
+                    queue_expr(node->lhs, record + 1);
+                    queue_expr(node->rhs, record + 2);
+                    return record;
+                },
+                (*bin_expr)->var);
+        }
+
+        struct term_visitor {
+            ast_writer *writer;
+
+            uint64_t operator()(const node_term_int_lit *term_int_lit) const {
+                uint64_t record = writer->add_record(ast_kind::int_lit);
+                writer->m_words[record + 1] = writer->add_string(term_int_lit->int_lit);
+                return record;
+            }
+
+            uint64_t operator()(const node_term_identifier *term_ident) const {
+                uint64_t record = writer->add_record(ast_kind::identifier);
+                writer->m_words[record + 1] = writer->add_string(term_ident->identifier);
+                return record;
+            }
+
+            uint64_t operator()(const node_term_parentheses *term_paren) const {
+                uint64_t record = writer->add_record(ast_kind::parentheses);
+                writer->queue_expr(term_paren->expr, record + 1);
+                return record;
+            }
+
+            uint64_t operator()(const node_term_call *term_call) const {
+                uint64_t record = writer->add_record(ast_kind::call, term_call->is_tail ? 1 : 0);
+                writer->m_words[record + 1] = writer->add_string(term_call->ident);
+                uint64_t args = writer->add_list(term_call->args.size());
+                writer->m_words[record + 2] = args * 8;
+                for (size_t i = 0; i < term_call->args.size(); ++i) {
+                    writer->queue_expr(term_call->args[i], args + 1 + i);
+                }
+                return record;
+            }
+
+            uint64_t operator()(const node_term_index *term_index) const {
+                uint64_t record = writer->add_record(ast_kind::index);
+                writer->m_words[record + 1] = writer->add_string(term_index->ident);
+                writer->queue_expr(term_index->index, record + 2);
+                return record;
+            }
+
+            uint64_t operator()(const node_term_not *term_not) const {
+                uint64_t record = writer->add_record(ast_kind::not_);
+                writer->queue_expr(term_not->expr, record + 1);
+                return record;
+            }
+        };
+
+        return std::visit(term_visitor{.writer = this}, std::get<node_term *>(expr->var)->var);
+    }
+
+    template <typename T> static constexpr ast_kind binary_kind() {
+        if constexpr (std::is_same_v<T, node_binary_expr_add>) {
+            return ast_kind::add;
+        } else if constexpr (std::is_same_v<T, node_binary_expr_multiply>) {
+            return ast_kind::multiply;
+        } else if constexpr (std::is_same_v<T, node_binary_expr_minus>) {
+            return ast_kind::minus;
+        } else if constexpr (std::is_same_v<T, node_binary_expr_divide>) {
+            return ast_kind::divide;
+        } else if constexpr (std::is_same_v<T, node_binary_expr_modulus>) {
+            return ast_kind::modulus;
+        } else if constexpr (std::is_same_v<T, node_binary_expr_and>) {
+            return ast_kind::and_;
+        } else {
+            static_assert(std::is_same_v<T, node_binary_expr_or>);
+            return ast_kind::or_;
+        }
+    }
+
+    std::vector<uint64_t> m_words;
+    std::unordered_map<std::string_view, uint64_t> m_strings; // Offset of every string written so far
+    std::vector<pending> m_pending;                           // Nodes not written yet
+};
+
+// Maps an AST file and builds the program it holds straight into node storage, with no tokenizing or parsing.
+// Every offset is checked against the file, so a damaged or foreign file is reported rather than followed.
+// Nodes go into the arena, owned by the caller, and their names point into the mapping, so the reader must outlive
+// the tree; the file is unmapped when the reader is destroyed.
+class ast_reader final : public body_loader {
+  public:
+    inline ast_reader(const std::string &path, storage_allocator &arena) : m_allocator(arena) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            report_error("Error: Unable to open file ", path);
+        }
+        m_size = static_cast<size_t>(info.st_size);
+        void *mapping = m_size > 0 ? mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            report_error("Error: Unable to map AST file ", path);
+        }
+        m_words = static_cast<const uint64_t *>(mapping);
+        try {
+            load();
+        } catch (...) {
+            munmap(mapping, m_size);
+            throw;
+        }
+        m_pending.clear();
+        m_pending.shrink_to_fit();
+    }
+
+    inline ~ast_reader() {
+        munmap(const_cast<uint64_t *>(m_words), m_size);
+    }
+
+    inline ast_reader(const ast_reader &) = delete;
+    inline ast_reader &operator=(const ast_reader &) = delete;
+
+    inline node_program *program() const {
+        return m_prog;
+    }
+
+    // Builds a function body the first time it is asked for. The generator's workers ask for the bodies of the
+    // functions they generate, so several threads may ask at once; building a body is quick next to generating
+    // it, and they take turns. A body that turns out to be corrupt is left unbuilt and reported to each caller.
+    inline node_scope *load_body(const node_statement_fn &stmt_fn) override {
+        std::lock_guard lock(m_mutex);
+        if (stmt_fn.scope == nullptr) {
+            node_scope *scope = nullptr;
+            try {
+                queue_scope(stmt_fn.body_record, &scope);
+                build_pending();
+            } catch (...) {
+                m_pending.clear();
+                throw;
+            }
+            stmt_fn.scope = scope;
+        }
+        return stmt_fn.scope;
+    }
+
+  private:
+    enum class node_kind { statement, scope, expr };
+
+    // Record still to be built, and where the node built from it goes
+    struct pending {
+        node_kind kind;
+        uint64_t offset;
+        void *dest; // node_statement *, node_scope ** or node_expr **
+    };
+
+    [[noreturn]] static void corrupt() {
+        report_error("Error: Invalid AST file");
+    }
+
+    // Word at a byte offset, which must lie inside the file
+    inline uint64_t word(uint64_t offset) const {
+        if (offset % 8 != 0 || offset / 8 >= m_size / 8) {
+            corrupt();
+        }
+        return m_words[offset / 8];
+    }
+
+    // Kind of the record at offset. Every record built uses up budget, so a file whose offsets loop is caught.
+    inline ast_kind kind(uint64_t offset) {
+        if (offset == 0 || m_budget == 0) {
+            corrupt();
+        }
+        word(offset + 24); // The last field must be inside the file too
+        --m_budget;
+        return static_cast<ast_kind>(word(offset) & 0xffffffff);
+    }
+
+    inline uint32_t flags(uint64_t offset) const {
+        return static_cast<uint32_t>(word(offset) >> 32);
+    }
+
+    inline uint64_t field(uint64_t offset, int index) const {
+        return word(offset + 8 * index);
+    }
+
+    // Number of items in the list at offset, all of which must lie inside the file
+    inline uint64_t list_size(uint64_t offset) const {
+        uint64_t count = word(offset);
+        if (count > (m_size - offset) / 8 - 1) {
+            corrupt();
+        }
+        return count;
+    }
+
+    // Identifier, integer or string literal, held to what the tokenizer would have produced since identifiers and
+    // integers end up in assembly and strings in paths. The spelling is left in the mapping rather than interned.
+    inline token read_token(uint64_t offset, tokentype type) const {
+        uint64_t length = word(offset);
+        if (length == 0 || length > m_size - offset - 8) {
+            corrupt();
+        }
+        std::string_view text(reinterpret_cast<const char *>(m_words) + offset + 8, length);
+        for (size_t i = 0; i < text.size(); ++i) {
+            unsigned char c = text[i];
+            bool valid = type == tokentype::string_lit ? c != '"' && c != '\n'
+                         : type == tokentype::int_lit  ? std::isdigit(c)
+                         : i == 0                      ? std::isalpha(c)
+                                                       : std::isalnum(c);
+            if (!valid) {
+                corrupt();
+            }
+        }
+        int64_t value;
+        if (type == tokentype::int_lit &&
+            std::from_chars(text.data(), text.data() + text.size(), value).ec != std::errc()) {
+            corrupt();
+        }
+        return {.type = type, .value = text};
+    }
+
+    inline void load() {
+        if (m_size < 24 || m_words[0] != ast_magic) {
+            corrupt();
+        }
+        if (m_words[1] != ast_version) {
+            report_error("Error: AST file has format version ", m_words[1], ", expected ", ast_version);
+        }
+        m_budget = m_size / 32;
+        uint64_t program = m_words[2];
+        if (kind(program) != ast_kind::program) {
+            corrupt();
+        }
+        m_prog = m_allocator.alloc<node_program>();
+        uint64_t list = field(program, 1);
+        m_prog->stmts.resize(m_allocator, list_size(list));
+        for (size_t i = m_prog->stmts.size(); i-- > 0;) {
+            m_prog->stmts[i] = m_allocator.alloc<node_statement>();
+            m_pending.push_back({node_kind::statement, word(list + 8 + i * 8), m_prog->stmts[i]});
+        }
+        if (uint64_t imports = field(program, 2)) {
+            m_prog->imports.resize(m_allocator, list_size(imports));
+            for (size_t i = 0; i < m_prog->imports.size(); ++i) {
+                m_prog->imports[i] = read_token(word(imports + 8 + i * 8), tokentype::string_lit);
+            }
+        }
+        build_pending();
+    }
+
+    // Builds queued records until there are none left, building one may queue more
+    inline void build_pending() {
+        while (!m_pending.empty()) {
+            pending next = m_pending.back();
+            m_pending.pop_back();
+            if (next.kind == node_kind::statement) {
+                read_statement(next.offset, *static_cast<node_statement *>(next.dest));
+            } else if (next.kind == node_kind::scope) {
+                *static_cast<node_scope **>(next.dest) = read_scope(next.offset);
+            } else {
+                *static_cast<node_expr **>(next.dest) = read_expr(next.offset);
+            }
+        }
+    }
+
+    // Queues the record at offset for a non-null field of a node
+    inline void queue_expr(uint64_t offset, node_expr **dest) {
+        m_pending.push_back({node_kind::expr, offset, dest});
+    }
+
+    inline void queue_scope(uint64_t offset, node_scope **dest) {
+        m_pending.push_back({node_kind::scope, offset, dest});
+    }
+
+    // Builds a scope, queueing its statements
+    inline node_scope *read_scope(uint64_t offset) {
+        if (kind(offset) != ast_kind::scope) {
+            corrupt();
+        }
+        auto scope = m_allocator.alloc<node_scope>();
+        uint64_t list = field(offset, 1);
+        scope->stmts.resize(m_allocator, list_size(list));
+        for (size_t i = scope->stmts.size(); i-- > 0;) {
+            scope->stmts[i] = m_allocator.alloc<node_statement>();
+            m_pending.push_back({node_kind::statement, word(list + 8 + i * 8), scope->stmts[i]});
+        }
+        return scope;
+    }
+
+    inline void read_statement(uint64_t offset, node_statement &stmt) {
+        ast_kind record_kind = kind(offset);
+        switch (record_kind) {
+        case ast_kind::exit:
+            stmt.var = node_statement_exit{};
+            queue_expr(field(offset, 1), &std::get<node_statement_exit>(stmt.var).expr);
+            break;
+        case ast_kind::let: {
+            node_statement_let stmt_let{.ident = read_token(field(offset, 1), tokentype::ident)};
+            stmt.var = std::move(stmt_let);
+            queue_expr(field(offset, 2), &std::get<node_statement_let>(stmt.var).expr);
+            break;
+        }
+        case ast_kind::scope:
+            ++m_budget; // Counted again by read_scope
+            stmt.var = read_scope(offset);
+            break;
+        case ast_kind::if_: {
+            auto stmt_if = m_allocator.alloc<node_statement_if>();
+            queue_expr(field(offset, 1), &stmt_if->expr);
+            queue_scope(field(offset, 2), &stmt_if->scope);
+            if (field(offset, 3) != 0) {
+                queue_scope(field(offset, 3), &stmt_if->else_scope);
+            }
+            stmt.var = stmt_if;
+            break;
+        }
+        case ast_kind::return_: {
+            auto stmt_return = m_allocator.alloc<node_statement_return>();
+            queue_expr(field(offset, 1), &stmt_return->expr);
+            stmt.var = stmt_return;
+            break;
+        }
+        case ast_kind::fn: {
+            auto stmt_fn = m_allocator.alloc<node_statement_fn>();
+            stmt_fn->ident = read_token(field(offset, 1), tokentype::ident);
+            uint64_t params = field(offset, 2);
+            stmt_fn->params.resize(m_allocator, list_size(params));
+            for (size_t i = 0; i < stmt_fn->params.size(); ++i) {
+                stmt_fn->params[i] = read_token(word(params + 8 + i * 8), tokentype::ident);
+            }
+            stmt_fn->loader = this; // See load_body
+            stmt_fn->body_record = field(offset, 3);
+            stmt.var = stmt_fn;
+            break;
+        }
+        case ast_kind::array: {
+            auto stmt_array = m_allocator.alloc<node_statement_array>();
+            stmt_array->ident = read_token(field(offset, 1), tokentype::ident);
+            stmt_array->size = field(offset, 2);
+            if (stmt_array->size == 0 || stmt_array->size > UINT32_MAX) {
+                corrupt(); // The parser never accepts such a size
+            }
+            stmt_array->is_static = flags(offset) != 0;
+            stmt.var = stmt_array;
+            break;
+        }
+        case ast_kind::assign: {
+            auto stmt_assign = m_allocator.alloc<node_statement_assign>();
+            stmt_assign->ident = read_token(field(offset, 1), tokentype::ident);
+            if (field(offset, 2) != 0) {
+                queue_expr(field(offset, 2), &stmt_assign->index);
+            }
+            queue_expr(field(offset, 3), &stmt_assign->expr);
+            stmt.var = stmt_assign;
+            break;
+        }
+        case ast_kind::while_: {
+            auto stmt_while = m_allocator.alloc<node_statement_while>();
+            queue_expr(field(offset, 1), &stmt_while->expr);
+            queue_scope(field(offset, 2), &stmt_while->scope);
+            stmt.var = stmt_while;
+            break;
+        }
+        case ast_kind::match: {
+            auto stmt_match = m_allocator.alloc<node_statement_match>();
+            queue_expr(field(offset, 1), &stmt_match->expr);
+            uint64_t arms = field(offset, 2);
+            stmt_match->arms.resize(m_allocator, list_size(arms));
+            for (size_t i = 0; i < stmt_match->arms.size(); ++i) {
+                uint64_t arm = word(arms + 8 + i * 8);
+                if (kind(arm) != ast_kind::arm) {
+                    corrupt();
+                }
+                if (flags(arm) != 0) {
+                    stmt_match->arms[i].value = static_cast<int64_t>(field(arm, 1));
+                }
+                queue_scope(field(arm, 2), &stmt_match->arms[i].scope);
+            }
+            stmt.var = stmt_match;
+            break;
+        }
+        default:
+            corrupt();
+        }
+    }
+
+    // Builds an expression, queueing its operands
+    inline node_expr *read_expr(uint64_t offset) {
+        ast_kind record_kind = kind(offset);
+        auto expr = m_allocator.alloc<node_expr>();
+        switch (record_kind) {
+        case ast_kind::add:
+            expr->var = read_binary<node_binary_expr_add>(offset);
+            return expr;
+        case ast_kind::multiply:
+            expr->var = read_binary<node_binary_expr_multiply>(offset);
+            return expr;
+        case ast_kind::minus:
+            expr->var = read_binary<node_binary_expr_minus>(offset);
+            return expr;
+        case ast_kind::divide:
+            expr->var = read_binary<node_binary_expr_divide>(offset);
+            return expr;
+        case ast_kind::modulus:
+            expr->var = read_binary<node_binary_expr_modulus>(offset);
+            return expr;
+        case ast_kind::and_:
+            expr->var = read_binary<node_binary_expr_and>(offset);
+            return expr;
+        case ast_kind::or_:
+            expr->var = read_binary<node_binary_expr_or>(offset);
+            return expr;
+        case ast_kind::compare: {
+            if (flags(offset) > static_cast<uint32_t>(compare_op::ge)) {
+                corrupt();
+            }
+            node_binary_expr *bin_expr = read_binary<node_binary_expr_compare>(offset);
+            std::get<node_binary_expr_compare *>(bin_expr->var)->op = static_cast<compare_op>(flags(offset));
+            expr->var = bin_expr;
+            return expr;
+        }
+        default:
+            break;
+        }
+
+        auto term = m_allocator.alloc<node_term>();
+        switch (record_kind) {
+        case ast_kind::int_lit: {
+            auto term_int_lit = m_allocator.alloc<node_term_int_lit>();
+            term_int_lit->int_lit = read_token(field(offset, 1), tokentype::int_lit);
+            term->var = term_int_lit;
+            break;
+        }
+        case ast_kind::identifier: {
+            auto term_ident = m_allocator.alloc<node_term_identifier>();
+            term_ident->identifier = read_token(field(offset, 1), tokentype::ident);
+            term->var = term_ident;
+            break;
+        }
+        case ast_kind::parentheses: {
+            auto term_paren = m_allocator.alloc<node_term_parentheses>();
+            queue_expr(field(offset, 1), &term_paren->expr);
+            term->var = term_paren;
+            break;
+        }
+        case ast_kind::call: {
+            auto term_call = m_allocator.alloc<node_term_call>();
+            term_call->ident = read_token(field(offset, 1), tokentype::ident);
+            term_call->is_tail = flags(offset) != 0;
+            uint64_t args = field(offset, 2);
+            term_call->args.resize(m_allocator, list_size(args));
+            for (size_t i = 0; i < term_call->args.size(); ++i) {
+                queue_expr(word(args + 8 + i * 8), &term_call->args[i]);
+            }
+            term->var = term_call;
+            break;
+        }
+        case ast_kind::index: {
+            auto term_index = m_allocator.alloc<node_term_index>();
+            term_index->ident = read_token(field(offset, 1), tokentype::ident);
+            queue_expr(field(offset, 2), &term_index->index);
+            term->var = term_index;
+            break;
+        }
+        case ast_kind::not_: {
+            auto term_not = m_allocator.alloc<node_term_not>();
+            queue_expr(field(offset, 1), &term_not->expr);
+            term->var = term_not;
+            break;
+        }
+        default:
+            corrupt();
+        }
+        expr->var = term;
+        return expr;
+    }
+
+    template <typename T> node_binary_expr *read_binary(uint64_t offset) {
+        auto node = m_allocator.alloc<T>();
+        queue_expr(field(offset, 1), &node->lhs);
+        queue_expr(field(offset, 2), &node->rhs);
+        auto bin_expr = m_allocator.alloc<node_binary_expr>();
+        bin_expr->var = node;
+        return bin_expr;
+    }
+
+    storage_allocator &m_allocator;
+    node_program *m_prog = nullptr;
+    const uint64_t *m_words = nullptr; // The mapped file, which names in the tree point into
+    size_t m_size = 0;                 // In bytes
+    uint64_t m_budget = 0;             // Records that may still be built, see kind
+    std::vector<pending> m_pending;    // Records not built yet
+    std::mutex m_mutex;                // Held while building a function body
+};
@@ -0,0 +1,72 @@
+// Times tokenizing and parsing many files in one process, as a batch build or the compile server does, with a
+// fresh arena for every file, with arenas reused from a pool, and with pooled arenas whose blocks are pre-faulted
+// on huge pages. Every way must parse each file into the same number of statements.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../compilation.hpp"
+
+// A file of functions with loops, branches and calls, different for every seed
+static std::string program(int seed, int functions) {
+    std::string source;
+    for (int i = 0; i < functions; ++i) {
+        std::string n = std::to_string(seed * functions + i);
+        source += "fn f" + n + "(a, b) {\n"
+                  "    let v[8]; let i = 0; let s = a + " + n + ";\n"
+                  "    while (i < 8) { v[i] = i * b; s = s + v[i] % 7; i = i + 1; }\n"
+                  "    if (s > a && b != 0) { s = s - b; } else { s = s * 2; }\n"
+                  "    return s;\n}\n";
+    }
+    return source + "exit(0);\n";
+}
+
+template <typename F> static double time_ms(F &&body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    constexpr int files = 2000;
+    std::vector<std::string> sources;
+    for (int i = 0; i < files; ++i) {
+        sources.push_back(program(i, 200));
+    }
+
+    struct setup {
+        const char *name;
+        arena_pool pool;
+    };
+    setup setups[] = {
+        {"fresh arenas", arena_pool(1024 * 1024 * 4, {}, 0)}, // Keeps none, so every file allocates anew
+        {"pooled", arena_pool(1024 * 1024 * 4)},
+        {"pooled, populated", arena_pool(1024 * 1024 * 4, {.populate = true, .huge_pages = true})},
+    };
+
+    bool mismatch = false;
+    std::vector<size_t> statements(files, 0);
+    std::printf("%-20s %12s %12s %10s %12s %12s\n", "arenas", "total (ms)", "us/file", "arenas", "high water",
+                "KiB held");
+    for (setup &s : setups) {
+        double ms = time_ms([&] {
+            for (int i = 0; i < files; ++i) {
+                compilation unit(sources[i], s.pool);
+                size_t count = unit.parse(1).stmts.size();
+                if (statements[i] != 0 && statements[i] != count) {
+                    mismatch = true;
+                }
+                statements[i] = count;
+            }
+        });
+        arena_pool::stats stats = s.pool.statistics();
+        std::printf("%-20s %12.2f %12.1f %10zu %12zu %12zu\n", s.name, ms, ms * 1000 / files, stats.arenas,
+                    stats.high_water, stats.reserved / 1024);
+    }
+    if (mismatch) {
+        std::printf("  parses differ between arena setups\n");
+    }
+    return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
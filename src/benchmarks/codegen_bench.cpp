@@ -0,0 +1,56 @@
+// Times code generation for programs of many functions on one thread and on several. Function bodies are
+// generated as independent units and appended in order, so every thread count must give the same assembly.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "../compilation.hpp"
+#include "../generation.hpp"
+
+// Functions with loops, branches, arrays, matches and calls, then a main program calling a few of them
+static std::string program(int functions) {
+    std::string source;
+    for (int i = 0; i < functions; ++i) {
+        std::string n = std::to_string(i);
+        source += "fn f" + n + "(a, b) {\n"
+                  "    let v[16]; let i = 0; let s = a;\n"
+                  "    while (i < 16) { v[i] = i * b + " + n + "; s = s + v[i] % 7; i = i + 1; }\n"
+                  "    if (s > a && b != 0) { s = s - b; } else if (s < 3) { s = s + 1; } else { s = s * 2; }\n"
+                  "    match (s % 5) { 0 => { s = s + 1; } 1 => { s = s + 2; } 2 => { s = s + 4; } "
+                  "3 => { s = s + 8; } _ => { } }\n";
+        source += i > 0 ? "    return f" + std::to_string(i - 1) + "(s % 3, b) + s;\n}\n" : "    return s;\n}\n";
+    }
+    return source + "exit(f" + std::to_string(functions - 1) + "(1, 2) % 256);\n";
+}
+
+template <typename F> static double time_ms(F &&body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    const unsigned threads = std::max(std::thread::hardware_concurrency(), 4u);
+    bool mismatch = false;
+    std::string threads_column = std::to_string(threads) + " threads";
+    std::printf("%-18s %12s %12s %12s\n", "functions", "KiB of asm", "1 thread", threads_column.c_str());
+    for (int functions : {1000, 5000, 20000}) {
+        std::string source = program(functions);
+        compilation unit{std::move(source)};
+        node_program *prog = &unit.parse();
+
+        asm_buffer sequential;
+        asm_buffer parallel;
+        double sequential_ms = time_ms([&] { generator(*prog, {.threads = 1}).generate_program(sequential); });
+        double parallel_ms = time_ms([&] { generator(*prog, {.threads = threads}).generate_program(parallel); });
+
+        std::printf("%-18d %12zu %12.2f %12.2f\n", functions, sequential.size() / 1024, sequential_ms, parallel_ms);
+        if (sequential.view() != parallel.view()) {
+            std::printf("  output differs between thread counts\n");
+            mismatch = true;
+        }
+    }
+    return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,72 @@
+// Compares the bytecode interpreter (--interp) with native code on a few workloads. Native code is assembled
+// in-process the way --run does it, so neither side pays for nasm, ld or a fork. Each timing covers compiling
+// the parsed program and running it.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "../compilation.hpp"
+#include "../generation.hpp"
+#include "../jit.hpp"
+#include "../interp.hpp"
+
+struct workload {
+    const char *name;
+    const char *source;
+    int repeat; // Compile-and-run cycles per timing
+};
+
+static const workload workloads[] = {
+    {"tiny program", "let x = 6; let y = x * 7; if (y > 40) { exit(y); } exit(0);", 2000},
+    {"counting loop", "let i = 0; let s = 0; while (i < 5000000) { s = s + i % 7; i = i + 1; } exit(s % 256);", 1},
+    {"recursive calls",
+     "fn fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); } exit(fib(27) % 256);", 1},
+    {"tail calls", "fn count(n, acc) { if (n == 0) { return acc; } return count(n - 1, acc + n); } "
+                   "exit(count(5000000, 0) % 256);",
+     1},
+    {"array loop",
+     "let a[64]; let r = 0; let s = 0; while (r < 20000) { let i = 0; "
+     "while (i < 64) { a[i] = a[i] + i; i = i + 1; } r = r + 1; } s = a[63]; exit(s % 256);",
+     1},
+};
+
+template <typename F> static double time_ms(int repeat, F &&body) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i) {
+        body();
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    bool mismatch = false;
+    std::printf("%-18s %14s %14s %10s\n", "workload", "interp (ms)", "native (ms)", "ratio");
+    for (const workload &w : workloads) {
+        compilation unit{w.source};
+        node_program *prog = &unit.parse();
+
+        int64_t interp_status = 0;
+        double interp_ms = time_ms(w.repeat, [&] {
+            bytecode_program bytecode = bytecode_compiler(*prog).compile_program();
+            interp_status = interpreter(bytecode).run();
+        });
+
+        int64_t native_status = 0;
+        double native_ms = time_ms(w.repeat, [&] {
+            generator obj_generator(*prog, generator_options{.jit = true});
+            asm_buffer output;
+            obj_generator.generate_program(output);
+            native_status = jit(output.view()).run();
+        });
+
+        std::printf("%-18s %14.3f %14.3f %9.2fx\n", w.name, interp_ms / w.repeat, native_ms / w.repeat,
+                    interp_ms / native_ms);
+        if ((interp_status & 0xff) != (native_status & 0xff)) {
+            std::printf("  exit status differs: interp %lld, native %lld\n", static_cast<long long>(interp_status),
+                        static_cast<long long>(native_status));
+            mismatch = true;
+        }
+    }
+    return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+// Times tokenizing and parsing single expressions of a million terms, both long flat chains of operators and
+// nesting a million levels deep. The expression parser keeps its state on explicit stacks, so the deep cases
+// must finish with the default native stack; each parsed tree is walked to check no term went missing.
+// Then times a program of many top-level statements parsed on one thread and on several, checking both parses
+// generate the same assembly.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../compilation.hpp"
+#include "../generation.hpp"
+
+constexpr int terms = 1000000;
+
+struct workload {
+    const char *name;
+    std::string source;
+    int leaves; // Terms the walk should find: brackets and '!' only wrap the single innermost one
+};
+
+static std::string flat(const char *op) {
+    std::string source = "exit(1";
+    for (int i = 1; i < terms; ++i) {
+        source += op;
+        source += std::to_string(i % 100);
+    }
+    return source + ");";
+}
+
+static std::string mixed() {
+    static const char *ops[] = {" + ", " * ", " - ", " / ", " < ", " && ", " % ", " || ", " == "};
+    std::string source = "exit(x";
+    for (int i = 1; i < terms; ++i) {
+        source += ops[i % 9];
+        source += i % 3 == 0 ? "x" : std::to_string(i % 100 + 1);
+    }
+    return source + ");";
+}
+
+// The term wrapped in a million levels of open ... close, e.g. 1 + (1 + (1))
+static std::string nested(const char *open, const char *term, const char *close) {
+    std::string source = "exit(";
+    for (int i = 1; i < terms; ++i) {
+        source += open;
+    }
+    source += term;
+    for (int i = 1; i < terms; ++i) {
+        source += close;
+    }
+    return source + ");";
+}
+
+// Top-level statements of every kind, with functions, else-if chains, loops and matches between plain statements
+static std::string program(int statements) {
+    std::string source;
+    for (int i = 0; i < statements; ++i) {
+        std::string n = std::to_string(i);
+        switch (i % 6) {
+        case 0:
+            source += "fn f" + n + "(a, b) { if (a < b) { return a * 2 + b; } return f" + n + "(a - b, b); }\n";
+            break;
+        case 1:
+            source += "let x" + n + " = f" + std::to_string(i - 1) + "(" + n + ", 3) % 7;\n";
+            break;
+        case 2:
+            source += "if (x" + std::to_string(i - 1) + " == 1) { exit(1); } else if (x" + std::to_string(i - 1) +
+                      " > 4) { let y = 2; } else { let y = 3; }\n";
+            break;
+        case 3:
+            source += "let i" + n + " = 0;\nwhile (i" + n + " < 3) { i" + n + " = i" + n + " + 1; }\n";
+            break;
+        case 4:
+            source += "match (i" + std::to_string(i - 1) + ") { 1 => { exit(2); } 3 => { } _ => { exit(4); } }\n";
+            break;
+        default:
+            source += "{ let z = (x" + std::to_string(i - 4) + " + 1) * (i" + std::to_string(i - 2) + " - 1); }\n";
+            break;
+        }
+    }
+    return source + "exit(0);\n";
+}
+
+// Assembly for a parsed program, to compare two parses by
+static std::string assembly(node_program *prog) {
+    asm_buffer output;
+    generator(*prog, {}).generate_program(output);
+    return std::string(output.view());
+}
+
+// Counts the leaf terms under an expression without recursing
+static size_t count_terms(const node_expr *root) {
+    size_t count = 0;
+    std::vector<const node_expr *> pending = {root};
+    while (!pending.empty()) {
+        const node_expr *expr = pending.back();
+        pending.pop_back();
+        if (auto bin = std::get_if<node_binary_expr *>(&expr->var)) {
+            std::visit([&](auto *node) { pending.insert(pending.end(), {node->rhs, node->lhs}); }, (*bin)->var);
+            continue;
+        }
+        const node_term *term = std::get<node_term *>(expr->var);
+        if (auto paren = std::get_if<node_term_parentheses *>(&term->var)) {
+            pending.push_back((*paren)->expr);
+        } else if (auto negated = std::get_if<node_term_not *>(&term->var)) {
+            pending.push_back((*negated)->expr);
+        } else if (auto call = std::get_if<node_term_call *>(&term->var)) {
+            ++count;
+            pending.insert(pending.end(), (*call)->args.rbegin(), (*call)->args.rend());
+        } else if (auto index = std::get_if<node_term_index *>(&term->var)) {
+            ++count;
+            pending.push_back((*index)->index);
+        } else {
+            ++count;
+        }
+    }
+    return count;
+}
+
+template <typename F> static double time_ms(F &&body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    const workload workloads[] = {
+        {"a + b + ...", flat(" + "), terms},
+        {"a * b * ...", flat(" * "), terms},
+        {"mixed operators", mixed(), terms},
+        {"a + (b + (...))", nested("1 + (", "1", ")"), terms},
+        {"((((a))))", nested("(", "1", ")"), 1},
+        {"!!!!a", nested("!", "1", ""), 1},
+        {"f(f(f(a)))", nested("f(", "1", ")"), terms},
+        {"a[a[a[0]]]", nested("a[", "0", "]"), terms},
+    };
+
+    bool mismatch = false;
+    std::printf("%-18s %12s %12s %12s\n", "workload", "lex (ms)", "parse (ms)", "ns/term");
+    for (const workload &w : workloads) {
+        compilation unit{w.source};
+        double lex_ms = time_ms([&] { unit.tokenize(); });
+
+        node_program *prog = nullptr;
+        double parse_ms = time_ms([&] { prog = &unit.parse(); });
+
+        std::printf("%-18s %12.2f %12.2f %12.1f\n", w.name, lex_ms, parse_ms, parse_ms * 1e6 / terms);
+        const node_expr *expr = std::get<node_statement_exit>(prog->stmts[0]->var).expr;
+        if (size_t parsed = count_terms(expr); parsed != static_cast<size_t>(w.leaves)) {
+            std::printf("  parsed %zu terms, expected %d\n", parsed, w.leaves);
+            mismatch = true;
+        }
+    }
+
+    // Parallel parsing only pays off on inputs too large to generate code for here in reasonable time, so the
+    // timing uses a large program and the comparison a smaller one
+    const unsigned threads = std::max(std::thread::hardware_concurrency(), 4u);
+    std::string threads_column = std::to_string(threads) + " threads";
+    std::printf("\n%-18s %12s %12s %12s\n", "program", "lex (ms)", "1 thread", threads_column.c_str());
+    for (int statements : {60000, 500000}) {
+        std::string source = program(statements);
+        compilation unit{std::move(source)};
+        double lex_ms = time_ms([&] { unit.tokenize(); });
+
+        // Both parse the same tokens, into separate arenas
+        storage_allocator sequential_nodes(1024 * 1024 * 4);
+        storage_allocator parallel_nodes(1024 * 1024 * 4);
+        parser sequential(unit.tokens(), sequential_nodes);
+        parser parallel(unit.tokens(), parallel_nodes);
+        node_program *sequential_prog = nullptr;
+        node_program *parallel_prog = nullptr;
+        double sequential_ms = time_ms([&] { sequential_prog = sequential.parse_prog(1).value(); });
+        double parallel_ms = time_ms([&] { parallel_prog = parallel.parse_prog(threads).value(); });
+
+        std::string name = std::to_string(statements) + " statements";
+        std::printf("%-18s %12.2f %12.2f %12.2f\n", name.c_str(), lex_ms, sequential_ms, parallel_ms);
+        if (sequential_prog->stmts.size() != parallel_prog->stmts.size() ||
+            (statements <= 60000 && assembly(sequential_prog) != assembly(parallel_prog))) {
+            std::printf("  parallel parse differs from the sequential one\n");
+            mismatch = true;
+        }
+    }
+    return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+// Measures the code querk generates rather than querk itself. Every program of a corpus is compiled under each of
+// several sets of flags, assembled and linked with nasm and ld as querk does, and run a number of times. Hardware
+// counters for the program alone (instructions, cycles, branch misses, L1d read misses) come from perf_event_open,
+// counting from the exec on; where the kernel allows no counters, only wall-clock time is taken, which includes
+// starting the process. Each set of flags is reported against the first, and a program exiting with a different
+// status under some flags is an error.
+//
+//   ./querk_runbench [--runs=N] [--config="FLAGS"]... [program.qrk]...
+//
+// Without programs, the corpus in benchmarks/corpus is run. Without --config, the default flags are compared with
+// --no-cmov, --no-bounds-check and --target=scalar.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <linux/perf_event.h> // For the counter attributes
+#include <sys/syscall.h>      // For SYS_perf_event_open, which has no libc wrapper
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../querk.hpp"
+
+// Counters read for every run, in the order they are printed
+struct counter_spec {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const counter_spec counters[] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1d misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+constexpr size_t counter_count = sizeof(counters) / sizeof(counters[0]);
+
+// One run of a program
+struct measurement {
+    int status = 0; // Exit status, or 128 plus the signal that ended it
+    double wall_ms = 0;
+    std::optional<double> counts[counter_count]; // Unset where the counter could not be opened
+};
+
+// A program compiled under one set of flags, and the medians of its runs
+struct result {
+    int status = 0;
+    double wall_ms = 0;
+    std::optional<double> counts[counter_count];
+};
+
+// Counter for process pid, off until it execs. -1 with errno set if the kernel refuses it.
+static int open_counter(const counter_spec &spec, pid_t pid) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = spec.type;
+    attr.config = spec.config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0));
+}
+
+// Count of an open counter, scaled up for the time the kernel had it multiplexed out
+static std::optional<double> read_counter(int fd) {
+    uint64_t values[3]; // Value, time enabled, time running
+    if (read(fd, values, sizeof(values)) != static_cast<ssize_t>(sizeof(values)) || values[2] == 0) {
+        return std::nullopt;
+    }
+    return static_cast<double>(values[0]) * static_cast<double>(values[1]) / static_cast<double>(values[2]);
+}
+
+// Runs the executable at path once. The child waits on a pipe until its counters are attached, so they see the
+// exec and nothing before it.
+static std::optional<measurement> run_once(const std::string &path, std::string &counter_error) {
+    int ready[2];
+    if (pipe(ready) != 0) {
+        return std::nullopt;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(ready[0]);
+        close(ready[1]);
+        return std::nullopt;
+    }
+    if (pid == 0) {
+        close(ready[1]);
+        char go;
+        if (read(ready[0], &go, 1) == 1) {
+            execl(path.c_str(), path.c_str(), static_cast<char *>(nullptr));
+        }
+        _exit(127);
+    }
+    close(ready[0]);
+
+    int fds[counter_count];
+    for (size_t i = 0; i < counter_count; ++i) {
+        fds[i] = open_counter(counters[i], pid);
+        if (fds[i] < 0 && counter_error.empty()) {
+            counter_error = std::string(counters[i].name) + ": " + std::strerror(errno);
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool started = write(ready[1], "x", 1) == 1;
+    close(ready[1]);
+    int wait_status = 0;
+    waitpid(pid, &wait_status, 0);
+    measurement m;
+    m.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    m.status = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 128 + WTERMSIG(wait_status);
+    for (size_t i = 0; i < counter_count; ++i) {
+        if (fds[i] >= 0) {
+            m.counts[i] = read_counter(fds[i]);
+            close(fds[i]);
+        }
+    }
+    if (!started) {
+        return std::nullopt;
+    }
+    return m;
+}
+
+static double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 == 1 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+// Compiles the program at source_path with the given flags into dir/name, as querk would into out
+static bool build(const std::string &source_path, const std::vector<std::string> &flags, const std::string &dir,
+                  const std::string &name) {
+    generator_options options;
+    for (const std::string &flag : flags) {
+        if (!parse_option(flag, options)) {
+            std::fprintf(stderr, "Error: Unsupported option %s\n", flag.c_str());
+            return false;
+        }
+    }
+    std::ifstream input(source_path, std::ios::in | std::ios::binary);
+    std::stringstream contents;
+    contents << input.rdbuf();
+    if (!input) {
+        std::fprintf(stderr, "Error: Unable to open file %s\n", source_path.c_str());
+        return false;
+    }
+    compile_result compiled = compile_file(contents.str(), source_path, options);
+    for (const diagnostic &diag : compiled.diagnostics) {
+        std::fprintf(stderr, "%s: %s\n", source_path.c_str(), diag.message.c_str());
+    }
+    if (!compiled.ok()) {
+        return false;
+    }
+    const std::string base = dir + "/" + name;
+    std::ofstream(base + ".asm", std::ios::binary) << compiled.assembly->view();
+    std::string commands = "nasm -f elf64 '" + base + ".asm' -o '" + base + ".o' && ld -o '" + base + "' '" + base +
+                           ".o'";
+    for (const std::string &object : compiled.objects) {
+        commands += " '" + object + "'";
+    }
+    return system(commands.c_str()) == 0;
+}
+
+// Flags of a --config, split at spaces
+static std::vector<std::string> split_flags(const std::string &config) {
+    std::vector<std::string> flags;
+    std::istringstream words(config);
+    for (std::string flag; words >> flag;) {
+        flags.push_back(flag);
+    }
+    return flags;
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 10;
+    std::vector<std::string> configs;
+    std::vector<std::string> programs;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--runs=", 0) == 0) {
+            runs = std::atoi(arg.c_str() + 7);
+        } else if (arg.rfind("--config=", 0) == 0) {
+            configs.push_back(arg.substr(9));
+        } else if (arg.rfind("--", 0) == 0) {
+            std::fprintf(stderr, "querk_runbench [--runs=N] [--config=\"FLAGS\"]... [program.qrk]...\n");
+            return EXIT_FAILURE;
+        } else {
+            programs.push_back(arg);
+        }
+    }
+    if (runs < 1) {
+        std::fprintf(stderr, "Error: --runs must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (configs.empty()) {
+        configs = {"", "--no-cmov", "--no-bounds-check", "--target=scalar"};
+    }
+    if (programs.empty()) {
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator(QUERK_CORPUS, error)) {
+            if (entry.path().extension() == ".qrk") {
+                programs.push_back(entry.path().string());
+            }
+        }
+        std::sort(programs.begin(), programs.end());
+        if (programs.empty()) {
+            std::fprintf(stderr, "Error: No programs in %s\n", QUERK_CORPUS);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char dir[] = "/tmp/querk-runbench-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        std::fprintf(stderr, "Error: Unable to create a working directory\n");
+        return EXIT_FAILURE;
+    }
+
+    bool failed = false;
+    std::string counter_error; // Why the first counter that could not be opened was refused
+    std::printf("%-16s %-28s %6s %10s", "program", "flags", "status", "wall (ms)");
+    for (const counter_spec &spec : counters) {
+        std::printf(" %15s", spec.name);
+    }
+    std::printf(" %9s\n", "vs first");
+    for (const std::string &program : programs) {
+        // Every set of flags is built first and the runs then take turns, so drift in the machine's speed over
+        // the runs affects them all alike
+        std::vector<std::string> binaries(configs.size());
+        std::vector<std::vector<measurement>> measured(configs.size());
+        for (size_t c = 0; c < configs.size(); ++c) {
+            const std::string name = "p" + std::to_string(c);
+            if (build(program, split_flags(configs[c]), dir, name)) {
+                binaries[c] = std::string(dir) + "/" + name;
+                run_once(binaries[c], counter_error); // Warm-up, not counted
+            }
+        }
+        for (int i = 0; i < runs; ++i) {
+            for (size_t c = 0; c < configs.size(); ++c) {
+                if (binaries[c].empty()) {
+                    continue;
+                }
+                if (std::optional<measurement> m = run_once(binaries[c], counter_error)) {
+                    measured[c].push_back(*m);
+                }
+            }
+        }
+
+        std::vector<std::optional<result>> results;
+        for (size_t c = 0; c < configs.size(); ++c) {
+            for (const char *suffix : {"", ".o", ".asm"}) {
+                unlink((std::string(dir) + "/p" + std::to_string(c) + suffix).c_str());
+            }
+            if (measured[c].empty()) {
+                results.push_back(std::nullopt);
+                failed = true;
+                continue;
+            }
+
+            result r;
+            r.status = measured[c][0].status;
+            std::vector<double> values;
+            for (const measurement &m : measured[c]) {
+                values.push_back(m.wall_ms);
+                failed |= m.status != r.status; // The same binary should always exit the same way
+            }
+            r.wall_ms = median(values);
+            for (size_t i = 0; i < counter_count; ++i) {
+                values.clear();
+                for (const measurement &m : measured[c]) {
+                    if (m.counts[i].has_value()) {
+                        values.push_back(*m.counts[i]);
+                    }
+                }
+                if (values.size() == measured[c].size()) {
+                    r.counts[i] = median(values);
+                }
+            }
+            results.push_back(r);
+        }
+
+        // Compared by cycles where they were counted, by wall-clock time otherwise
+        const std::optional<result> &first = results[0];
+        std::string shown = std::filesystem::path(program).filename().string();
+        for (size_t c = 0; c < configs.size(); ++c) {
+            std::string flags = configs[c].empty() ? "(defaults)" : configs[c];
+            std::printf("%-16s %-28s", c == 0 ? shown.c_str() : "", flags.c_str());
+            if (!results[c].has_value()) {
+                std::printf(" %6s\n", "failed");
+                continue;
+            }
+            const result &r = *results[c];
+            std::printf(" %6d %10.2f", r.status, r.wall_ms);
+            for (size_t i = 0; i < counter_count; ++i) {
+                if (r.counts[i].has_value()) {
+                    std::printf(" %15.0f", *r.counts[i]);
+                } else {
+                    std::printf(" %15s", "-");
+                }
+            }
+            if (c > 0 && first.has_value()) {
+                bool by_cycles = r.counts[1].has_value() && first->counts[1].has_value();
+                double now = by_cycles ? *r.counts[1] : r.wall_ms;
+                double before = by_cycles ? *first->counts[1] : first->wall_ms;
+                std::printf(" %+8.1f%%", before > 0 ? (now / before - 1) * 100 : 0.0);
+                if (r.status != first->status) {
+                    std::printf("  exit status differs");
+                    failed = true;
+                }
+            }
+            std::printf("\n");
+        }
+    }
+    rmdir(dir);
+
+    if (!counter_error.empty()) {
+        std::printf("\nCounters shown as '-' were refused (%s); without cycles, flags are compared by wall-clock "
+                    "time\n",
+                    counter_error.c_str());
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,220 @@
+// Grows programs along one dimension at a time, from a thousand up to --max (default a million) and ten million
+// with --max=10000000, and times tokenizing, parsing and generating each size. Every size is compiled --repeat
+// times (default 5) and the fastest time of each phase kept, since a single timing of a few milliseconds is mostly
+// noise. The growth of every phase is fitted as time ~ n^k over the sizes that take at least 20 ms; a k above
+// --limit (default 1.3) means some path is super-linear, and the run fails unless --no-fit is given, which only
+// reports k. Sizes stop growing once a phase passes --budget seconds (default 20), so a regressed path cannot run
+// for hours.
+//
+//   statements   top-level assignments and ifs on one variable
+//   depth        ifs, whiles and bare scopes nested n deep
+//   nesting      one expression with n operators nested in parentheses, x + (x * (x - ...))
+//   width        one expression of n terms
+//   variables    n variables declared, then each one read
+//   else-ifs     one if with n-1 else-if arms
+//   functions    n functions, each calling the one before
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "../compilation.hpp"
+#include "../generation.hpp"
+
+static std::string statements(size_t n) {
+    std::string source = "let x = 0;\n";
+    for (size_t i = 0; i < n; ++i) {
+        source += i % 2 == 0 ? "x = x + " + std::to_string(i % 97) + ";\n" : "if (x > 1000) { x = x - 1000; }\n";
+    }
+    return source + "exit(x % 256);\n";
+}
+
+static std::string depth(size_t n) {
+    static const char *opens[] = {"if (x < 1000000) { ", "while (x < 0) { ", "{ "};
+    std::string source = "let x = 0;\n";
+    for (size_t i = 0; i < n; ++i) {
+        source += "x = x + 1; ";
+        source += opens[i % 3];
+    }
+    source += std::string(n, '}');
+    return source + "\nexit(x % 256);\n";
+}
+
+static std::string nesting(size_t n) {
+    static const char *ops[] = {" + (", " * (", " - ("};
+    std::string source = "let x = 3;\nexit((";
+    for (size_t i = 0; i < n; ++i) {
+        source += "x";
+        source += ops[i % 3];
+    }
+    source += "x" + std::string(n, ')');
+    return source + ") % 256);\n";
+}
+
+static std::string width(size_t n) {
+    static const char *ops[] = {" + ", " * ", " - ", " % ", " + "};
+    std::string source = "let x = 7;\nexit((x";
+    for (size_t i = 1; i < n; ++i) {
+        source += ops[i % 5];
+        source += i % 2 == 0 ? "x" : std::to_string(i % 89 + 2);
+    }
+    return source + ") % 256);\n";
+}
+
+static std::string variables(size_t n) {
+    std::string source = "let x = 0;\n";
+    for (size_t i = 0; i < n; ++i) {
+        source += "let v" + std::to_string(i) + " = x + " + std::to_string(i % 13) + ";\n";
+    }
+    for (size_t i = 0; i < n; ++i) {
+        source += "x = x + v" + std::to_string(i) + ";\n";
+    }
+    return source + "exit(x % 256);\n";
+}
+
+static std::string else_ifs(size_t n) {
+    std::string source = "let x = 5;\nlet y = 0;\n";
+    for (size_t i = 0; i < n; ++i) {
+        source += i == 0 ? "if" : " else if";
+        source += " (x == " + std::to_string(i) + ") { y = " + std::to_string(i % 200) + "; }";
+    }
+    return source + "\nexit(y);\n";
+}
+
+static std::string functions(size_t n) {
+    std::string source = "fn f0(a) { return a; }\n";
+    for (size_t i = 1; i < n; ++i) {
+        source += "fn f" + std::to_string(i) + "(a) { return f" + std::to_string(i - 1) + "(a) + 1; }\n";
+    }
+    return source + "exit(f" + std::to_string(n - 1) + "(0) % 256);\n";
+}
+
+template <typename F> static double time_ms(F &&body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+constexpr int phases = 3;
+static const char *phase_names[phases] = {"tokenize", "parse", "generate"};
+
+// Least-squares slope of log(ms) over log(n), for the points timed long enough to be above the clock's noise
+static std::optional<double> exponent(const std::vector<size_t> &sizes, const std::vector<double> &ms) {
+    constexpr double floor_ms = 20;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int points = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        if (ms[i] < floor_ms) {
+            continue;
+        }
+        double x = std::log(static_cast<double>(sizes[i]));
+        double y = std::log(ms[i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        ++points;
+    }
+    if (points < 2) {
+        return {};
+    }
+    return (points * sxy - sx * sy) / (points * sxx - sx * sx);
+}
+
+int main(int argc, char **argv) {
+    size_t max = 1000000;
+    int repeat = 5;
+    double limit = 1.3;
+    bool fit = true;
+    double budget_ms = 20000;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.starts_with("--max=")) {
+            max = static_cast<size_t>(std::stod(arg.substr(6)));
+        } else if (arg.starts_with("--repeat=") && std::stoi(arg.substr(9)) > 0) {
+            repeat = std::stoi(arg.substr(9));
+        } else if (arg.starts_with("--limit=")) {
+            limit = std::stod(arg.substr(8));
+        } else if (arg == "--no-fit") {
+            fit = false;
+        } else if (arg.starts_with("--budget=")) {
+            budget_ms = std::stod(arg.substr(9)) * 1000;
+        } else {
+            std::fprintf(stderr, "usage: %s [--max=N] [--repeat=N] [--limit=K] [--no-fit] [--budget=SECONDS]\n",
+                         argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct dimension {
+        const char *name;
+        std::string (*program)(size_t);
+    };
+    const dimension dimensions[] = {
+        {"statements", statements}, {"depth", depth},       {"nesting", nesting},     {"width", width},
+        {"variables", variables},   {"else-ifs", else_ifs}, {"functions", functions},
+    };
+
+    bool failed = false;
+    std::printf("%-12s %10s %12s %12s %12s\n", "dimension", "n", "tokenize", "parse", "generate");
+    for (const dimension &dim : dimensions) {
+        std::vector<size_t> sizes;
+        std::vector<double> ms[phases];
+        for (size_t n = 1000; n <= max; n *= 10) {
+            for (size_t step : {n, n * 3}) {
+                if (step > max) {
+                    break;
+                }
+                std::string source = dim.program(step);
+                double times[phases] = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+                for (int r = 0; r < repeat; ++r) {
+                    compilation unit{source};
+                    asm_buffer output;
+                    times[0] = std::min(times[0], time_ms([&] { unit.tokenize(); }));
+                    times[1] = std::min(times[1], time_ms([&] { unit.parse(); }));
+                    times[2] = std::min(times[2], time_ms([&] { generator(unit.program()).generate_program(output); }));
+                    if (times[0] > budget_ms || times[1] > budget_ms || times[2] > budget_ms) {
+                        break; // One slow run is enough to stop at
+                    }
+                }
+                sizes.push_back(step);
+                std::printf("%-12s %10zu", dim.name, step);
+                for (int p = 0; p < phases; ++p) {
+                    ms[p].push_back(times[p]);
+                    std::printf(" %12.2f", times[p]);
+                }
+                std::printf("\n");
+                std::fflush(stdout);
+                if (times[0] > budget_ms || times[1] > budget_ms || times[2] > budget_ms) {
+                    n = max; // Out of time: fit what there is
+                    break;
+                }
+            }
+        }
+
+        std::printf("%-12s %10s", dim.name, "n^k: k =");
+        std::string slow;
+        for (int p = 0; p < phases; ++p) {
+            std::optional<double> k = exponent(sizes, ms[p]);
+            if (k.has_value()) {
+                std::printf(" %12.2f", k.value());
+            } else {
+                std::printf(" %12s", "too fast");
+            }
+            if (k.has_value() && k.value() > limit) {
+                slow += std::string(slow.empty() ? "" : ", ") + phase_names[p];
+            }
+        }
+        std::printf("\n");
+        if (!slow.empty()) {
+            std::printf("  super-linear in %s: %s\n", dim.name, slow.c_str());
+            failed |= fit;
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
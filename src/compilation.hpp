@@ -0,0 +1,99 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ast_file.hpp"
+#include "diagnostics.hpp"
+#include "parser.hpp"
+#include "storage.hpp"
+#include "tokenization.hpp"
+
+// ============================= COMPILATION =============================
+
+// Arenas every compilation takes its nodes from unless given a pool of its own, so compiling many files in one
+// process, as a batch build or the compile server does, reuses the same blocks
+inline arena_pool &node_arenas() {
+    static arena_pool pool(1024 * 1024 * 4);
+    return pool;
+}
+
+// Everything one source file becomes on its way to code: the source text, its tokens, the interned spellings
+// they name and the tree parsed from them. Each phase borrows what the one before left here instead of taking
+// it over, so nothing is copied from phase to phase, and the tree stays valid for as long as this object lives.
+// It neither moves nor copies, since tokens and nodes point into it.
+class compilation {
+  public:
+    // The arena comes from arenas and goes back there, reset, with the compilation. Spellings are taken from
+    // shared_symbols, if given, which must outlive the compilation.
+    inline explicit compilation(std::string source, arena_pool &arenas = node_arenas(),
+                                shared_symbol_interner *shared_symbols = nullptr)
+        : m_source(std::move(source)), m_symbols(shared_symbols), m_arena(arenas.acquire()) {}
+
+    // For a tree loaded from an AST file
+    inline explicit compilation(arena_pool &arenas = node_arenas()) : m_arena(arenas.acquire()) {}
+
+    inline compilation(const compilation &) = delete;
+    inline compilation &operator=(const compilation &) = delete;
+
+    // Splits the source into tokens, once
+    inline const std::vector<token> &tokenize() {
+        if (!m_tokenized) {
+            m_tokens = tokenizer(m_source, m_symbols).tokenize();
+            m_tokenized = true;
+        }
+        return m_tokens;
+    }
+
+    // Builds the tree from the tokens, tokenizing first if that has not been done
+    inline node_program &parse(unsigned threads = std::thread::hardware_concurrency()) {
+        tokenize();
+        std::optional<node_program *> prog = parser(m_tokens, *m_arena).parse_prog(threads);
+        if (!prog.has_value()) {
+            report_error("Error: Ivalid Program");
+        }
+        m_prog = prog.value();
+        return *m_prog;
+    }
+
+    // Builds the tree from an AST file instead, leaving the source and tokens empty. The file stays mapped, since
+    // names in the tree point into it.
+    inline node_program &load_ast(const std::string &path) {
+        m_ast.emplace(path, *m_arena);
+        m_prog = m_ast->program();
+        return *m_prog;
+    }
+
+    inline const std::string &source() const {
+        return m_source;
+    }
+
+    inline const std::vector<token> &tokens() const {
+        return m_tokens;
+    }
+
+    // The tree, which parse or load_ast must have built
+    inline node_program &program() const {
+        return *m_prog;
+    }
+
+    inline storage_allocator &arena() {
+        return *m_arena;
+    }
+
+    inline symbol_interner &symbols() {
+        return m_symbols;
+    }
+
+  private:
+    std::string m_source;                       // Read by the tokenizer in place
+    symbol_interner m_symbols;                  // Spellings the tokens and nodes point to
+    std::vector<token> m_tokens;                // Read by the parser in place
+    bool m_tokenized = false;
+    arena_pool::lease m_arena;                  // Nodes of the tree, and of the parser's workers in its forks
+    std::optional<ast_reader> m_ast;            // The AST file the tree was loaded from, if it was
+    node_program *m_prog = nullptr;
+};
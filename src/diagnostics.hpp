@@ -0,0 +1,19 @@
+#pragma once
+
+#include <sstream>   // For building the message
+#include <stdexcept> // For std::runtime_error
+#include <string>
+
+// Error in the program being compiled. The tokenizer, parser and generator throw it instead of exiting, so one
+// process can compile many programs; compile_source (querk.hpp) turns it into a diagnostic value.
+class compile_error : public std::runtime_error {
+  public:
+    inline explicit compile_error(const std::string &message) : std::runtime_error(message) {}
+};
+
+// Throws a compile_error whose message is the arguments streamed one after another
+template <typename... Args> [[noreturn]] inline void report_error(const Args &...args) {
+    std::ostringstream message;
+    (message << ... << args);
+    throw compile_error(message.str());
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <charconv>    // For std::to_chars
+#include <cstdint>     // For int64_t
+#include <cstdlib>     // For malloc, realloc and free
+#include <cstring>     // For memcpy
+#include <string_view> // For borrowed text operands
+#include <type_traits> // For std::is_integral_v
+#include <utility>     // For std::swap
+#include <unistd.h>    // For write
+#include <cerrno>
+
+// Stack slot operand, printed as "QWORD [rsp + offset]"
+struct stack_slot {
+    size_t offset; // In bytes from RSP
+};
+
+// Memory operand "[base + index*8 + offset]", or "[base + index*8 - offset]" for a negative one, prefixed with
+// "QWORD " when sized
+struct memory_operand {
+    std::string_view base;  // Register or label
+    std::string_view index; // Register scaled by 8, empty for none
+    int64_t offset;         // In bytes
+    bool sized;
+};
+
+// Growable byte buffer that assembly text is appended to. Numbers are formatted with std::to_chars directly into
+// the buffer, so once it has grown to size emitting an instruction costs no allocations.
+class asm_buffer {
+  public:
+    inline explicit asm_buffer(size_t capacity = 1 << 16) : m_capacity(capacity) {
+        m_data = reinterpret_cast<char *>(malloc(m_capacity));
+    }
+
+    inline asm_buffer(const asm_buffer &) = delete;
+    inline asm_buffer &operator=(const asm_buffer &) = delete;
+
+    inline asm_buffer(asm_buffer &&other) noexcept
+        : m_data(other.m_data), m_size(other.m_size), m_capacity(other.m_capacity) {
+        other.m_data = nullptr;
+        other.m_size = 0;
+        other.m_capacity = 0;
+    }
+
+    inline asm_buffer &operator=(asm_buffer &&other) noexcept {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_capacity, other.m_capacity);
+        return *this;
+    }
+
+    inline ~asm_buffer() {
+        free(m_data);
+    }
+
+    inline asm_buffer &operator<<(std::string_view text) {
+        reserve(text.size());
+        memcpy(m_data + m_size, text.data(), text.size());
+        m_size += text.size();
+        return *this;
+    }
+
+    inline asm_buffer &operator<<(const char *text) {
+        return *this << std::string_view(text);
+    }
+
+    inline asm_buffer &operator<<(char c) {
+        reserve(1);
+        m_data[m_size++] = c;
+        return *this;
+    }
+
+    template <typename T> inline std::enable_if_t<std::is_integral_v<T>, asm_buffer &> operator<<(T value) {
+        reserve(20); // Longest 64-bit integer, "-9223372036854775808"
+        m_size = std::to_chars(m_data + m_size, m_data + m_capacity, value).ptr - m_data;
+        return *this;
+    }
+
+    inline asm_buffer &operator<<(stack_slot slot) {
+        return *this << "QWORD [rsp + " << slot.offset << ']';
+    }
+
+    inline asm_buffer &operator<<(const memory_operand &operand) {
+        if (operand.sized) {
+            *this << "QWORD ";
+        }
+        *this << '[' << operand.base;
+        if (!operand.index.empty()) {
+            *this << " + " << operand.index << "*8";
+        }
+        if (operand.offset > 0) {
+            *this << " + " << operand.offset;
+        } else if (operand.offset < 0) {
+            *this << " - " << -operand.offset;
+        }
+        return *this << ']';
+    }
+
+    inline size_t size() const {
+        return m_size;
+    }
+
+    // Text appended between two earlier size() readings
+    inline std::string_view view(size_t begin, size_t end) const {
+        return {m_data + begin, end - begin};
+    }
+
+    inline std::string_view view() const {
+        return view(0, m_size);
+    }
+
+    // Writes the whole buffer to a file descriptor, returning false on failure
+    inline bool write_to(int fd) const {
+        size_t written = 0;
+        while (written < m_size) {
+            ssize_t n = write(fd, m_data + written, m_size - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+  private:
+    inline void reserve(size_t extra) {
+        if (m_size + extra <= m_capacity) {
+            return;
+        }
+        while (m_size + extra > m_capacity) {
+            m_capacity = m_capacity > 0 ? m_capacity * 2 : 64; // A moved-from buffer starts again from nothing
+        }
+        m_data = reinterpret_cast<char *>(realloc(m_data, m_capacity));
+    }
+
+    char *m_data;
+    size_t m_size = 0;
+    size_t m_capacity;
+};
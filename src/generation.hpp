@@ -1,260 +1,2627 @@
 #pragma once // Ensures this header file is only included once during compilation
 
 #include "parser.hpp" // Includes the parser, which provides the AST (Abstract Syntax Tree)
-#include <sstream>    // Used to construct the output assembly as a string
+#include "emitter.hpp" // Buffer the output assembly is appended to
+#include <string_view> // Names point into the interner of the program
 #include <vector>     // Used for storing variables and their stack locations
 #include <assert.h>
 #include <algorithm>
+#include <cstdint>
+#include <charconv>      // For parsing immediates
+#include <unordered_map> // Block lookup by label
+#include <unordered_set> // Labels that are jumped to
+#include <atomic>        // For handing out function bodies
+#include <exception>     // For errors raised on worker threads
+#include <memory>        // For the worker generators
+#include <iterator>      // For std::back_inserter
+#include <thread>        // For generating function bodies in parallel
+
+// Instruction set used for vectorized loops
+enum class simd_target {
+    scalar, // No vectorization
+    sse2,   // 128-bit vectors, two 64-bit lanes (baseline x86-64)
+    avx2    // 256-bit vectors, four 64-bit lanes
+};
+
+// Options that change how code is generated
+struct generator_options {
+    bool bounds_checks = true;              // Guard array accesses whose index is not provably in range
+    bool cmov = true;                       // Lower simple conditional assignments without branching
+    simd_target target = simd_target::sse2; // Vector width for auto-vectorized loops
+    bool jit = false;                       // _start is called by the host and exit() returns to it
+    unsigned threads = 0;                   // Threads to parse and generate on, 0 for one per core
+};
+
+// Function defined in another module (see modules.hpp), linked in under its label fn_<name>
+struct extern_function {
+    std::string name;
+    size_t param_count;
+};
+
+// Number of threads the options ask for
+inline unsigned thread_count(const generator_options &options) {
+    return options.threads > 0 ? options.threads : std::max(std::thread::hardware_concurrency(), 1u);
+}
 
 // ============================= CODE GENERATOR CLASS =============================
 
 // The generator class converts the parsed AST into assembly code
 class generator {
+  private:
+    // Inclusive interval of values an expression can take at run time
+    struct value_range {
+        int64_t lo;
+        int64_t hi;
+    };
+
+    // Structure representing a variable in the symbol table
+    struct variable {
+        std::string_view name;             // Interned, see symbol_interner
+        int64_t offset;                    // From RBP in bytes, of element 0 for arrays (see CALL GENERATION)
+        size_t array_size = 0;             // Number of elements for arrays, 0 for scalars
+        std::string static_label;          // Set for static arrays, which live in .bss instead of on the stack
+        std::optional<value_range> range;  // Values the variable is known to hold at this point, if any
+
+        size_t slots() const {
+            if (!static_label.empty()) {
+                return 0;
+            }
+            return array_size > 0 ? array_size : 1;
+        }
+    };
+
+    struct static_array {
+        std::string label;
+        size_t size;
+    };
+
+    static constexpr char bounds_msg[] = "Error: array index out of bounds\n";
+
+    // How control leaves a basic block
+    enum class block_exit {
+        fall_through, // Into the next block
+        jump,         // jmp target
+        branch,       // jcc target, otherwise into the next block
+        stop          // Never continues (ret, exit syscall)
+    };
+
+    // A straight-line run of instructions with a single entry label and a known exit
+    struct basic_block {
+        std::string label;     // Empty when the block is only entered by falling into it
+        size_t code_begin = 0; // Body as a range of m_output
+        size_t code_end = 0;
+        block_exit exit = block_exit::fall_through;
+        std::string cc;     // Condition code of a branch, e.g. "ge"
+        std::string target; // Label a jump or branch goes to
+
+        bool empty() const {
+            return code_begin == code_end;
+        }
+    };
+
+    // Targets of an indirect 'jmp [label + rax*8]', emitted to .rodata
+    struct jump_table {
+        std::string label;
+        std::vector<std::string> targets;
+    };
+
+    // One step of expression generation, see run_expr_tasks
+    struct expr_task {
+        enum class kind {
+            value,         // Leave the value of expr in RAX
+            condition,     // Jump to label when the truth of expr equals jump_if, otherwise fall through
+            binary,        // Combine the operands of the arithmetic bin_expr, see queue_operands
+            compare,       // cmp the operands of the comparison bin_expr, then setcc or jump to label
+            spill,         // Store RAX in the next temporary, for the other operand to be computed
+            argument,      // Push RAX as the next argument of a call
+            logical_not,   // Replace RAX with 1 if it is 0, otherwise 0
+            logical_value, // Set RAX to 1 when falling through a condition, 0 when it jumped to label
+            call,          // Call function label once the arguments of the call in term are pushed
+            array_read,    // Replace the index in RAX with the element of the array read in term
+            test,          // Jump to label when the truth of RAX equals jump_if
+            label          // Place label
+        } kind;
+        const node_expr *expr = nullptr;
+        const node_binary_expr *bin_expr = nullptr;
+        const node_term *term = nullptr;
+        std::string label;
+        std::string end_label;     // Where a logical value continues after being materialised
+        bool jump_if = false;
+        bool bounds_check = false; // Whether an array read needs its index checked
+    };
+
+    // One step of the statement walk, see run_statement_tasks
+    struct statement_task {
+        enum class kind {
+            statement,  // Generate stmt
+            scope,      // Open scope and queue its statements
+            end_scope,  // Drop the variables of the innermost scope
+            if_then,    // The then-scope of stmt_if is done, labels[0] is where a false condition jumps
+            if_else,    // The else-scope of stmt_if is done, labels[0] follows it
+            while_body, // The body of stmt_while is done, labels are its body and condition
+            match_arm   // Arm index of stmt_match is done, labels are the arm labels then the end label
+        } kind;
+        const node_statement *stmt = nullptr;
+        const node_scope *scope = nullptr;
+        const node_statement_if *stmt_if = nullptr;
+        const node_statement_while *stmt_while = nullptr;
+        const node_statement_match *stmt_match = nullptr;
+        std::vector<std::string> labels;
+        size_t index = 0; // Arm of a match, or the induction variable of a while in m_variables (SIZE_MAX if none)
+    };
+
+    // Structure representing a function in the function table
+    struct function {
+        std::string_view name;
+        std::string label;
+        size_t param_count;
+    };
+
+    // A function body generated by a worker, as ranges of the worker's blocks, jump tables and static arrays
+    struct function_unit {
+        generator *worker = nullptr;
+        size_t blocks_begin = 0;
+        size_t blocks_end = 0;
+        size_t tables_begin = 0;
+        size_t tables_end = 0;
+        size_t statics_begin = 0;
+        size_t statics_end = 0;
+        std::exception_ptr error; // Set if generating the body failed
+    };
+
+    // Every scalar assignment in the program or a function body, in the order a walk of the tree meets them, so the
+    // ones inside any scope are a single run of them and nothing has to walk a scope again to learn what it assigns
+    struct assignment_index {
+        std::vector<std::string_view> names; // Scalar each assignment stores to
+        std::unordered_map<const node_scope *, std::pair<size_t, size_t>> scopes; // Run of names inside each scope
+        std::unordered_map<std::string_view, std::vector<size_t>> positions;     // Where each name is in names
+
+        // Assignments to name inside scope
+        size_t count(const node_scope *scope, std::string_view name) const {
+            auto it = positions.find(name);
+            if (it == positions.end()) {
+                return 0;
+            }
+            auto [begin, end] = scopes.at(scope);
+            return std::lower_bound(it->second.cbegin(), it->second.cend(), end) -
+                   std::lower_bound(it->second.cbegin(), it->second.cend(), begin);
+        }
+    };
+
+    // Slots a function or the program needs below RBP, see measure_frame
+    struct frame_size {
+        size_t locals = 0; // Most variable slots in scope at once
+        size_t temps = 0;  // Most operands spilled at once, kept below the locals
+    };
+
+    // The operand an instruction on RAX takes: a 32-bit immediate, a register or a memory operand
+    struct operand {
+        std::optional<int64_t> imm;
+        std::string_view reg;
+        memory_operand mem{};
+
+        friend asm_buffer &operator<<(asm_buffer &out, const operand &op) {
+            if (op.imm.has_value()) {
+                return out << op.imm.value();
+            }
+            return op.reg.empty() ? out << op.mem : out << op.reg;
+        }
+    };
+
   public:
-    // Constructor: Takes an AST (node_program) as input
-    explicit generator(node_program prog) : m_prog(std::move(prog)) {}
+    // Constructor: Borrows the AST (node_program), which must outlive the generator, and takes the functions of the
+    // modules it may call
+    explicit generator(const node_program &prog, generator_options options = {},
+                       std::vector<extern_function> externs = {})
+        : m_prog(prog), m_options(options), m_externs(std::move(externs)) {}
 
-    void generate_binary_expr(const node_binary_expr *bin_expr) {
-        struct binary_expr_visitor {
-            generator *gen;
+    // ============================= EXPRESSION GENERATION =============================
+
+    // Expressions are generated without recursion, so how deeply they nest is limited by memory rather than the
+    // native stack. Pending work lives on m_expr_tasks: visiting a node queues the step that finishes it and then
+    // its operands, so operands are generated first and in the order a recursive walk would take. Every value ends
+    // up in RAX; an operator takes a literal or scalar operand straight from its immediate or slot, and only when
+    // neither side is one does the RHS wait in a temporary of the frame while the LHS is computed.
+
+    // Function to generate assembly code for an expression, leaving its value in RAX
+    void generate_expr(const node_expr *expr) {
+        size_t base = m_expr_tasks.size();
+        m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = expr});
+        run_expr_tasks(base);
+    }
 
-            void operator()(const node_binary_expr_minus *minus) const {
-                gen->generate_expr(minus->rhs);
-                gen->generate_expr(minus->lhs);
-                gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    sub rax, rbx\n";
-                gen->push("rax");
-            }
-
-            void operator()(const node_binary_expr_add *add) const {
-                gen->generate_expr(add->rhs);
-                gen->generate_expr(add->lhs);
-                gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    add rax, rbx\n";
-                gen->push("rax");
-            }
-
-            void operator()(const node_binary_expr_multiply *multi) const {
-                gen->generate_expr(multi->rhs);
-                gen->generate_expr(multi->lhs);
-                gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    mul rbx\n";
-                gen->push("rax");
-            }
-
-            void operator()(const node_binary_expr_divide *div) const {
-                gen->generate_expr(div->rhs);
-                gen->generate_expr(div->lhs);
-                gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    div rbx\n";
-                gen->push("rax");
-            }
-            void operator()(const node_binary_expr_modulus *modu) const {
-                gen->generate_expr(modu->rhs);     // Evaluate RHS first (divisor)
-                gen->generate_expr(modu->lhs);     // Then LHS (dividend)
-                gen->pop("rax");                   // Pop dividend (numerator) into RAX
-                gen->pop("rbx");                   // Pop divisor into RBX
-                gen->m_output << "    cqo\n";      // Sign-extend RAX into RDX:RAX for division
-                gen->m_output << "    idiv rbx\n"; // Perform signed division
-                gen->push("rdx");                  // Push remainder (modulus result) onto the stack
+    // Runs the tasks queued above base until they are all done
+    void run_expr_tasks(size_t base) {
+        while (m_expr_tasks.size() > base) {
+            expr_task task = std::move(m_expr_tasks.back());
+            m_expr_tasks.pop_back();
+            switch (task.kind) {
+            case expr_task::kind::value:
+                if (auto term = std::get_if<node_term *>(&task.expr->var)) {
+                    visit_term(*term);
+                } else {
+                    visit_binary_expr(task.expr);
+                }
+                break;
+            case expr_task::kind::condition:
+                visit_condition(task.expr, task.label, task.jump_if);
+                break;
+            case expr_task::kind::binary:
+                finish_binary_expr(task.bin_expr);
+                break;
+            case expr_task::kind::compare: {
+                compare_op op = emit_compare(std::get<node_binary_expr_compare *>(task.bin_expr->var));
+                if (task.label.empty()) {
+                    // A comparison used as a value is materialised as 0 or 1 with setcc
+                    m_output << "    set" << condition_code(op) << " al\n";
+                    m_output << "    movzx rax, al\n";
+                } else {
+                    emit_branch(condition_code(task.jump_if ? op : negate(op)), task.label);
+                }
+                break;
             }
-        };
-        binary_expr_visitor visitor{.gen = this};
-        std::visit(visitor, bin_expr->var);
+            case expr_task::kind::spill:
+                spill();
+                break;
+            case expr_task::kind::argument:
+                m_output << "    push rax\n";
+                break;
+            case expr_task::kind::logical_not:
+                m_output << "    test rax, rax\n";
+                m_output << "    sete al\n";
+                m_output << "    movzx rax, al\n";
+                break;
+            case expr_task::kind::logical_value:
+                m_output << "    mov rax, 1\n";
+                emit_jump(task.end_label);
+                place_label(task.label);
+                m_output << "    xor eax, eax\n";
+                place_label(task.end_label);
+                break;
+            case expr_task::kind::call:
+                // The callee drops the arguments and leaves its result in RAX
+                m_output << "    call " << task.label << "\n";
+                break;
+            case expr_task::kind::array_read: {
+                const variable &var = lookup_array(std::get<node_term_index *>(task.term->var)->ident);
+                if (task.bounds_check) {
+                    emit_bounds_check("rax", var.array_size);
+                }
+                m_output << "    mov rax, " << element_operand(var, "rax", 0) << "\n";
+                break;
+            }
+            case expr_task::kind::test:
+                m_output << "    test rax, rax\n";
+                emit_branch(task.jump_if ? "nz" : "z", task.label);
+                break;
+            case expr_task::kind::label:
+                place_label(task.label);
+                break;
+            }
+        }
     }
 
-    void generate_term(const node_term *term) {
+    void visit_term(const node_term *term) {
         struct term_visitor {
             generator *gen;
+            const node_term *term;
 
             void operator()(const node_term_int_lit *term_int_lit) const {
                 // Move the integer value into register RAX (used for syscall arguments and computation)
                 gen->m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                // Push RAX onto the stack to store the computed value
-                gen->push("rax");
             }
             void operator()(const node_term_identifier *term_ident) const {
-                // Ensure the variable has been declared before using it
-                auto it = std::find_if(gen->m_variables.cbegin(), gen->m_variables.cend(), [&](const variable &var) {
-                    return var.name == term_ident->identifier.value.value();
-                });
-                if (it == gen->m_variables.cend()) {
-                    std::cerr << "Error: Undeclared Identifier " << term_ident->identifier.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                // Ensure the variable has been declared, and is not an array, before loading it from its slot
+                const variable &var = gen->lookup_scalar(term_ident->identifier);
+                gen->m_output << "    mov rax, " << gen->slot_of(var) << "\n";
+            }
+
+            void operator()(const node_term_parentheses *term_paren) const {
+                gen->m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = term_paren->expr});
+            }
+
+            // Arguments are pushed left to right, see CALL GENERATION
+            void operator()(const node_term_call *term_call) const {
+                // Calls in tail position never reach here, they are lowered by generate_return
+                if (term_call->is_tail) {
+                    report_error("Error: Call to '", term_call->ident.value.value(),
+                                 "' is marked 'tail' but is not in tail position, so it cannot be optimized");
                 }
-                // Retrieve the variable's stack location
-                const auto &var = (*it);
+                const function &fn = gen->lookup_function(term_call);
+                gen->m_expr_tasks.push_back({.kind = expr_task::kind::call, .term = term, .label = fn.label});
+                for (auto it = term_call->args.rbegin(); it != term_call->args.rend(); ++it) {
+                    gen->m_expr_tasks.push_back({.kind = expr_task::kind::argument});
+                    gen->m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = *it});
+                }
+            }
 
-                // Corrected offset calculation
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << ((gen->m_stack_size - (*it).stack_loc - 1) * 8)
-                       << "]"; // No subtraction from stack size
-                // Push the variable onto the stack
-                gen->push(offset.str());
+            // A constant index that range analysis proves in bounds is folded into the address
+            void operator()(const node_term_index *term_index) const {
+                const variable &var = gen->lookup_array(term_index->ident);
+                std::optional<value_range> range = gen->expr_range(term_index->index);
+                if (range.has_value() && range->lo == range->hi && in_bounds(range.value(), var)) {
+                    gen->m_output << "    mov rax, " << gen->element_operand(var, "", range->lo) << "\n";
+                    return;
+                }
+                gen->m_expr_tasks.push_back({.kind = expr_task::kind::array_read,
+                                             .term = term,
+                                             .bounds_check = !range.has_value() || !in_bounds(range.value(), var)});
+                gen->m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = term_index->index});
             }
 
-            void operator()(const node_term_parentheses *term_paren) const {
-                gen->generate_expr(term_paren->expr);
+            void operator()(const node_term_not *term_not) const {
+                gen->m_expr_tasks.push_back({.kind = expr_task::kind::logical_not});
+                gen->m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = term_not->expr});
             }
         };
-        term_visitor visitor{.gen = this};
+        term_visitor visitor{.gen = this, .term = term};
         std::visit(visitor, term->var);
     }
 
-    // ============================= EXPRESSION GENERATION =============================
+    void visit_binary_expr(const node_expr *expr) {
+        const node_binary_expr *bin_expr = std::get<node_binary_expr *>(expr->var);
+        if (std::holds_alternative<node_binary_expr_compare *>(bin_expr->var)) {
+            queue_compare(bin_expr, "", false);
+            return;
+        }
+        // A logical expression used as a value is materialised as 1 or 0 through its branch chain
+        if (std::holds_alternative<node_binary_expr_and *>(bin_expr->var) ||
+            std::holds_alternative<node_binary_expr_or *>(bin_expr->var)) {
+            std::string false_label = create_label();
+            std::string end_label = create_label();
+            m_expr_tasks.push_back({.kind = expr_task::kind::logical_value, .label = false_label,
+                                    .end_label = std::move(end_label)});
+            m_expr_tasks.push_back(
+                {.kind = expr_task::kind::condition, .expr = expr, .label = std::move(false_label), .jump_if = false});
+            return;
+        }
+        m_expr_tasks.push_back({.kind = expr_task::kind::binary, .bin_expr = bin_expr});
+        std::visit([&](const auto *node) { queue_operands(node->lhs, node->rhs); }, bin_expr->var);
+    }
 
-    // Function to generate assembly code for an expression
-    void generate_expr(const node_expr *expr) {
-        // Define a visitor struct to handle different expression types
-        struct expr_visitor {
-            generator *gen; // Pointer to the generator instance
+    // Queues the operands of a binary expression ahead of the step that combines them, leaving one of them in RAX.
+    // A direct operand is read in place by that step, so it is the other one that is computed: the LHS when the
+    // RHS is direct, otherwise the RHS when the LHS is. When neither is, the RHS is computed first and spilled to a
+    // temporary while the LHS is computed. temp_slots counts the temporaries the same way.
+    void queue_operands(const node_expr *lhs, const node_expr *rhs) {
+        if (const node_term *rhs_term = direct_term(rhs)) {
+            // Reported now, so an error in the RHS still comes before one in the LHS
+            if (auto ident = std::get_if<node_term_identifier *>(&rhs_term->var)) {
+                lookup_scalar((*ident)->identifier);
+            }
+            m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = lhs});
+        } else if (direct_term(lhs) != nullptr) {
+            m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = rhs});
+        } else {
+            m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = lhs});
+            m_expr_tasks.push_back({.kind = expr_task::kind::spill});
+            m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = rhs});
+        }
+    }
+
+    // Combines the operands of an arithmetic expression queued by queue_operands
+    void finish_binary_expr(const node_binary_expr *bin_expr) {
+        const node_expr *lhs = nullptr, *rhs = nullptr;
+        std::visit([&](const auto *node) { lhs = node->lhs, rhs = node->rhs; }, bin_expr->var);
+        const bool add = std::holds_alternative<node_binary_expr_add *>(bin_expr->var);
+        const bool minus = std::holds_alternative<node_binary_expr_minus *>(bin_expr->var);
+        const bool multiply = std::holds_alternative<node_binary_expr_multiply *>(bin_expr->var);
+        const bool divide = std::holds_alternative<node_binary_expr_divide *>(bin_expr->var);
 
-            void operator()(const node_term *term) const {
-                gen->generate_term(term);
+        operand other;         // The operand RAX is combined with
+        bool reversed = false; // Whether RAX holds the RHS and other the LHS
+        if (const node_term *rhs_term = direct_term(rhs)) {
+            other = direct_operand(rhs_term, add || minus);
+        } else if (const node_term *lhs_term = direct_term(lhs)) {
+            if (add || minus || multiply) {
+                other = direct_operand(lhs_term, add || minus);
+                reversed = true;
+            } else {
+                // Division is not commutative, so the RHS moves aside for the LHS
+                m_output << "    mov rbx, rax\n";
+                visit_term(lhs_term);
+                other = {.reg = "rbx"};
             }
+        } else {
+            other = {.mem = release_temp()};
+        }
 
-            // Handles binary expressions (e.g., addition, multiplication)
-            void operator()(const node_binary_expr *bin_expr) const {
-                gen->generate_binary_expr(bin_expr);
+        if (minus) {
+            m_output << "    sub rax, " << other << "\n";
+            if (reversed) {
+                m_output << "    neg rax\n";
             }
-        };
+        } else if (add) {
+            m_output << "    add rax, " << other << "\n";
+        } else if (multiply) {
+            m_output << "    mul " << other << "\n";
+        } else if (divide) {
+            m_output << "    xor edx, edx\n"; // Unsigned division of RDX:RAX, whatever a 'mul' left in RDX
+            m_output << "    div " << other << "\n";
+        } else {
+            assert(std::holds_alternative<node_binary_expr_modulus *>(bin_expr->var));
+            m_output << "    cqo\n";                  // Sign-extend RAX into RDX:RAX for division
+            m_output << "    idiv " << other << "\n"; // Perform signed division
+            m_output << "    mov rax, rdx\n";         // The remainder is the result
+        }
+    }
 
-        expr_visitor visitor{.gen = this}; // Create a visitor instance
-        std::visit(visitor, expr->var);    // Apply visitor pattern to handle the expression
+    // An operand that needs no code of its own to be computed: an integer literal or a scalar, in parentheses or not
+    static const node_term *direct_term(const node_expr *expr) {
+        auto term = std::get_if<node_term *>(&strip_parentheses(expr)->var);
+        if (term == nullptr || !(std::holds_alternative<node_term_int_lit *>((*term)->var) ||
+                                 std::holds_alternative<node_term_identifier *>((*term)->var))) {
+            return nullptr;
+        }
+        return *term;
     }
 
-    // ============================= STATEMENT GENERATION =============================
+    // A direct term as an operand: an immediate if allowed and it fits, a scalar's slot, or RBX loaded with the
+    // constant otherwise. Loading RBX emits code, so this is called before the instruction using it is started.
+    operand direct_operand(const node_term *term, bool allow_immediate) {
+        if (auto int_lit = std::get_if<node_term_int_lit *>(&term->var)) {
+            if (std::optional<int64_t> value = immediate(term); allow_immediate && value.has_value()) {
+                return {.imm = value};
+            }
+            m_output << "    mov rbx, " << (*int_lit)->int_lit.value.value() << "\n";
+            return {.reg = "rbx"};
+        }
+        return {.mem = slot_of(lookup_scalar(std::get<node_term_identifier *>(term->var)->identifier))};
+    }
 
-    void generate_scope(const node_scope *scope) {
-        begin_scope();
-        for (const node_statement *stmt : scope->stmts) {
-            generate_statement(*stmt);
+    // Stores RAX in the next temporary
+    void spill() {
+        m_output << "    mov " << temp_slot(m_temps++) << ", rax\n";
+        assert(m_temps <= m_frame.temps); // measure_frame reserved too few
+    }
+
+    // The temporary spilled last, which is free again once read
+    memory_operand release_temp() {
+        return temp_slot(--m_temps);
+    }
+
+    // ============================= CONDITION GENERATION =============================
+
+    // Jumps to label when the condition's truth equals jump_if and falls through otherwise. A comparison
+    // lowers straight to cmp + jcc without materialising a boolean. '&&', '||' and '!' become chains of such
+    // jumps, so only the operands that decide the outcome are evaluated. Anything else is tested against zero.
+    void generate_condition(const node_expr *expr, const std::string &label, bool jump_if = false) {
+        size_t base = m_expr_tasks.size();
+        m_expr_tasks.push_back({.kind = expr_task::kind::condition, .expr = expr, .label = label, .jump_if = jump_if});
+        run_expr_tasks(base);
+    }
+
+    void visit_condition(const node_expr *expr, const std::string &label, bool jump_if) {
+        if (auto term = std::get_if<node_term *>(&expr->var)) {
+            if (auto paren = std::get_if<node_term_parentheses *>(&(*term)->var)) {
+                m_expr_tasks.push_back(
+                    {.kind = expr_task::kind::condition, .expr = (*paren)->expr, .label = label, .jump_if = jump_if});
+                return;
+            }
+            if (auto term_not = std::get_if<node_term_not *>(&(*term)->var)) {
+                m_expr_tasks.push_back({.kind = expr_task::kind::condition,
+                                        .expr = (*term_not)->expr,
+                                        .label = label,
+                                        .jump_if = !jump_if});
+                return;
+            }
+        }
+        if (auto bin_expr = std::get_if<node_binary_expr *>(&expr->var)) {
+            if (std::holds_alternative<node_binary_expr_compare *>((*bin_expr)->var)) {
+                queue_compare(*bin_expr, label, jump_if);
+                return;
+            }
+            // 'a && b' is false as soon as a is, 'a || b' is true as soon as a is
+            const node_expr *lhs = nullptr, *rhs = nullptr;
+            bool short_circuit_on = false;
+            if (auto logical_and = std::get_if<node_binary_expr_and *>(&(*bin_expr)->var)) {
+                lhs = (*logical_and)->lhs, rhs = (*logical_and)->rhs, short_circuit_on = false;
+            } else if (auto logical_or = std::get_if<node_binary_expr_or *>(&(*bin_expr)->var)) {
+                lhs = (*logical_or)->lhs, rhs = (*logical_or)->rhs, short_circuit_on = true;
+            }
+            if (lhs != nullptr) {
+                if (jump_if == short_circuit_on) {
+                    // The left operand alone can decide the jump
+                    m_expr_tasks.push_back(
+                        {.kind = expr_task::kind::condition, .expr = rhs, .label = label, .jump_if = jump_if});
+                    m_expr_tasks.push_back(
+                        {.kind = expr_task::kind::condition, .expr = lhs, .label = label, .jump_if = jump_if});
+                } else {
+                    // The left operand alone can only decide not to jump
+                    std::string skip_label = create_label();
+                    m_expr_tasks.push_back({.kind = expr_task::kind::label, .label = skip_label});
+                    m_expr_tasks.push_back(
+                        {.kind = expr_task::kind::condition, .expr = rhs, .label = label, .jump_if = jump_if});
+                    m_expr_tasks.push_back({.kind = expr_task::kind::condition,
+                                            .expr = lhs,
+                                            .label = std::move(skip_label),
+                                            .jump_if = short_circuit_on});
+                }
+                return;
+            }
         }
-        end_scope();
+        m_expr_tasks.push_back({.kind = expr_task::kind::test, .label = label, .jump_if = jump_if});
+        m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = expr});
     }
 
-    // Function to generate assembly code for a statement
-    void generate_statement(const node_statement &stmt) {
-        // Define a visitor struct to handle different statement types
-        struct statement_visitor {
-            generator *gen; // Pointer to the generator instance
+    // Queues a comparison: its operands, see queue_operands, then the cmp followed by setcc when label is empty
+    // or by a jump to label otherwise
+    void queue_compare(const node_binary_expr *bin_expr, const std::string &label, bool jump_if) {
+        const node_binary_expr_compare *compare = std::get<node_binary_expr_compare *>(bin_expr->var);
+        m_expr_tasks.push_back(
+            {.kind = expr_task::kind::compare, .bin_expr = bin_expr, .label = label, .jump_if = jump_if});
+        queue_operands(compare->lhs, compare->rhs);
+    }
 
-            // Handles exit statements (e.g., exit(5);)
-            void operator()(const node_statement_exit &stmt_exit) {
-                // Generate code for the expression inside exit()
-                gen->generate_expr(stmt_exit.expr);
-                // Move the syscall number for exit (60) into RAX
-                gen->m_output << "    mov rax, 60\n";
-                // Pop the expression result from the stack into RDI (exit code argument for syscall)
-                gen->pop("rdi");
-                // Execute the syscall to terminate the program
-                gen->m_output << "    syscall\n";
+    // Emits the operands of a comparison and a cmp, leaving the result in the flags, and returns the operator
+    // the flags should be tested with
+    compare_op generate_compare(const node_binary_expr_compare *compare) {
+        size_t base = m_expr_tasks.size();
+        queue_operands(compare->lhs, compare->rhs);
+        run_expr_tasks(base);
+        return emit_compare(compare);
+    }
+
+    // The cmp of a comparison whose operands queue_operands has computed. A small constant on either side is
+    // compared as an immediate, swapping the operands when the constant is on the left.
+    compare_op emit_compare(const node_binary_expr_compare *compare) {
+        if (const node_term *rhs = direct_term(compare->rhs)) {
+            operand other = direct_operand(rhs, true);
+            m_output << "    cmp rax, " << other << "\n";
+            return compare->op;
+        }
+        if (const node_term *lhs = direct_term(compare->lhs)) {
+            if (std::optional<int64_t> value = immediate(lhs)) {
+                m_output << "    cmp rax, " << value.value() << "\n";
+                return swap_operands(compare->op);
             }
+            operand other = direct_operand(lhs, false);
+            m_output << "    cmp " << other << ", rax\n";
+            return compare->op;
+        }
+        m_output << "    cmp rax, " << release_temp() << "\n";
+        return compare->op;
+    }
 
-            // Handles let statements (e.g., let x = 5;)
-            void operator()(const node_statement_let &stmt_let) {
-                // Ensure the variable is not already declared
-                auto it = std::find_if(gen->m_variables.cbegin(), gen->m_variables.cend(),
-                                       [&](const variable &var) { return var.name == stmt_let.ident.value.value(); });
-                if (it != gen->m_variables.cend()) {
-                    std::cerr << "Error: Identifier already exists: " << stmt_let.ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+    static const char *condition_code(compare_op op) {
+        switch (op) {
+        case compare_op::eq:
+            return "e";
+        case compare_op::ne:
+            return "ne";
+        case compare_op::lt:
+            return "l";
+        case compare_op::le:
+            return "le";
+        case compare_op::gt:
+            return "g";
+        case compare_op::ge:
+            return "ge";
+        }
+        assert(false);
+        return "";
+    }
+
+    static compare_op negate(compare_op op) {
+        switch (op) {
+        case compare_op::eq:
+            return compare_op::ne;
+        case compare_op::ne:
+            return compare_op::eq;
+        case compare_op::lt:
+            return compare_op::ge;
+        case compare_op::le:
+            return compare_op::gt;
+        case compare_op::gt:
+            return compare_op::le;
+        case compare_op::ge:
+            return compare_op::lt;
+        }
+        assert(false);
+        return op;
+    }
+
+    // The operator that gives the same result with lhs and rhs exchanged
+    static compare_op swap_operands(compare_op op) {
+        switch (op) {
+        case compare_op::lt:
+            return compare_op::gt;
+        case compare_op::le:
+            return compare_op::ge;
+        case compare_op::gt:
+            return compare_op::lt;
+        case compare_op::ge:
+            return compare_op::le;
+        default:
+            return op;
+        }
+    }
+
+    // The value of an integer literal, empty if it does not fit in 64 bits (the tokenizer rejects those, an AST
+    // file need not have)
+    static std::optional<int64_t> int_lit_value(const node_term_int_lit *int_lit) {
+        std::string_view text = int_lit->int_lit.value.value();
+        int64_t value = 0;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (error != std::errc() || end != text.data() + text.size()) {
+            return {};
+        }
+        return value;
+    }
+
+    // The value of an integer literal that fits a sign-extended 32-bit immediate
+    static std::optional<int64_t> immediate(const node_term *term) {
+        auto int_lit = std::get_if<node_term_int_lit *>(&term->var);
+        if (int_lit == nullptr) {
+            return {};
+        }
+        std::optional<int64_t> value = int_lit_value(*int_lit);
+        if (!value.has_value() || value.value() < INT32_MIN || value.value() > INT32_MAX) {
+            return {};
+        }
+        return value;
+    }
+
+    // ============================= MATCH GENERATION =============================
+
+    // The scrutinee is evaluated once into RAX, then dispatched one of three ways depending on the case values:
+    //  - a jump table in .rodata when there are at least 4 cases filling at least half of their value range
+    //  - a balanced compare tree when there are more than 3 cases
+    //  - a chain of compares otherwise
+    void generate_match(const node_statement_match *stmt_match) {
+        std::vector<std::pair<int64_t, std::string>> cases;
+        std::string end_label = create_label();
+        std::string default_label = end_label;
+        std::vector<std::string> arm_labels;
+        std::unordered_set<int64_t> values;
+        for (const node_match_arm &arm : stmt_match->arms) {
+            arm_labels.push_back(create_label());
+            if (!arm.value.has_value()) {
+                if (default_label != end_label) {
+                    report_error("Error: 'match' has more than one '_' arm");
                 }
-                // Store the variable in the symbol table with its stack location
-                gen->m_variables.push_back({.name = stmt_let.ident.value.value(), .stack_loc = gen->m_stack_size});
+                default_label = arm_labels.back();
+                continue;
+            }
+            if (!values.insert(arm.value.value()).second) {
+                report_error("Error: Duplicate 'match' arm ", arm.value.value());
+            }
+            cases.push_back({arm.value.value(), arm_labels.back()});
+        }
+        std::sort(cases.begin(), cases.end());
 
-                // Generate code for the assigned expression
-                gen->generate_expr(stmt_let.expr);
+        generate_expr(stmt_match->expr);
+        if (cases.empty()) {
+            emit_jump(default_label);
+        } else {
+            __int128 span = (__int128)cases.back().first - cases.front().first + 1;
+            if (cases.size() >= 4 && span <= (__int128)cases.size() * 2) {
+                generate_jump_table(cases, static_cast<size_t>(span), default_label);
+            } else {
+                generate_case_tree(cases, 0, cases.size(), default_label);
             }
+        }
 
-            void operator()(const node_scope *scope) const {
-                gen->generate_scope(scope);
+        // The arms follow in order, each jumping to the end label kept after the arm labels
+        arm_labels.push_back(std::move(end_label));
+        queue_match_arm(stmt_match, std::move(arm_labels), 0);
+    }
+
+    void queue_match_arm(const node_statement_match *stmt_match, std::vector<std::string> labels, size_t arm) {
+        // Only one arm runs, so each starts from what was known before the match, and after the match anything
+        // an arm assigns is unknown. The arms before the last were forgotten as the next one began.
+        if (arm > 0) {
+            forget_ranges(stmt_match->arms[arm - 1].scope);
+        }
+        if (arm == stmt_match->arms.size()) {
+            place_label(labels.back());
+            return;
+        }
+        place_label(labels[arm]);
+        const node_scope *scope = stmt_match->arms[arm].scope;
+        m_statement_tasks.push_back(
+            {.kind = statement_task::kind::match_arm, .stmt_match = stmt_match, .labels = std::move(labels),
+             .index = arm});
+        m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = scope});
+    }
+
+    // Rebases RAX to the smallest case and jumps through the table, values outside it go to the default arm
+    void generate_jump_table(const std::vector<std::pair<int64_t, std::string>> &cases, size_t span,
+                             const std::string &default_label) {
+        jump_table table{.label = m_unit_prefix + "jumptable" + std::to_string(m_jump_table_count++)};
+        table.targets.assign(span, default_label);
+        for (const auto &[value, label] : cases) {
+            table.targets[value - cases.front().first] = label;
+        }
+        if (cases.front().first != 0) {
+            emit_cmp_rax(cases.front().first, "sub");
+        }
+        emit_cmp_rax(static_cast<int64_t>(span - 1), "cmp");
+        emit_branch("a", default_label); // Unsigned, so values below the smallest case wrap around too
+        m_output << "    jmp QWORD [" << table.label << " + rax*8]\n";
+        emit_stop();
+        m_jump_tables.push_back(std::move(table));
+    }
+
+    // Binary search over the sorted cases in [lo, hi), finishing with a linear chain for three or fewer
+    void generate_case_tree(const std::vector<std::pair<int64_t, std::string>> &cases, size_t lo, size_t hi,
+                            const std::string &default_label) {
+        if (hi - lo <= 3) {
+            for (size_t i = lo; i < hi; ++i) {
+                emit_cmp_rax(cases[i].first, "cmp");
+                emit_branch("e", cases[i].second);
             }
+            emit_jump(default_label);
+            return;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        std::string lower_label = create_label();
+        emit_cmp_rax(cases[mid].first, "cmp");
+        emit_branch("e", cases[mid].second);
+        emit_branch("l", lower_label);
+        generate_case_tree(cases, mid + 1, hi, default_label);
+        place_label(lower_label);
+        generate_case_tree(cases, lo, mid, default_label);
+    }
 
-            void operator()(const node_statement_if *stmt_if) {
-                gen->generate_expr(stmt_if->expr);
-                gen->pop("rax");
-                std::string label = gen->create_label();
-                gen->m_output << "    test rax, rax\n";
-                gen->m_output << "    jz " << label << "\n";
-                gen->generate_scope(stmt_if->scope);
-                gen->m_output << label << ":\n";
+    // 'op rax, value' with the value as an immediate when it fits, otherwise through RBX
+    void emit_cmp_rax(int64_t value, const char *op) {
+        if (value >= INT32_MIN && value <= INT32_MAX) {
+            m_output << "    " << op << " rax, " << value << "\n";
+        } else {
+            m_output << "    mov rbx, " << value << "\n";
+            m_output << "    " << op << " rax, rbx\n";
+        }
+    }
+
+    // ============================= BRANCHLESS SELECTS =============================
+
+    // 'if (c) { x = a; }' and 'if (c) { x = a; } else { x = b; }' where a and b are cheap and side-effect free
+    // become a cmov, so data-dependent conditions cannot be mispredicted. Both values are computed up front,
+    // the condition sets the flags last and cmov picks the result. Returns false when the pattern does not apply.
+    bool try_generate_select(const node_statement_if *stmt_if) {
+        const node_statement_assign *then_assign = single_assignment(stmt_if->scope);
+        if (then_assign == nullptr) {
+            return false;
+        }
+        const node_expr *else_value = nullptr;
+        if (stmt_if->else_scope != nullptr) {
+            const node_statement_assign *else_assign = single_assignment(stmt_if->else_scope);
+            if (else_assign == nullptr || else_assign->ident.value.value() != then_assign->ident.value.value()) {
+                return false;
             }
-        };
+            else_value = else_assign->expr;
+        }
+        const variable *target = find_variable(then_assign->ident.value.value());
+        if (target == nullptr || target->array_size > 0 || !is_cheap(then_assign->expr) ||
+            (else_value != nullptr && !is_cheap(else_value))) {
+            return false;
+        }
 
-        statement_visitor visitor{.gen = this}; // Create a visitor instance
-        std::visit(visitor, stmt.var);          // Apply visitor pattern to handle the statement
+        // Only conditions that leave their answer in the flags: a comparison or a plain value, possibly negated
+        const node_expr *cond = stmt_if->expr;
+        bool negated = false;
+        while (true) {
+            auto term = std::get_if<node_term *>(&cond->var);
+            if (term == nullptr) {
+                break;
+            }
+            if (auto paren = std::get_if<node_term_parentheses *>(&(*term)->var)) {
+                cond = (*paren)->expr;
+            } else if (auto term_not = std::get_if<node_term_not *>(&(*term)->var)) {
+                cond = (*term_not)->expr;
+                negated = !negated;
+            } else {
+                break;
+            }
+        }
+        const node_binary_expr_compare *compare = nullptr;
+        if (auto bin_expr = std::get_if<node_binary_expr *>(&cond->var)) {
+            if (auto cmp = std::get_if<node_binary_expr_compare *>(&(*bin_expr)->var)) {
+                compare = *cmp;
+            } else if (std::holds_alternative<node_binary_expr_and *>((*bin_expr)->var) ||
+                       std::holds_alternative<node_binary_expr_or *>((*bin_expr)->var)) {
+                return false;
+            }
+        }
+
+        std::optional<value_range> then_range = expr_range(then_assign->expr);
+        std::optional<value_range> else_range = else_value != nullptr ? expr_range(else_value) : target->range;
+
+        generate_expr(then_assign->expr);
+        memory_operand then_operand = temp_slot(m_temps);
+        spill();
+        memory_operand else_operand = slot_of(*target);
+        if (else_value != nullptr) {
+            generate_expr(else_value);
+            else_operand = temp_slot(m_temps);
+            spill();
+        }
+        std::string cc;
+        if (compare != nullptr) {
+            compare_op op = generate_compare(compare);
+            cc = condition_code(negated ? negate(op) : op);
+        } else {
+            generate_expr(cond);
+            m_output << "    test rax, rax\n";
+            cc = negated ? "z" : "nz";
+        }
+        // mov leaves the flags alone
+        m_output << "    mov rcx, " << else_operand << "\n";
+        m_output << "    cmov" << cc << " rcx, " << then_operand << "\n";
+        m_output << "    mov " << slot_of(*target) << ", rcx\n";
+        m_temps -= else_value != nullptr ? 2 : 1;
+
+        variable &var = lookup_scalar(then_assign->ident);
+        if (then_range.has_value() && else_range.has_value()) {
+            var.range = value_range{std::min(then_range->lo, else_range->lo), std::max(then_range->hi, else_range->hi)};
+        } else {
+            var.range.reset();
+        }
+        return true;
     }
 
-    // ============================= PROGRAM GENERATION =============================
+    // The scope's only statement if it is a plain scalar assignment
+    static const node_statement_assign *single_assignment(const node_scope *scope) {
+        if (scope->stmts.size() != 1) {
+            return nullptr;
+        }
+        auto stmt_assign = std::get_if<node_statement_assign *>(&scope->stmts.front()->var);
+        if (stmt_assign == nullptr || (*stmt_assign)->index != nullptr) {
+            return nullptr;
+        }
+        return *stmt_assign;
+    }
+
+    // Cheap enough to compute even when it is not selected, and unable to fault: constants and scalars combined
+    // with at most two additions or subtractions
+    bool is_cheap(const node_expr *expr, int budget = 2) const {
+        expr = strip_parentheses(expr);
+        if (auto term = std::get_if<node_term *>(&expr->var)) {
+            if (std::holds_alternative<node_term_int_lit *>((*term)->var)) {
+                return true;
+            }
+            if (auto ident = std::get_if<node_term_identifier *>(&(*term)->var)) {
+                const variable *var = find_variable((*ident)->identifier.value.value());
+                return var != nullptr && var->array_size == 0;
+            }
+            return false;
+        }
+        if (budget == 0) {
+            return false;
+        }
+        const node_binary_expr *bin_expr = std::get<node_binary_expr *>(expr->var);
+        if (auto add = std::get_if<node_binary_expr_add *>(&bin_expr->var)) {
+            return is_cheap((*add)->lhs, budget - 1) && is_cheap((*add)->rhs, budget - 1);
+        }
+        if (auto minus = std::get_if<node_binary_expr_minus *>(&bin_expr->var)) {
+            return is_cheap((*minus)->lhs, budget - 1) && is_cheap((*minus)->rhs, budget - 1);
+        }
+        return false;
+    }
 
-    // Function to generate assembly code for the entire program
-    std::string generate_program() {
-        std::stringstream output; // String stream to store generated assembly code
+    // ============================= ARRAY GENERATION =============================
 
-        // Start of the assembly program
-        m_output << "global _start\n"; // Declares the _start entry point for the assembler
-        m_output << "_start:\n";       // Defines the _start label
+    // Arrays are contiguous runs of QWORDs with element 0 at the lowest address. Stack arrays take array_size
+    // slots of the frame, static arrays live in .bss. An index is bounds checked unless range analysis proves it
+    // is inside the array, in which case a constant index is also folded into the address.
+
+    // The value is computed first. A direct index is then loaded into RCX beside it, any other index is computed
+    // into RAX while the value waits in a temporary.
+    void generate_array_write(const node_statement_assign *stmt_assign) {
+        const variable &var = lookup_array(stmt_assign->ident);
+        std::optional<value_range> range = expr_range(stmt_assign->index);
+        const bool check = !range.has_value() || !in_bounds(range.value(), var);
+        generate_expr(stmt_assign->expr);
+        if (!check && range->lo == range->hi) {
+            m_output << "    mov " << element_operand(var, "", range->lo) << ", rax\n";
+            return;
+        }
+        if (const node_term *index = direct_term(stmt_assign->index)) {
+            operand index_operand = direct_operand(index, true);
+            m_output << "    mov rcx, " << index_operand << "\n";
+            if (check) {
+                emit_bounds_check("rcx", var.array_size);
+            }
+            m_output << "    mov " << element_operand(var, "rcx", 0) << ", rax\n";
+            return;
+        }
+        spill();
+        generate_expr(stmt_assign->index);
+        if (check) {
+            emit_bounds_check("rax", var.array_size);
+        }
+        m_output << "    mov rbx, " << release_temp() << "\n";
+        m_output << "    mov " << element_operand(var, "rax", 0) << ", rbx\n";
+    }
 
-        // Generate assembly for each statement in the program
-        for (const node_statement &stmt : m_prog.stmts) {
-            generate_statement(stmt);
+    void generate_array_decl(const node_statement_array *stmt_array) {
+        std::string_view name = stmt_array->ident.value.value();
+        if (find_variable(name) != nullptr) {
+            report_error("Error: Identifier already exists: ", name);
         }
+        if (stmt_array->is_static) {
+            std::string label = m_unit_prefix + "static" + std::to_string(m_static_count++);
+            m_statics.push_back({.label = label, .size = stmt_array->size});
+            declare({.name = name, .offset = 0, .array_size = stmt_array->size, .static_label = label});
+            return;
+        }
+        declare({.name = name, .offset = allocate_locals(stmt_array->size), .array_size = stmt_array->size});
+        // Zero the elements, which the frame already holds
+        m_output << "    lea rdi, " << element_address(m_variables.back(), "", 0) << "\n";
+        m_output << "    mov rcx, " << stmt_array->size << "\n";
+        m_output << "    xor eax, eax\n";
+        m_output << "    rep stosq\n";
+    }
 
-        // Ensure the program exits cleanly in case there is no exit() statement
-        m_output << "    mov rax, 60\n"; // Move syscall number for exit into RAX
-        m_output << "    mov rdi, 0\n";  // Set exit status to 0 (successful termination)
-        m_output << "    syscall\n";     // Call the exit syscall
+    // ============================= FRAME LAYOUT =============================
 
-        return m_output.str(); // Return the generated assembly code as a string
+    // Every slot a function or the program uses lives in one frame below RBP, sized before any of its code is
+    // generated and reserved with a single 'sub rsp'. Variables take slots in declaration order and give them
+    // back when their scope ends, so the frame holds the deepest nesting of them; the temporaries operands are
+    // spilled to follow. Addresses never move while the body runs, and values are stored with mov, not push.
+
+    // Points RBP at a new frame for the statements and reserves it
+    void enter_frame(const statement_list &stmts) {
+        m_frame = measure_frame(stmts);
+        m_locals = 0;
+        m_temps = 0;
+        m_output << "    mov rbp, rsp\n";
+        if (size_t slots = m_frame.locals + m_frame.temps; slots > 0) {
+            m_output << "    sub rsp, " << slots * 8 << "\n";
+        }
     }
 
-  private:
-    // Pushes a value onto the stack and updates the stack size
-    void push(const std::string &reg) {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
+    // Walks the statements the way code generation will, scopes included but not function bodies, counting the
+    // slots their variables need at once and the temporaries any one statement needs
+    static frame_size measure_frame(const statement_list &stmts) {
+        frame_size frame;
+        size_t locals = 0;
+        std::vector<std::pair<const node_statement *, size_t>> pending; // A statement, or the end of a scope with
+                                                                        // the slots in use before it
+        auto enter = [&](const node_scope *scope) {
+            pending.push_back({nullptr, locals});
+            for (auto it = scope->stmts.rbegin(); it != scope->stmts.rend(); ++it) {
+                pending.push_back({*it, 0});
+            }
+        };
+        for (auto it = stmts.rbegin(); it != stmts.rend(); ++it) {
+            pending.push_back({*it, 0});
+        }
+        while (!pending.empty()) {
+            auto [stmt, outer_locals] = pending.back();
+            pending.pop_back();
+            if (stmt == nullptr) {
+                locals = outer_locals;
+                continue;
+            }
+            size_t temps = 0;
+            if (auto stmt_exit = std::get_if<node_statement_exit>(&stmt->var)) {
+                temps = temp_slots(stmt_exit->expr);
+            } else if (auto stmt_let = std::get_if<node_statement_let>(&stmt->var)) {
+                ++locals;
+                temps = temp_slots(stmt_let->expr);
+            } else if (auto stmt_array = std::get_if<node_statement_array *>(&stmt->var)) {
+                locals += (*stmt_array)->is_static ? 0 : (*stmt_array)->size;
+            } else if (auto stmt_assign = std::get_if<node_statement_assign *>(&stmt->var)) {
+                // An array write spills the value while an index that is not direct is computed
+                const node_statement_assign *assign = *stmt_assign;
+                temps = temp_slots(assign->expr);
+                if (assign->index != nullptr && direct_term(assign->index) == nullptr) {
+                    temps = std::max(temps, 1 + temp_slots(assign->index));
+                }
+            } else if (auto scope = std::get_if<node_scope *>(&stmt->var)) {
+                enter(*scope);
+            } else if (auto stmt_if = std::get_if<node_statement_if *>(&stmt->var)) {
+                temps = temp_slots((*stmt_if)->expr);
+                // A select spills the value it assigns, and the else value if any, before the condition
+                if (const node_statement_assign *then_assign = single_assignment((*stmt_if)->scope)) {
+                    const node_statement_assign *else_assign =
+                        (*stmt_if)->else_scope != nullptr ? single_assignment((*stmt_if)->else_scope) : nullptr;
+                    size_t spilled = 1;
+                    temps = std::max(temps, temp_slots(then_assign->expr));
+                    if (else_assign != nullptr) {
+                        temps = std::max(temps, 1 + temp_slots(else_assign->expr));
+                        spilled = 2;
+                    }
+                    temps = std::max(temps, spilled + temp_slots((*stmt_if)->expr));
+                }
+                if ((*stmt_if)->else_scope != nullptr) {
+                    enter((*stmt_if)->else_scope);
+                }
+                enter((*stmt_if)->scope);
+            } else if (auto stmt_while = std::get_if<node_statement_while *>(&stmt->var)) {
+                temps = temp_slots((*stmt_while)->expr);
+                enter((*stmt_while)->scope);
+            } else if (auto stmt_match = std::get_if<node_statement_match *>(&stmt->var)) {
+                temps = temp_slots((*stmt_match)->expr);
+                for (auto it = (*stmt_match)->arms.rbegin(); it != (*stmt_match)->arms.rend(); ++it) {
+                    enter(it->scope);
+                }
+            } else if (auto stmt_return = std::get_if<node_statement_return *>(&stmt->var)) {
+                // A tail call's arguments need what the call itself would
+                temps = temp_slots((*stmt_return)->expr);
+            }
+            frame.locals = std::max(frame.locals, locals);
+            frame.temps = std::max(frame.temps, temps);
+        }
+        return frame;
     }
 
-    // Pops a value from the stack and updates the stack size
-    void pop(const std::string &reg) {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+    // Temporaries computing expr holds at most at once. Like queue_operands, an operator spills its RHS only when
+    // neither operand is direct; everything else holds nothing while its operands are computed.
+    static size_t temp_slots(const node_expr *expr) {
+        if (direct_term(expr) != nullptr) {
+            return 0;
+        }
+        std::vector<std::pair<const node_expr *, bool>> pending{{expr, false}}; // Expression, operands done
+        std::vector<size_t> slots;
+        while (!pending.empty()) {
+            auto [next, operands_done] = pending.back();
+            pending.pop_back();
+            if (auto term = std::get_if<node_term *>(&next->var)) {
+                if (auto paren = std::get_if<node_term_parentheses *>(&(*term)->var)) {
+                    pending.push_back({(*paren)->expr, false});
+                } else if (auto term_not = std::get_if<node_term_not *>(&(*term)->var)) {
+                    pending.push_back({(*term_not)->expr, false});
+                } else if (auto term_index = std::get_if<node_term_index *>(&(*term)->var)) {
+                    pending.push_back({(*term_index)->index, false});
+                } else if (auto term_call = std::get_if<node_term_call *>(&(*term)->var)) {
+                    // Arguments are pushed as they are computed, so they take no temporaries
+                    if (!operands_done) {
+                        pending.push_back({next, true});
+                        for (const node_expr *arg : (*term_call)->args) {
+                            pending.push_back({arg, false});
+                        }
+                        continue;
+                    }
+                    size_t most = 0;
+                    for (size_t i = 0; i < (*term_call)->args.size(); ++i) {
+                        most = std::max(most, slots.back());
+                        slots.pop_back();
+                    }
+                    slots.push_back(most);
+                } else {
+                    slots.push_back(0);
+                }
+                continue;
+            }
+            const node_binary_expr *bin_expr = std::get<node_binary_expr *>(next->var);
+            const node_expr *lhs = nullptr, *rhs = nullptr;
+            std::visit([&](const auto *node) { lhs = node->lhs, rhs = node->rhs; }, bin_expr->var);
+            if (!operands_done) {
+                pending.push_back({next, true});
+                pending.push_back({lhs, false});
+                pending.push_back({rhs, false});
+                continue;
+            }
+            size_t lhs_slots = slots.back(); // The RHS was done first
+            slots.pop_back();
+            size_t rhs_slots = slots.back();
+            slots.pop_back();
+            if (std::holds_alternative<node_binary_expr_and *>(bin_expr->var) ||
+                std::holds_alternative<node_binary_expr_or *>(bin_expr->var) || direct_term(lhs) != nullptr ||
+                direct_term(rhs) != nullptr) {
+                slots.push_back(std::max(lhs_slots, rhs_slots));
+            } else {
+                slots.push_back(std::max(rhs_slots, 1 + lhs_slots));
+            }
+        }
+        return slots.back();
     }
 
-    void begin_scope() {
-        m_scopes.push_back(m_variables.size());
+    // ============================= CALL GENERATION =============================
+
+    // Calling convention: arguments are pushed left to right and the callee drops them with 'ret N', which lets a
+    // tail call change the argument count. The result comes back in RAX. A function saves RBP and points it at its
+    // frame, so parameter i of N sits at [rbp + 16 + 8*(N-1-i)], above the saved RBP and the return address, and
+    // the locals and temporaries measure_frame counted sit below it in slots reserved on entry. Ordinary calls are
+    // finished by run_expr_tasks once their arguments are pushed.
+
+    // A call in tail position reuses the caller's frame: the new arguments are pushed below it and the caller's
+    // RBP is restored, then the arguments overwrite the caller's parameters, the return address is moved on top
+    // of them, everything else is dropped and control jumps to the callee. Recursion through tail calls therefore
+    // runs in constant stack space.
+    void generate_tail_call(const node_term_call *term_call) {
+        const function &fn = lookup_function(term_call);
+        const size_t caller_params = m_fn_params.value();
+        const size_t callee_params = term_call->args.size();
+        for (const node_expr *arg : term_call->args) {
+            generate_expr(arg);
+            m_output << "    push rax\n";
+        }
+        m_output << "    mov rbp, " << memory_operand{.base = "rbp", .offset = 0, .sized = true} << "\n";
+        // The arguments, the frame, the saved RBP and the return address lie above RSP, then the parameters
+        const size_t size = callee_params + m_frame.locals + m_frame.temps + 2 + caller_params;
+        const bool move_return = callee_params != caller_params;
+        if (move_return) {
+            m_output << "    mov rcx, " << stack_slot{(size - caller_params - 1) * 8} << "\n";
+        }
+        // Copying in ascending order never clobbers an argument that has not been copied yet
+        for (size_t i = 0; i < callee_params; ++i) {
+            m_output << "    mov rax, " << stack_slot{(callee_params - i - 1) * 8} << "\n";
+            m_output << "    mov " << stack_slot{(size - i - 1) * 8} << ", rax\n";
+        }
+        if (move_return) {
+            m_output << "    mov " << stack_slot{(size - callee_params - 1) * 8} << ", rcx\n";
+        }
+        if (size - callee_params - 1 > 0) {
+            m_output << "    add rsp, " << (size - callee_params - 1) * 8 << "\n";
+        }
+        emit_jump(fn.label);
     }
 
-    void end_scope() {
-        size_t pop_count = m_variables.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n"; // add becasue stack grows from top
-        m_stack_size -= pop_count;
+    void generate_return(const node_statement_return *stmt_return) {
+        if (!m_fn_params.has_value()) {
+            report_error("Error: 'return' outside of function");
+        }
+        if (auto term = std::get_if<node_term *>(&stmt_return->expr->var)) {
+            if (auto term_call = std::get_if<node_term_call *>(&(*term)->var)) {
+                generate_tail_call(*term_call);
+                return;
+            }
+        }
+        generate_expr(stmt_return->expr);
+        emit_ret(m_fn_params.value());
+    }
 
-        for (int i = 0; i < pop_count; ++i) {
-            m_variables.pop_back();
+    void generate_function(const node_statement_fn *stmt_fn) {
+        m_variables.clear();
+        m_variable_index.clear();
+        m_scopes.clear();
+        for (size_t i = 0; i < stmt_fn->params.size(); ++i) {
+            std::string_view name = stmt_fn->params[i].value.value();
+            if (find_variable(name) != nullptr) {
+                report_error("Error: Duplicate parameter ", name);
+            }
+            declare({.name = name, .offset = static_cast<int64_t>(16 + 8 * (stmt_fn->params.size() - 1 - i))});
         }
-        m_scopes.pop_back();
+        m_fn_params = stmt_fn->params.size();
+
+        // The body is only built and indexed now, on the worker generating it
+        const node_scope *body = stmt_fn->body();
+        m_assignments = index_assignments(body->stmts);
+
+        place_label("fn_" + std::string(stmt_fn->ident.value.value()));
+        m_output << "    push rbp\n";
+        enter_frame(body->stmts);
+        generate_scope(body);
+        // Falling off the end of a function returns 0
+        m_output << "    mov rax, 0\n";
+        emit_ret(stmt_fn->params.size());
+
+        m_fn_params.reset();
+        m_variables.clear();
+        m_variable_index.clear();
     }
 
-    std::string create_label() {
-        return "label" + std::to_string(m_label_count);
+    // ============================= STATEMENT GENERATION =============================
+
+    // Statements are walked like expressions, so scopes can nest to any depth: a statement holding a scope queues
+    // the step that finishes it on m_statement_tasks, then the scope, instead of recursing into it.
+
+    void generate_scope(const node_scope *scope) {
+        size_t base = m_statement_tasks.size();
+        m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = scope});
+        run_statement_tasks(base);
     }
 
-    // Structure representing a variable in the symbol table
-    struct variable {
-        std::string name;
-        size_t stack_loc; // Stack position of the variable
-    };
+    // Function to generate assembly code for a statement
+    void generate_statement(const node_statement &stmt) {
+        size_t base = m_statement_tasks.size();
+        m_statement_tasks.push_back({.kind = statement_task::kind::statement, .stmt = &stmt});
+        run_statement_tasks(base);
+    }
+
+    // Runs the tasks queued above base until they are all done
+    void run_statement_tasks(size_t base) {
+        while (m_statement_tasks.size() > base) {
+            statement_task task = std::move(m_statement_tasks.back());
+            m_statement_tasks.pop_back();
+            switch (task.kind) {
+            case statement_task::kind::statement:
+                visit_statement(*task.stmt);
+                break;
+            case statement_task::kind::scope:
+                begin_scope();
+                m_statement_tasks.push_back({.kind = statement_task::kind::end_scope});
+                for (auto it = task.scope->stmts.rbegin(); it != task.scope->stmts.rend(); ++it) {
+                    m_statement_tasks.push_back({.kind = statement_task::kind::statement, .stmt = *it});
+                }
+                break;
+            case statement_task::kind::end_scope:
+                end_scope();
+                break;
+            case statement_task::kind::if_then:
+                finish_if_then(task);
+                break;
+            case statement_task::kind::if_else:
+                place_label(task.labels[0]);
+                // Either scope may have run; the then-scope's assignments were forgotten before the else-scope
+                forget_ranges(task.stmt_if->else_scope);
+                break;
+            case statement_task::kind::while_body:
+                finish_while(task);
+                break;
+            case statement_task::kind::match_arm:
+                emit_jump(task.labels.back());
+                queue_match_arm(task.stmt_match, std::move(task.labels), task.index + 1);
+                break;
+            }
+        }
+    }
+
+    void visit_statement(const node_statement &stmt) {
+        // Define a visitor struct to handle different statement types
+        struct statement_visitor {
+            generator *gen; // Pointer to the generator instance
+
+            // Handles exit statements (e.g., exit(5);)
+            void operator()(const node_statement_exit &stmt_exit) {
+                // Generate code for the expression inside exit()
+                gen->generate_expr(stmt_exit.expr);
+                // Move the expression result into RDI (exit code argument for syscall)
+                gen->m_output << "    mov rdi, rax\n";
+                gen->emit_exit();
+            }
+
+            // Handles let statements (e.g., let x = 5;)
+            void operator()(const node_statement_let &stmt_let) {
+                // Ensure the variable is not already declared
+                if (gen->find_variable(stmt_let.ident.value.value()) != nullptr) {
+                    report_error("Error: Identifier already exists: ", stmt_let.ident.value.value());
+                }
+                // Store the variable in the symbol table with the next slot of the frame
+                gen->declare({.name = stmt_let.ident.value.value(),
+                              .offset = gen->allocate_locals(1),
+                              .range = gen->expr_range(stmt_let.expr)});
+
+                // Generate code for the assigned expression and store it in the slot
+                gen->generate_expr(stmt_let.expr);
+                gen->m_output << "    mov " << gen->slot_of(gen->m_variables.back()) << ", rax\n";
+            }
+
+            void operator()(const node_scope *scope) const {
+                gen->m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = scope});
+            }
+
+            void operator()(const node_statement_if *stmt_if) {
+                if (gen->m_options.cmov && gen->try_generate_select(stmt_if)) {
+                    return;
+                }
+                std::string label = gen->create_label();
+                gen->generate_condition(stmt_if->expr, label);
+                gen->m_statement_tasks.push_back(
+                    {.kind = statement_task::kind::if_then, .stmt_if = stmt_if, .labels = {std::move(label)}});
+                gen->m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = stmt_if->scope});
+            }
+
+            void operator()(const node_statement_while *stmt_while) {
+                gen->generate_while(stmt_while);
+            }
+
+            void operator()(const node_statement_match *stmt_match) {
+                gen->generate_match(stmt_match);
+            }
+
+            void operator()(const node_statement_array *stmt_array) {
+                gen->generate_array_decl(stmt_array);
+            }
+
+            void operator()(const node_statement_assign *stmt_assign) {
+                if (stmt_assign->index != nullptr) {
+                    gen->generate_array_write(stmt_assign);
+                    return;
+                }
+                variable &var = gen->lookup_scalar(stmt_assign->ident);
+                std::optional<value_range> range = gen->expr_range(stmt_assign->expr);
+                gen->generate_expr(stmt_assign->expr);
+                gen->m_output << "    mov " << gen->slot_of(var) << ", rax\n";
+                var.range = range;
+            }
+
+            void operator()(const node_statement_return *stmt_return) {
+                gen->generate_return(stmt_return);
+            }
+
+            // Function bodies are emitted after the main program by generate_program
+            void operator()(const node_statement_fn *) {
+            }
+        };
+
+        statement_visitor visitor{.gen = this}; // Create a visitor instance
+        std::visit(visitor, stmt.var);          // Apply visitor pattern to handle the statement
+    }
+
+    // The then-scope of an if is done: skip the else-scope, if any, and queue it
+    void finish_if_then(const statement_task &task) {
+        const node_statement_if *stmt_if = task.stmt_if;
+        if (stmt_if->else_scope == nullptr) {
+            place_label(task.labels[0]);
+            // The body may or may not have run, so anything it assigns is unknown afterwards
+            forget_ranges(stmt_if->scope);
+            return;
+        }
+        std::string end_label = create_label();
+        emit_jump(end_label);
+        place_label(task.labels[0]);
+        // The else-scope runs only when the then-scope did not, so what the then-scope assigned is unknown there
+        forget_ranges(stmt_if->scope);
+        m_statement_tasks.push_back(
+            {.kind = statement_task::kind::if_else, .stmt_if = stmt_if, .labels = {std::move(end_label)}});
+        m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = stmt_if->else_scope});
+    }
+
+    void generate_while(const node_statement_while *stmt_while) {
+        // Look for an induction variable before its entry range is forgotten
+        const node_expr *limit_expr = nullptr;
+        bool stops_at_limit = false;
+        variable *induction = find_induction_variable(stmt_while, limit_expr, stops_at_limit);
+        std::optional<value_range> start = induction != nullptr ? induction->range : std::nullopt;
+
+        // The condition and body run repeatedly, so nothing the body assigns keeps a known range inside the loop
+        forget_ranges(stmt_while->scope);
+
+        // i stepping by one keeps i in [start, n - 1] inside the body. 'i < n' guarantees that on its own,
+        // 'i != n' and 'n - i' only when i starts at or below n.
+        std::optional<value_range> induction_range;
+        if (induction != nullptr) {
+            std::optional<value_range> limit = expr_range(limit_expr);
+            if (start.has_value() && limit.has_value() && limit->lo == limit->hi &&
+                (!stops_at_limit || start->hi <= limit->lo) && start->lo <= limit->lo - 1) {
+                induction_range = value_range{start->lo, limit->lo - 1};
+                // Whole vectors go through a SIMD copy of the loop first, the scalar loop finishes the rest
+                try_generate_vector_loop(stmt_while, *induction, induction_range.value(), limit->lo);
+            }
+        }
+
+        // The loop is laid out with the condition at the bottom, so each iteration takes a single backward
+        // branch and leaving the loop falls through
+        std::string body_label = create_label();
+        std::string cond_label = create_label();
+        emit_jump(cond_label);
+        place_label(body_label);
+        if (induction != nullptr) {
+            induction->range = induction_range;
+        }
+        // The body may declare variables, so the induction variable is remembered by its index
+        m_statement_tasks.push_back(
+            {.kind = statement_task::kind::while_body,
+             .stmt_while = stmt_while,
+             .labels = {std::move(body_label), std::move(cond_label)},
+             .index = induction != nullptr ? static_cast<size_t>(induction - m_variables.data()) : SIZE_MAX});
+        m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = stmt_while->scope});
+    }
+
+    // The body of a while loop is done: the condition follows it
+    void finish_while(const statement_task &task) {
+        if (task.index != SIZE_MAX) {
+            m_variables[task.index].range.reset();
+        }
+        place_label(task.labels[1]);
+        generate_condition(task.stmt_while->expr, task.labels[0], true);
+        forget_ranges(task.stmt_while->scope);
+    }
+
+    // ============================= VECTORIZATION =============================
+
+    // A counted loop 'while (n - i) { ...; i = i + 1; }' whose other statements are all lane-wise is given a
+    // packed SIMD copy that runs first, handling as many whole vectors as fit. The scalar loop that follows it
+    // then only runs for the remainder. Lane-wise statements are
+    //   a[i] = E;        element-wise stores
+    //   s = s + E;       reductions (also s = E + s and s = s - E), with s used nowhere else in the loop
+    // where E combines b[i], constants and loop-invariant scalars with + and -. Every array must be provably in
+    // bounds for the whole loop, since the vector body has no bounds checks.
+
+    bool try_generate_vector_loop(const node_statement_while *stmt_while, const variable &induction,
+                                  const value_range &induction_range, int64_t limit) {
+        const size_t lanes = vector_lanes();
+        if (lanes == 0) {
+            return false;
+        }
+        const auto &stmts = stmt_while->scope->stmts;
+        std::vector<std::string_view> assigned;
+        collect_assigned(stmt_while->scope, assigned);
+
+        // Classify the body, giving each reduction its own accumulator counting down from the last register
+        struct reduction {
+            const variable *var;
+            const node_expr *expr;
+            bool subtract;
+            int acc;
+        };
+        std::vector<const node_statement_assign *> stores;
+        std::vector<reduction> reductions;
+        for (size_t i = 0; i + 1 < stmts.size(); ++i) {
+            auto stmt_assign = std::get_if<node_statement_assign *>(&stmts[i]->var);
+            if (stmt_assign == nullptr) {
+                return false;
+            }
+            const node_statement_assign *assign = *stmt_assign;
+            if (assign->index != nullptr) {
+                auto arr = find_variable(assign->ident.value.value());
+                if (arr == nullptr || arr->array_size == 0 || !in_bounds(induction_range, *arr) ||
+                    !is_identifier(assign->index, induction.name)) {
+                    return false;
+                }
+                stores.push_back(assign);
+                continue;
+            }
+            std::string_view name = assign->ident.value.value();
+            auto bin_expr = std::get_if<node_binary_expr *>(&assign->expr->var);
+            auto scalar = find_variable(name);
+            if (bin_expr == nullptr || scalar == nullptr || scalar->array_size > 0 || name == induction.name ||
+                std::count(assigned.cbegin(), assigned.cend(), name) != 1) {
+                return false;
+            }
+            reduction red{.var = scalar, .expr = nullptr, .subtract = false, .acc = 15 - (int)reductions.size()};
+            if (auto add = std::get_if<node_binary_expr_add *>(&(*bin_expr)->var)) {
+                red.expr = is_identifier((*add)->lhs, name) ? (*add)->rhs
+                         : is_identifier((*add)->rhs, name) ? (*add)->lhs
+                                                             : nullptr;
+            } else if (auto minus = std::get_if<node_binary_expr_minus *>(&(*bin_expr)->var)) {
+                red.expr = is_identifier((*minus)->lhs, name) ? (*minus)->rhs : nullptr;
+                red.subtract = true;
+            }
+            if (red.expr == nullptr) {
+                return false;
+            }
+            reductions.push_back(red);
+        }
+        if (stores.empty() && reductions.empty()) {
+            return false;
+        }
+
+        // Every operand must be lane-wise, and reductions may not read any scalar the loop assigns
+        const int free_regs = 16 - (int)reductions.size();
+        for (const node_statement_assign *store : stores) {
+            int regs = vector_regs(store->expr, induction, induction_range, assigned);
+            if (regs == 0 || regs > free_regs) {
+                return false;
+            }
+        }
+        for (const reduction &red : reductions) {
+            int regs = vector_regs(red.expr, induction, induction_range, assigned);
+            if (regs == 0 || regs > free_regs) {
+                return false;
+            }
+        }
+
+        const bool avx = m_options.target == simd_target::avx2;
+        const std::string start_label = create_label();
+        const std::string end_label = create_label();
+        for (const reduction &red : reductions) {
+            if (avx) {
+                m_output << "    vpxor ymm" << red.acc << ", ymm" << red.acc << ", ymm" << red.acc << "\n";
+            } else {
+                m_output << "    pxor xmm" << red.acc << ", xmm" << red.acc << "\n";
+            }
+        }
+        place_label(start_label);
+        m_output << "    mov rax, " << slot_of(induction) << "\n";
+        m_output << "    mov rbx, " << limit << "\n";
+        m_output << "    sub rbx, rax\n";
+        m_output << "    cmp rbx, " << lanes << "\n";
+        emit_branch("l", end_label);
+        // Statements run in source order for each group of lanes, which keeps per-element semantics intact
+        size_t next_store = 0, next_reduction = 0;
+        for (size_t i = 0; i + 1 < stmts.size(); ++i) {
+            auto assign = std::get<node_statement_assign *>(stmts[i]->var);
+            if (assign->index != nullptr) {
+                const node_statement_assign *store = stores[next_store++];
+                generate_vector_expr(store->expr, 0);
+                const variable &arr = *find_variable(store->ident.value.value());
+                m_output << "    " << (avx ? "vmovdqu " : "movdqu ") << element_address(arr, "rax", 0) << ", "
+                         << vector_reg(0) << "\n";
+            } else {
+                const reduction &red = reductions[next_reduction++];
+                generate_vector_expr(red.expr, 0);
+                if (avx) {
+                    m_output << "    vpaddq ymm" << red.acc << ", ymm" << red.acc << ", ymm0\n";
+                } else {
+                    m_output << "    paddq xmm" << red.acc << ", xmm0\n";
+                }
+            }
+        }
+        m_output << "    add " << slot_of(induction) << ", " << lanes << "\n";
+        emit_jump(start_label);
+        place_label(end_label);
+
+        // Fold each accumulator's lanes and merge the total into the scalar
+        for (const reduction &red : reductions) {
+            const std::string acc = "xmm" + std::to_string(red.acc);
+            if (avx) {
+                m_output << "    vextracti128 xmm0, ymm" << red.acc << ", 1\n";
+                m_output << "    vpaddq " << acc << ", " << acc << ", xmm0\n";
+                m_output << "    vpshufd xmm0, " << acc << ", 0xEE\n";
+                m_output << "    vpaddq " << acc << ", " << acc << ", xmm0\n";
+                m_output << "    vmovq rbx, " << acc << "\n";
+            } else {
+                m_output << "    pshufd xmm0, " << acc << ", 0xEE\n";
+                m_output << "    paddq " << acc << ", xmm0\n";
+                m_output << "    movq rbx, " << acc << "\n";
+            }
+            m_output << "    " << (red.subtract ? "sub " : "add ") << slot_of(*red.var) << ", rbx\n";
+        }
+        if (avx) {
+            m_output << "    vzeroupper\n";
+        }
+        return true;
+    }
+
+    size_t vector_lanes() const {
+        switch (m_options.target) {
+        case simd_target::sse2:
+            return 2;
+        case simd_target::avx2:
+            return 4;
+        default:
+            return 0;
+        }
+    }
+
+    std::string vector_reg(int reg) const {
+        return (m_options.target == simd_target::avx2 ? "ymm" : "xmm") + std::to_string(reg);
+    }
+
+    // Number of vector registers needed to evaluate expr lane-wise, or 0 if it cannot be or would need more than
+    // limit. Left operands are followed in a loop; only right operands recurse, each needing one register more
+    // than the last, so the recursion is never deeper than limit.
+    int vector_regs(const node_expr *expr, const variable &induction, const value_range &induction_range,
+                    const std::vector<std::string_view> &assigned, int limit = 16) const {
+        std::vector<const node_expr *> rhs_operands; // Outermost first
+        expr = strip_parentheses(expr);
+        while (auto bin_expr = std::get_if<node_binary_expr *>(&expr->var)) {
+            if (auto add = std::get_if<node_binary_expr_add *>(&(*bin_expr)->var)) {
+                rhs_operands.push_back((*add)->rhs);
+                expr = strip_parentheses((*add)->lhs);
+            } else if (auto minus = std::get_if<node_binary_expr_minus *>(&(*bin_expr)->var)) {
+                rhs_operands.push_back((*minus)->rhs);
+                expr = strip_parentheses((*minus)->lhs);
+            } else {
+                return 0; // There is no packed 64-bit multiply or divide below AVX-512
+            }
+        }
+
+        const node_term *term = std::get<node_term *>(expr->var);
+        if (auto ident = std::get_if<node_term_identifier *>(&term->var)) {
+            // Loop-invariant scalars are broadcast to every lane
+            std::string_view name = (*ident)->identifier.value.value();
+            auto var = find_variable(name);
+            bool invariant = std::find(assigned.cbegin(), assigned.cend(), name) == assigned.cend();
+            if (var == nullptr || var->array_size > 0 || !invariant) {
+                return 0;
+            }
+        } else if (auto index = std::get_if<node_term_index *>(&term->var)) {
+            auto arr = find_variable((*index)->ident.value.value());
+            bool lane_wise = arr != nullptr && arr->array_size > 0 && in_bounds(induction_range, *arr) &&
+                             is_identifier((*index)->index, induction.name);
+            if (!lane_wise) {
+                return 0;
+            }
+        } else if (!std::holds_alternative<node_term_int_lit *>(term->var)) {
+            return 0;
+        }
+
+        // Each operation, innermost first, keeps its LHS in place and needs its RHS in the next register
+        int regs = 1;
+        for (auto it = rhs_operands.rbegin(); it != rhs_operands.rend(); ++it) {
+            int rhs_regs = limit > 1 ? vector_regs(*it, induction, induction_range, assigned, limit - 1) : 0;
+            if (rhs_regs == 0) {
+                return 0;
+            }
+            regs = std::max(regs, rhs_regs + 1);
+        }
+        return regs;
+    }
+
+    // Evaluates a lane-wise expression into vector register reg, using higher registers for temporaries.
+    // RAX holds the induction variable. Like vector_regs, only right operands recurse.
+    void generate_vector_expr(const node_expr *expr, int reg) {
+        const bool avx = m_options.target == simd_target::avx2;
+        std::vector<std::pair<const char *, const node_expr *>> rhs_operands; // Outermost first
+        expr = strip_parentheses(expr);
+        while (auto bin_expr = std::get_if<node_binary_expr *>(&expr->var)) {
+            if (auto add = std::get_if<node_binary_expr_add *>(&(*bin_expr)->var)) {
+                rhs_operands.push_back({"paddq", (*add)->rhs});
+                expr = strip_parentheses((*add)->lhs);
+            } else {
+                auto minus = std::get<node_binary_expr_minus *>((*bin_expr)->var);
+                rhs_operands.push_back({"psubq", minus->rhs});
+                expr = strip_parentheses(minus->lhs);
+            }
+        }
+
+        const node_term *term = std::get<node_term *>(expr->var);
+        if (auto index = std::get_if<node_term_index *>(&term->var)) {
+            const variable &arr = *find_variable((*index)->ident.value.value());
+            m_output << "    " << (avx ? "vmovdqu " : "movdqu ") << vector_reg(reg) << ", "
+                     << element_address(arr, "rax", 0) << "\n";
+        } else {
+            // Broadcast a constant or loop-invariant scalar through RBX
+            if (auto int_lit = std::get_if<node_term_int_lit *>(&term->var)) {
+                m_output << "    mov rbx, " << (*int_lit)->int_lit.value.value() << "\n";
+            } else {
+                const auto *ident = std::get<node_term_identifier *>(term->var);
+                const variable &var = *find_variable(ident->identifier.value.value());
+                m_output << "    mov rbx, " << slot_of(var) << "\n";
+            }
+            if (avx) {
+                m_output << "    vmovq xmm" << reg << ", rbx\n";
+                m_output << "    vpbroadcastq ymm" << reg << ", xmm" << reg << "\n";
+            } else {
+                m_output << "    movq xmm" << reg << ", rbx\n";
+                m_output << "    punpcklqdq xmm" << reg << ", xmm" << reg << "\n";
+            }
+        }
+
+        for (auto it = rhs_operands.rbegin(); it != rhs_operands.rend(); ++it) {
+            const char *op = it->first;
+            generate_vector_expr(it->second, reg + 1);
+            if (avx) {
+                m_output << "    v" << op << " " << vector_reg(reg) << ", " << vector_reg(reg) << ", "
+                         << vector_reg(reg + 1) << "\n";
+            } else {
+                m_output << "    " << op << " " << vector_reg(reg) << ", " << vector_reg(reg + 1) << "\n";
+            }
+        }
+    }
+
+    // ============================= RANGE ANALYSIS =============================
+
+    // Returns the range of an expression given what is currently known about variables, or nothing if the
+    // value cannot be bounded (or any intermediate could overflow). Operands are combined bottom-up from an
+    // explicit stack, so the depth of the expression does not matter.
+    std::optional<value_range> expr_range(const node_expr *expr) const {
+        std::vector<std::pair<const node_expr *, bool>> pending{{expr, false}}; // Expression, operands done
+        std::vector<std::optional<value_range>> ranges;
+        while (!pending.empty()) {
+            auto [next, operands_done] = pending.back();
+            pending.pop_back();
+            if (auto term = std::get_if<node_term *>(&next->var)) {
+                if (auto paren = std::get_if<node_term_parentheses *>(&(*term)->var)) {
+                    pending.push_back({(*paren)->expr, false});
+                } else {
+                    ranges.push_back(term_range(*term));
+                }
+                continue;
+            }
+            const node_binary_expr *bin_expr = std::get<node_binary_expr *>(next->var);
+            if (std::holds_alternative<node_binary_expr_compare *>(bin_expr->var) ||
+                std::holds_alternative<node_binary_expr_and *>(bin_expr->var) ||
+                std::holds_alternative<node_binary_expr_or *>(bin_expr->var)) {
+                ranges.push_back(value_range{0, 1});
+                continue;
+            }
+            if (std::holds_alternative<node_binary_expr_divide *>(bin_expr->var)) {
+                ranges.push_back(std::nullopt);
+                continue;
+            }
+            if (!operands_done) {
+                pending.push_back({next, true});
+                std::visit(
+                    [&](const auto *node) {
+                        pending.push_back({node->rhs, false});
+                        pending.push_back({node->lhs, false});
+                    },
+                    bin_expr->var);
+                continue;
+            }
+            std::optional<value_range> rhs = ranges.back();
+            ranges.pop_back();
+            ranges.back() = combine_ranges(bin_expr, ranges.back(), rhs);
+        }
+        return ranges.back();
+    }
+
+    std::optional<value_range> term_range(const node_term *term) const {
+        if (auto int_lit = std::get_if<node_term_int_lit *>(&term->var)) {
+            std::optional<int64_t> value = int_lit_value(*int_lit);
+            if (!value.has_value()) {
+                return {};
+            }
+            return value_range{value.value(), value.value()};
+        }
+        if (auto ident = std::get_if<node_term_identifier *>(&term->var)) {
+            const variable *var = find_variable((*ident)->identifier.value.value());
+            if (var == nullptr || var->array_size > 0) {
+                return {};
+            }
+            return var->range;
+        }
+        return {};
+    }
+
+    // Range of an arithmetic expression given the ranges of its operands
+    static std::optional<value_range> combine_ranges(const node_binary_expr *bin_expr,
+                                                     const std::optional<value_range> &lhs,
+                                                     const std::optional<value_range> &rhs) {
+        if (!lhs || !rhs) {
+            return {};
+        }
+        auto checked = [](__int128 lo, __int128 hi) -> std::optional<value_range> {
+            if (lo < INT64_MIN || hi > INT64_MAX) {
+                return {};
+            }
+            return value_range{static_cast<int64_t>(lo), static_cast<int64_t>(hi)};
+        };
+        if (std::holds_alternative<node_binary_expr_add *>(bin_expr->var)) {
+            return checked((__int128)lhs->lo + rhs->lo, (__int128)lhs->hi + rhs->hi);
+        }
+        if (std::holds_alternative<node_binary_expr_minus *>(bin_expr->var)) {
+            return checked((__int128)lhs->lo - rhs->hi, (__int128)lhs->hi - rhs->lo);
+        }
+        if (std::holds_alternative<node_binary_expr_multiply *>(bin_expr->var)) {
+            __int128 products[] = {(__int128)lhs->lo * rhs->lo, (__int128)lhs->lo * rhs->hi,
+                                   (__int128)lhs->hi * rhs->lo, (__int128)lhs->hi * rhs->hi};
+            return checked(*std::min_element(std::begin(products), std::end(products)),
+                           *std::max_element(std::begin(products), std::end(products)));
+        }
+        // A non-negative value modulo a positive constant d lies in [0, d - 1]
+        assert(std::holds_alternative<node_binary_expr_modulus *>(bin_expr->var));
+        if (lhs->lo < 0 || rhs->lo != rhs->hi || rhs->lo <= 0) {
+            return {};
+        }
+        return value_range{0, std::min(lhs->hi, rhs->lo - 1)};
+    }
+
+    // Recognises 'while (i < n) { ...; i = i + 1; }' where i is a scalar that the body assigns nowhere else.
+    // The condition may also be 'n > i', or 'i != n' and 'n - i', which only stop the loop when i reaches n
+    // exactly (stops_at_limit). Returns i and sets limit_expr to n, or returns nullptr when the loop has no such
+    // induction variable.
+    variable *find_induction_variable(const node_statement_while *stmt_while, const node_expr *&limit_expr,
+                                      bool &stops_at_limit) {
+        const auto &stmts = stmt_while->scope->stmts;
+        if (stmts.empty()) {
+            return nullptr;
+        }
+        auto step = std::get_if<node_statement_assign *>(&stmts.back()->var);
+        if (step == nullptr || (*step)->index != nullptr) {
+            return nullptr;
+        }
+        std::string_view name = (*step)->ident.value.value();
+        auto add = std::get_if<node_binary_expr *>(&(*step)->expr->var);
+        if (add == nullptr || !std::holds_alternative<node_binary_expr_add *>((*add)->var)) {
+            return nullptr;
+        }
+        const auto *add_expr = std::get<node_binary_expr_add *>((*add)->var);
+        if (!is_identifier(add_expr->lhs, name) || !is_int_lit(add_expr->rhs, 1)) {
+            return nullptr;
+        }
+
+        auto cond = std::get_if<node_binary_expr *>(&stmt_while->expr->var);
+        if (cond == nullptr) {
+            return nullptr;
+        }
+        const node_expr *limit = nullptr;
+        if (auto minus = std::get_if<node_binary_expr_minus *>(&(*cond)->var)) {
+            limit = is_identifier((*minus)->rhs, name) ? (*minus)->lhs : nullptr;
+            stops_at_limit = true;
+        } else if (auto compare = std::get_if<node_binary_expr_compare *>(&(*cond)->var)) {
+            const auto *cmp = *compare;
+            if ((cmp->op == compare_op::lt || cmp->op == compare_op::ne) && is_identifier(cmp->lhs, name)) {
+                limit = cmp->rhs;
+            } else if ((cmp->op == compare_op::gt || cmp->op == compare_op::ne) && is_identifier(cmp->rhs, name)) {
+                limit = cmp->lhs;
+            }
+            stops_at_limit = cmp->op == compare_op::ne;
+        }
+        if (limit == nullptr) {
+            return nullptr;
+        }
+
+        // The step is the last assignment in the body, so any other one comes before it
+        if (m_assignments->count(stmt_while->scope, name) > 1) {
+            return nullptr;
+        }
+
+        variable *var = find_variable(name);
+        if (var == nullptr || var->array_size > 0) {
+            return nullptr;
+        }
+        limit_expr = limit;
+        return var;
+    }
+
+    // The expression inside any number of brackets
+    static const node_expr *strip_parentheses(const node_expr *expr) {
+        while (true) {
+            auto term = std::get_if<node_term *>(&expr->var);
+            if (term == nullptr) {
+                return expr;
+            }
+            auto paren = std::get_if<node_term_parentheses *>(&(*term)->var);
+            if (paren == nullptr) {
+                return expr;
+            }
+            expr = (*paren)->expr;
+        }
+    }
+
+    static bool is_identifier(const node_expr *expr, std::string_view name) {
+        auto term = std::get_if<node_term *>(&expr->var);
+        if (term == nullptr) {
+            return false;
+        }
+        auto ident = std::get_if<node_term_identifier *>(&(*term)->var);
+        return ident != nullptr && (*ident)->identifier.value.value() == name;
+    }
+
+    static bool is_int_lit(const node_expr *expr, int64_t value) {
+        auto term = std::get_if<node_term *>(&expr->var);
+        if (term == nullptr) {
+            return false;
+        }
+        auto int_lit = std::get_if<node_term_int_lit *>(&(*term)->var);
+        return int_lit != nullptr && int_lit_value(*int_lit) == value;
+    }
+
+    // Collects the names of scalars a statement may assign, including inside nested scopes
+    static void collect_assigned(const node_statement &stmt, std::vector<std::string_view> &assigned) {
+        std::vector<const node_statement *> pending{&stmt};
+        while (!pending.empty()) {
+            const node_statement *next = pending.back();
+            pending.pop_back();
+            auto queue = [&](const node_scope *scope) {
+                pending.insert(pending.end(), scope->stmts.cbegin(), scope->stmts.cend());
+            };
+            if (auto stmt_assign = std::get_if<node_statement_assign *>(&next->var)) {
+                if ((*stmt_assign)->index == nullptr) {
+                    assigned.push_back((*stmt_assign)->ident.value.value());
+                }
+            } else if (auto scope = std::get_if<node_scope *>(&next->var)) {
+                queue(*scope);
+            } else if (auto stmt_if = std::get_if<node_statement_if *>(&next->var)) {
+                queue((*stmt_if)->scope);
+                if ((*stmt_if)->else_scope != nullptr) {
+                    queue((*stmt_if)->else_scope);
+                }
+            } else if (auto stmt_while = std::get_if<node_statement_while *>(&next->var)) {
+                queue((*stmt_while)->scope);
+            } else if (auto stmt_match = std::get_if<node_statement_match *>(&next->var)) {
+                for (const node_match_arm &arm : (*stmt_match)->arms) {
+                    queue(arm.scope);
+                }
+            }
+        }
+    }
+
+    static void collect_assigned(const node_scope *scope, std::vector<std::string_view> &assigned) {
+        for (const node_statement *stmt : scope->stmts) {
+            collect_assigned(*stmt, assigned);
+        }
+    }
+
+    // Walks the statements of the program or of one function body once for the assignment_index of them. Function
+    // definitions are left out: each body gets an index of its own when it is generated.
+    static std::shared_ptr<const assignment_index> index_assignments(const statement_list &stmts) {
+        auto index = std::make_shared<assignment_index>();
+        // A scope is entered, then its statements run, then it is closed with the run of names it got
+        struct step {
+            const node_statement *stmt = nullptr;
+            const node_scope *scope = nullptr;
+            bool close = false;
+            size_t begin = 0;
+        };
+        std::vector<step> pending;
+        auto enter = [&](const node_scope *scope) { pending.push_back({.scope = scope}); };
+        for (auto it = stmts.rbegin(); it != stmts.rend(); ++it) {
+            pending.push_back({.stmt = *it});
+        }
+        while (!pending.empty()) {
+            step next = pending.back();
+            pending.pop_back();
+            if (next.close) {
+                index->scopes[next.scope] = {next.begin, index->names.size()};
+                continue;
+            }
+            if (next.scope != nullptr) {
+                pending.push_back({.scope = next.scope, .close = true, .begin = index->names.size()});
+                for (auto it = next.scope->stmts.rbegin(); it != next.scope->stmts.rend(); ++it) {
+                    pending.push_back({.stmt = *it});
+                }
+                continue;
+            }
+            const node_statement *stmt = next.stmt;
+            if (auto stmt_assign = std::get_if<node_statement_assign *>(&stmt->var)) {
+                if ((*stmt_assign)->index == nullptr) {
+                    std::string_view name = (*stmt_assign)->ident.value.value();
+                    index->positions[name].push_back(index->names.size());
+                    index->names.push_back(name);
+                }
+            } else if (auto scope = std::get_if<node_scope *>(&stmt->var)) {
+                enter(*scope);
+            } else if (auto stmt_if = std::get_if<node_statement_if *>(&stmt->var)) {
+                if ((*stmt_if)->else_scope != nullptr) {
+                    enter((*stmt_if)->else_scope);
+                }
+                enter((*stmt_if)->scope);
+            } else if (auto stmt_while = std::get_if<node_statement_while *>(&stmt->var)) {
+                enter((*stmt_while)->scope);
+            } else if (auto stmt_match = std::get_if<node_statement_match *>(&stmt->var)) {
+                for (auto it = (*stmt_match)->arms.rbegin(); it != (*stmt_match)->arms.rend(); ++it) {
+                    enter(it->scope);
+                }
+            }
+        }
+        return index;
+    }
+
+    // Drops the known range of every variable the scope may assign. Every enclosing if, while and match asks this
+    // again for the scopes inside it, so instead of walking the scope it looks at the assignments the index lists
+    // for it, or at the variables in scope when those are fewer.
+    void forget_ranges(const node_scope *scope) {
+        auto [begin, end] = m_assignments->scopes.at(scope);
+        if (end - begin <= m_variables.size()) {
+            for (size_t i = begin; i < end; ++i) {
+                if (variable *var = find_variable(m_assignments->names[i])) {
+                    var->range.reset();
+                }
+            }
+            return;
+        }
+        for (variable &var : m_variables) {
+            if (var.range.has_value() && m_assignments->count(scope, var.name) > 0) {
+                var.range.reset();
+            }
+        }
+    }
+
+    // ============================= PROGRAM GENERATION =============================
+
+    // Function to generate assembly code for the entire program, written to output
+    void generate_program(asm_buffer &output) {
+        // Start of the assembly program
+        output << "global _start\n"; // Declares the _start entry point for the assembler
+        declare_externs(output);
+        m_blocks.back().label = "_start";
+        if (m_options.jit) {
+            // Called as a function: keep the callee-saved registers we use and remember where to return from
+            m_output << "    push rbx\n";
+            m_output << "    push rbp\n";
+            m_output << "    push r15\n";
+            m_output << "    mov r15, rsp\n";
+        }
+
+        register_functions();
+        generate_bodies([&] {
+            enter_frame(m_prog.stmts);
+            // Generate assembly for each statement in the program
+            for (const node_statement *stmt : m_prog.stmts) {
+                generate_statement(*stmt);
+            }
+
+            // Ensure the program exits cleanly in case there is no exit() statement
+            m_output << "    mov rdi, 0\n"; // Set exit status to 0 (successful termination)
+            emit_exit();
+        });
+        finish_output(output, {"_start"});
+    }
+
+    // Generates a module, a program of function definitions only, to be assembled into an object of its own and
+    // linked with the program that imports it. Its functions are exported under their labels.
+    void generate_module(asm_buffer &output) {
+        register_functions();
+        for (size_t i = m_externs.size(); i < m_functions.size(); ++i) {
+            output << "global " << m_functions[i].label << "\n";
+        }
+        declare_externs(output);
+        generate_bodies([] {});
+        finish_output(output, {});
+    }
+
+  private:
+    // Symbols of the functions other modules define
+    void declare_externs(asm_buffer &output) const {
+        for (const extern_function &fn : m_externs) {
+            output << "extern fn_" << fn.name << "\n";
+        }
+    }
+
+    // Enters the functions of other modules, then every function defined here, in the function table, so calls
+    // may refer to functions defined later (mutual recursion). Indexes the assignments outside functions too.
+    void register_functions() {
+        auto add = [&](std::string_view name, size_t param_count) {
+            if (!m_function_index.emplace(name, m_functions.size()).second) {
+                report_error("Error: Function already exists: ", name);
+            }
+            m_functions.push_back({.name = name, .label = "fn_" + std::string(name), .param_count = param_count});
+        };
+        for (const extern_function &fn : m_externs) {
+            add(fn.name, fn.param_count);
+        }
+        for (const node_statement *stmt : m_prog.stmts) {
+            if (auto stmt_fn = std::get_if<node_statement_fn *>(&stmt->var)) {
+                add((*stmt_fn)->ident.value.value(), (*stmt_fn)->params.size());
+            }
+        }
+        m_assignments = index_assignments(m_prog.stmts);
+    }
+
+    // Generates the function bodies on workers, on other threads while this one runs main_body, then appends
+    // them after whatever main_body generated in the order they were defined
+    template <typename Body> void generate_bodies(Body &&main_body) {
+        std::vector<const node_statement_fn *> bodies;
+        for (const node_statement *stmt : m_prog.stmts) {
+            if (auto stmt_fn = std::get_if<node_statement_fn *>(&stmt->var)) {
+                bodies.push_back(*stmt_fn);
+            }
+        }
+        std::vector<function_unit> units(bodies.size());
+        size_t helpers = std::min<size_t>(thread_count(m_options) - 1, bodies.size());
+        std::vector<std::unique_ptr<generator>> workers;
+        for (size_t i = 0; i <= helpers; ++i) {
+            workers.push_back(std::unique_ptr<generator>(new generator(this)));
+        }
+        std::atomic<size_t> next = 0;
+        auto work = [&](generator &worker) {
+            for (size_t i = next++; i < bodies.size(); i = next++) {
+                if (!worker.generate_unit(bodies[i], units[i])) {
+                    return;
+                }
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < helpers; ++i) {
+            pool.emplace_back(work, std::ref(*workers[i]));
+        }
+
+        std::exception_ptr main_error;
+        try {
+            main_body();
+        } catch (...) {
+            main_error = std::current_exception();
+            next = bodies.size(); // Bodies not started yet are not needed
+        }
+        if (main_error == nullptr) {
+            work(*workers.back());
+        }
+        for (std::thread &thread : pool) {
+            thread.join();
+        }
+
+        // The first error in program order is the one a single thread would have reported
+        if (main_error != nullptr) {
+            std::rethrow_exception(main_error);
+        }
+        for (const function_unit &unit : units) {
+            if (unit.error != nullptr) {
+                std::rethrow_exception(unit.error);
+            }
+        }
+
+        for (const function_unit &unit : units) {
+            append_unit(unit);
+        }
+        for (const std::unique_ptr<generator> &worker : workers) {
+            m_bounds_fail_used = m_bounds_fail_used || worker->m_bounds_fail_used;
+            m_jit_exit_used = m_jit_exit_used || worker->m_jit_exit_used;
+        }
+    }
+
+    // Adds the shared exit paths, then tidies the blocks and writes them out with the read-only data and static
+    // arrays. entries are the labels reached from outside besides the functions.
+    void finish_output(asm_buffer &output, std::unordered_set<std::string_view> entries) {
+        // Failed bounds checks report the error and exit with status 1
+        if (m_bounds_fail_used) {
+            place_label("bounds_fail");
+            m_output << "    mov rax, 1\n";
+            m_output << "    mov rdi, 2\n";
+            m_output << "    mov rsi, bounds_msg\n";
+            m_output << "    mov rdx, " << sizeof(bounds_msg) - 1 << "\n";
+            m_output << "    syscall\n";
+            m_output << "    mov rdi, 1\n";
+            emit_exit();
+        }
+
+        // Under the JIT, exit() hands its status back to the host
+        if (m_jit_exit_used) {
+            place_label("jit_exit");
+            m_output << "    mov rax, rdi\n";
+            m_output << "    mov rsp, r15\n";
+            m_output << "    pop r15\n";
+            m_output << "    pop rbp\n";
+            m_output << "    pop rbx\n";
+            m_output << "    ret\n";
+            emit_stop();
+        }
+
+        for (const function &fn : m_functions) {
+            entries.insert(fn.label);
+        }
+        optimize_blocks(entries);
+        render_blocks(output, entries);
+
+        if (m_bounds_fail_used || !m_jump_tables.empty()) {
+            output << "section .rodata\n";
+        }
+        if (m_bounds_fail_used) {
+            output << "bounds_msg: db \"" << std::string_view(bounds_msg, sizeof(bounds_msg) - 2) << "\", 10\n";
+        }
+        for (const jump_table &table : m_jump_tables) {
+            output << "align 8\n";
+            output << table.label << ": dq ";
+            for (size_t i = 0; i < table.targets.size(); ++i) {
+                output << (i > 0 ? ", " : "") << table.targets[i];
+            }
+            output << "\n";
+        }
+
+        // Static arrays are zero-initialised by the loader
+        if (!m_statics.empty()) {
+            output << "section .bss\n";
+            for (const static_array &arr : m_statics) {
+                output << arr.label << ": resq " << arr.size << "\n";
+            }
+        }
+    }
+
+    // Worker for function bodies, sharing the options and function table of the generator that made it
+    explicit generator(const generator *parent)
+        : m_prog(parent->m_prog), m_options(parent->m_options), m_functions(parent->m_functions),
+          m_function_index(parent->m_function_index) {}
+
+    // Generates a function body as a unit of its own. Its labels, jump tables and static arrays are named under
+    // the function's label, so the result does not depend on what the worker generated before; appended in
+    // order, the units make the same output whichever thread generated each one. Returns false on an error,
+    // which is kept in the unit, and leaves this worker unusable.
+    bool generate_unit(const node_statement_fn *stmt_fn, function_unit &unit) {
+        unit.worker = this;
+        unit.blocks_begin = m_blocks.size() - 1; // The empty block being filled
+        unit.tables_begin = m_jump_tables.size();
+        unit.statics_begin = m_statics.size();
+        m_unit_prefix = "fn_" + std::string(stmt_fn->ident.value.value()) + ".";
+        m_label_count = 0;
+        m_jump_table_count = 0;
+        m_static_count = 0;
+        try {
+            generate_function(stmt_fn);
+        } catch (...) {
+            unit.error = std::current_exception();
+            return false;
+        }
+        unit.blocks_end = m_blocks.size() - 1;
+        unit.tables_end = m_jump_tables.size();
+        unit.statics_end = m_statics.size();
+        return true;
+    }
+
+    // Moves a function body generated by a worker in place of the empty block being filled
+    void append_unit(const function_unit &unit) {
+        generator &worker = *unit.worker;
+        const size_t code_begin = worker.m_blocks[unit.blocks_begin].code_begin;
+        const size_t code_end = worker.m_blocks[unit.blocks_end - 1].code_end;
+        const size_t offset = m_output.size();
+        m_output << worker.m_output.view(code_begin, code_end);
+        m_blocks.pop_back();
+        for (size_t i = unit.blocks_begin; i < unit.blocks_end; ++i) {
+            basic_block &block = m_blocks.emplace_back(std::move(worker.m_blocks[i]));
+            block.code_begin = block.code_begin - code_begin + offset;
+            block.code_end = block.code_end - code_begin + offset;
+        }
+        m_blocks.push_back({.code_begin = m_output.size(), .code_end = m_output.size()});
+        std::move(worker.m_jump_tables.begin() + unit.tables_begin, worker.m_jump_tables.begin() + unit.tables_end,
+                  std::back_inserter(m_jump_tables));
+        std::move(worker.m_statics.begin() + unit.statics_begin, worker.m_statics.begin() + unit.statics_end,
+                  std::back_inserter(m_statics));
+    }
+
+    // ============================= BASIC BLOCKS =============================
+
+    // Code is collected as a list of basic blocks in emission order. m_output holds the body of the block being
+    // built; control flow goes through place_label, emit_jump, emit_branch and emit_stop so that every block's
+    // exit is known. Once everything is generated, optimize_blocks tidies the control flow before the blocks
+    // are written out in order.
+
+    void place_label(const std::string &label) {
+        finish_block(block_exit::fall_through, "", "");
+        m_blocks.back().label = label;
+    }
+
+    void emit_jump(const std::string &label) {
+        finish_block(block_exit::jump, "", label);
+    }
+
+    // Jumps to label when condition code cc holds and falls through to a new block otherwise
+    void emit_branch(const std::string &cc, const std::string &label) {
+        finish_block(block_exit::branch, cc, label);
+    }
+
+    // Ends a block that never falls through (ret or an exit syscall)
+    void emit_stop() {
+        finish_block(block_exit::stop, "", "");
+    }
+
+    // Ends the program with the status in RDI, or returns it to the host when running under the JIT
+    void emit_exit() {
+        if (m_options.jit) {
+            m_jit_exit_used = true;
+            emit_jump("jit_exit");
+            return;
+        }
+        m_output << "    mov rax, 60\n";
+        m_output << "    syscall\n";
+        emit_stop();
+    }
+
+    void finish_block(block_exit exit, const std::string &cc, const std::string &target) {
+        basic_block &block = m_blocks.back();
+        block.code_end = m_output.size();
+        block.exit = exit;
+        block.cc = cc;
+        block.target = target;
+        m_blocks.push_back({.code_begin = m_output.size(), .code_end = m_output.size()});
+    }
+
+    static std::string invert_condition(const std::string &cc) {
+        static const std::pair<const char *, const char *> inverse[] = {
+            {"e", "ne"}, {"z", "nz"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"}, {"be", "a"}};
+        for (const auto &[a, b] : inverse) {
+            if (cc == a) {
+                return b;
+            }
+            if (cc == b) {
+                return a;
+            }
+        }
+        assert(false);
+        return cc;
+    }
+
+    // Index of the block a label names, if any
+    // Uses the index built by index_blocks, so it must be rebuilt whenever blocks move or are relabelled
+    std::optional<size_t> find_block(const std::string &label) const {
+        auto it = m_block_index.find(label);
+        if (it == m_block_index.end()) {
+            return {};
+        }
+        return it->second;
+    }
+
+    void index_blocks() {
+        m_block_index.clear();
+        for (size_t i = 0; i < m_blocks.size(); ++i) {
+            if (!m_blocks[i].label.empty()) {
+                m_block_index.emplace(m_blocks[i].label, i); // The first block with a label wins
+            }
+        }
+    }
+
+    // Where control really ends up when it reaches a block: empty blocks that only jump or fall through are
+    // skipped. Stops on cycles and at blocks without a label to jump to. Every label passed is remembered in
+    // resolved with where it ends up, so a long chain of empty blocks is walked once rather than once per jump.
+    std::string resolve_target(const std::string &label,
+                               std::unordered_map<std::string, std::string> &resolved) const {
+        std::string target = label;
+        std::vector<std::string> passed;
+        for (size_t steps = 0; steps < m_blocks.size(); ++steps) {
+            if (auto it = resolved.find(target); it != resolved.end()) {
+                target = it->second;
+                break;
+            }
+            passed.push_back(target);
+            std::optional<size_t> index = find_block(target);
+            if (!index.has_value() || !m_blocks[index.value()].empty()) {
+                break;
+            }
+            const basic_block &block = m_blocks[index.value()];
+            if (block.exit == block_exit::jump) {
+                target = block.target;
+            } else if (block.exit == block_exit::fall_through && index.value() + 1 < m_blocks.size() &&
+                       !m_blocks[index.value() + 1].label.empty()) {
+                target = m_blocks[index.value() + 1].label;
+            } else {
+                break;
+            }
+        }
+        for (std::string &label : passed) {
+            resolved.emplace(std::move(label), target);
+        }
+        return target;
+    }
+
+    // Rewrites the block list until nothing changes:
+    //  - jump threading: jumps and branches to an empty block that only jumps on go straight to the final target
+    //  - 'jcc A; jmp B; A:' becomes 'jncc B; A:' so the likely path falls through
+    //  - a jump to the block that follows it is dropped
+    //  - blocks that cannot be reached (dead code after jmp/ret/exit) and empty unreferenced blocks are removed
+    // entries are the labels reachable from outside the block graph (_start and functions, which are called).
+    // Jump table targets count as referenced and reachable.
+    void optimize_blocks(const std::unordered_set<std::string_view> &entries) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            index_blocks();
+            std::unordered_map<std::string, std::string> resolved; // See resolve_target
+
+            for (basic_block &block : m_blocks) {
+                if (block.exit == block_exit::jump || block.exit == block_exit::branch) {
+                    std::string target = resolve_target(block.target, resolved);
+                    if (target != block.target) {
+                        block.target = target;
+                        changed = true;
+                    }
+                }
+            }
+            for (jump_table &table : m_jump_tables) {
+                for (std::string &target : table.targets) {
+                    std::string final_target = resolve_target(target, resolved);
+                    if (final_target != target) {
+                        target = final_target;
+                        changed = true;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i + 2 < m_blocks.size(); ++i) {
+                basic_block &branch = m_blocks[i];
+                basic_block &jump = m_blocks[i + 1];
+                if (branch.exit == block_exit::branch && jump.label.empty() && jump.empty() &&
+                    jump.exit == block_exit::jump && m_blocks[i + 2].label == branch.target) {
+                    branch.cc = invert_condition(branch.cc);
+                    branch.target = jump.target;
+                    jump.exit = block_exit::fall_through;
+                    jump.target.clear();
+                    changed = true;
+                }
+            }
+
+            for (size_t i = 0; i + 1 < m_blocks.size(); ++i) {
+                basic_block &block = m_blocks[i];
+                if ((block.exit == block_exit::jump || block.exit == block_exit::branch) &&
+                    m_blocks[i + 1].label == block.target) {
+                    block.exit = block_exit::fall_through;
+                    block.cc.clear();
+                    block.target.clear();
+                    changed = true;
+                }
+            }
+
+            // Mark everything reachable from the entries, following jumps, branches and fall-through
+            std::vector<bool> reachable(m_blocks.size(), false);
+            std::vector<size_t> work{0};
+            for (std::string_view entry : entries) {
+                if (auto index = find_block(std::string(entry))) {
+                    work.push_back(index.value());
+                }
+            }
+            for (const jump_table &table : m_jump_tables) {
+                for (const std::string &target : table.targets) {
+                    if (auto index = find_block(target)) {
+                        work.push_back(index.value());
+                    }
+                }
+            }
+            while (!work.empty()) {
+                size_t index = work.back();
+                work.pop_back();
+                if (reachable[index]) {
+                    continue;
+                }
+                reachable[index] = true;
+                const basic_block &block = m_blocks[index];
+                if (block.exit == block_exit::jump || block.exit == block_exit::branch) {
+                    if (auto target = find_block(block.target)) {
+                        work.push_back(target.value());
+                    }
+                }
+                if ((block.exit == block_exit::fall_through || block.exit == block_exit::branch) &&
+                    index + 1 < m_blocks.size()) {
+                    work.push_back(index + 1);
+                }
+            }
+
+            std::unordered_set<std::string_view> referenced = referenced_labels();
+            std::vector<basic_block> kept;
+            for (size_t i = 0; i < m_blocks.size(); ++i) {
+                const basic_block &block = m_blocks[i];
+                bool is_entry = entries.contains(block.label);
+                bool empty = block.empty() && block.exit == block_exit::fall_through && !is_entry && i > 0;
+                if (!reachable[i] || (empty && !referenced.contains(block.label))) {
+                    changed = true;
+                    continue;
+                }
+                kept.push_back(block);
+            }
+            m_blocks = std::move(kept);
+        }
+    }
+
+    // Labels some jump, branch or jump table goes to
+    std::unordered_set<std::string_view> referenced_labels() const {
+        std::unordered_set<std::string_view> referenced;
+        for (const jump_table &table : m_jump_tables) {
+            referenced.insert(table.targets.cbegin(), table.targets.cend());
+        }
+        for (const basic_block &block : m_blocks) {
+            if (block.exit == block_exit::jump || block.exit == block_exit::branch) {
+                referenced.insert(block.target);
+            }
+        }
+        return referenced;
+    }
+
+    // Writes the blocks out in order. Labels nothing refers to are left out.
+    void render_blocks(asm_buffer &output, const std::unordered_set<std::string_view> &entries) const {
+        std::unordered_set<std::string_view> referenced = referenced_labels();
+        for (size_t i = 0; i < m_blocks.size(); ++i) {
+            const basic_block &block = m_blocks[i];
+            bool is_entry = entries.contains(block.label);
+            if (is_entry || (!block.label.empty() && referenced.contains(block.label))) {
+                output << block.label << ":\n";
+            }
+            output << m_output.view(block.code_begin, block.code_end);
+            if (block.exit == block_exit::jump) {
+                output << "    jmp " << block.target << "\n";
+            } else if (block.exit == block_exit::branch) {
+                output << "    j" << block.cc << " " << block.target << "\n";
+            }
+        }
+    }
+
+    void begin_scope() {
+        m_scopes.push_back(m_variables.size());
+    }
+
+    // The slots of the scope's variables are free for the next scope to reuse, the frame itself stays
+    void end_scope() {
+        size_t pop_count = m_variables.size() - m_scopes.back();
+        size_t slot_count = 0; // Arrays take one slot per element, static arrays none
+        for (size_t i = m_scopes.back(); i < m_variables.size(); ++i) {
+            slot_count += m_variables[i].slots();
+        }
+        m_locals -= slot_count;
+
+        for (size_t i = 0; i < pop_count; ++i) {
+            m_variable_index.erase(m_variables.back().name);
+            m_variables.pop_back();
+        }
+        m_scopes.pop_back();
+    }
+
+    variable &lookup_scalar(const token &ident) {
+        variable *var = find_variable(ident.value.value());
+        if (var == nullptr) {
+            report_error("Error: Undeclared Identifier ", ident.value.value());
+        }
+        if (var->array_size > 0) {
+            report_error("Error: Array '", var->name, "' must be indexed");
+        }
+        return *var;
+    }
+
+    const variable &lookup_array(const token &ident) const {
+        const variable *var = find_variable(ident.value.value());
+        if (var == nullptr) {
+            report_error("Error: Undeclared Identifier ", ident.value.value());
+        }
+        if (var->array_size == 0) {
+            report_error("Error: '", var->name, "' is not an array");
+        }
+        return *var;
+    }
+
+    static bool in_bounds(const value_range &range, const variable &var) {
+        return range.lo >= 0 && static_cast<uint64_t>(range.hi) < var.array_size;
+    }
+
+    // A name is declared at most once among the variables in scope, so it indexes them
+    variable *find_variable(std::string_view name) {
+        auto it = m_variable_index.find(name);
+        return it == m_variable_index.end() ? nullptr : &m_variables[it->second];
+    }
+
+    const variable *find_variable(std::string_view name) const {
+        auto it = m_variable_index.find(name);
+        return it == m_variable_index.end() ? nullptr : &m_variables[it->second];
+    }
+
+    // Adds a variable to the innermost scope, where find_variable can see it until end_scope
+    void declare(variable var) {
+        m_variable_index.emplace(var.name, m_variables.size());
+        m_variables.push_back(std::move(var));
+    }
+
+    // Slot of the frame holding a scalar variable or parameter
+    memory_operand slot_of(const variable &var) const {
+        return {.base = "rbp", .offset = var.offset, .sized = true};
+    }
+
+    // Slot of the frame holding temporary index, below every local
+    memory_operand temp_slot(size_t index) const {
+        return {.base = "rbp", .offset = -8 * static_cast<int64_t>(m_frame.locals + index + 1), .sized = true};
+    }
+
+    // Takes the next slots of the frame for a variable and returns the offset of the lowest one
+    int64_t allocate_locals(size_t slots) {
+        m_locals += slots;
+        assert(m_locals <= m_frame.locals); // measure_frame reserved too few
+        return -8 * static_cast<int64_t>(m_locals);
+    }
+
+    // Memory operand for an element, indexed by a register or by a constant when index_reg is empty
+    memory_operand element_operand(const variable &var, std::string_view index_reg, int64_t index) const {
+        memory_operand operand = element_address(var, index_reg, index);
+        operand.sized = true;
+        return operand;
+    }
+
+    // Address of an element without an operand size, as used by vector loads and stores
+    memory_operand element_address(const variable &var, std::string_view index_reg, int64_t index) const {
+        if (!var.static_label.empty()) {
+            return {.base = var.static_label, .index = index_reg, .offset = index * 8, .sized = false};
+        }
+        return {.base = "rbp", .index = index_reg, .offset = var.offset + index * 8, .sized = false};
+    }
+
+    // An unsigned compare catches negative indices as well as ones past the end
+    void emit_bounds_check(const std::string &index_reg, size_t size) {
+        if (!m_options.bounds_checks) {
+            return;
+        }
+        if (size <= INT32_MAX) {
+            m_output << "    cmp " << index_reg << ", " << size << "\n";
+        } else {
+            m_output << "    mov rbx, " << size << "\n";
+            m_output << "    cmp " << index_reg << ", rbx\n";
+        }
+        emit_branch("ae", "bounds_fail");
+        m_bounds_fail_used = true;
+    }
+
+    // Drops the frame, returns to the caller and drops the callee's arguments
+    void emit_ret(size_t param_count) {
+        m_output << "    leave\n";
+        if (param_count > 0) {
+            m_output << "    ret " << param_count * 8 << "\n";
+        } else {
+            m_output << "    ret\n";
+        }
+        emit_stop();
+    }
+
+    std::string create_label() {
+        return m_unit_prefix + "label" + std::to_string(m_label_count++);
+    }
+
+    const function &lookup_function(const node_term_call *term_call) const {
+        std::string_view name = term_call->ident.value.value();
+        auto it = m_function_index.find(name);
+        if (it == m_function_index.end()) {
+            report_error("Error: Undeclared function ", name);
+        }
+        const function &fn = m_functions[it->second];
+        if (fn.param_count != term_call->args.size()) {
+            report_error("Error: Function '", name, "' expects ", fn.param_count, " argument(s), got ",
+                         term_call->args.size());
+        }
+        return fn;
+    }
 
-    const node_program m_prog;           // Stores the parsed program (AST)
-    std::stringstream m_output;          // Used to construct the assembly output
-    size_t m_stack_size = 0;             // Tracks the current stack size
+    const node_program &m_prog;          // The parsed program (AST), owned by the caller
+    const generator_options m_options;
+    std::vector<extern_function> m_externs{}; // Functions of other modules, in m_functions ahead of our own
+    asm_buffer m_output;                 // Code of every block, each one a range of it
+    frame_size m_frame;                  // Slots reserved below RBP for the function or program being generated
+    size_t m_locals = 0;                 // Slots of m_frame.locals the variables in scope take
+    size_t m_temps = 0;                  // Temporaries holding spilled operands
     std::vector<variable> m_variables{}; // Symbol table for variable storage
+    std::unordered_map<std::string_view, size_t> m_variable_index{}; // Position of each name in m_variables
     std::vector<size_t> m_scopes{};      // stores the scopes
+    std::string m_unit_prefix;           // Start of every generated name, "fn_name." inside a function body
     int m_label_count = 0;               // stores number of labels
+    size_t m_jump_table_count = 0;       // Jump tables named so far in this unit
+    size_t m_static_count = 0;           // Static arrays named so far in this unit
+    std::vector<function> m_functions{}; // Function table, filled before any code is generated
+    std::unordered_map<std::string_view, size_t> m_function_index{}; // Position of each name in m_functions
+    std::shared_ptr<const assignment_index> m_assignments; // Of the program, or of the function being generated
+    std::optional<size_t> m_fn_params;   // Parameter count of the function being generated, if any
+    std::vector<static_array> m_statics{}; // Static arrays to reserve in .bss
+    std::vector<basic_block> m_blocks{1};  // Finished blocks plus the one m_output is filling
+    std::unordered_map<std::string, size_t> m_block_index{}; // Block each label starts, see index_blocks
+    std::vector<jump_table> m_jump_tables{};
+    bool m_bounds_fail_used = false;       // Whether any bounds check jumps to bounds_fail
+    bool m_jit_exit_used = false;          // Whether any exit jumps to jit_exit
+    std::vector<expr_task> m_expr_tasks{}; // Expression work not done yet, innermost last
+    std::vector<statement_task> m_statement_tasks{}; // Statement work not done yet, innermost last
 };
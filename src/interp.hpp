@@ -0,0 +1,962 @@
+#pragma once // Ensures this header file is only included once during compilation
+
+#include "parser.hpp" // Includes the parser, which provides the AST (Abstract Syntax Tree)
+#include <algorithm>
+#include <charconv> // For reading integer literals
+#include <csignal> // For raise, to fail like the native code on division by zero
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map> // For finding variables, functions and constants by name or value
+#include <unordered_set>
+#include <vector>
+
+// ============================= BYTECODE =============================
+
+// Register machine instructions. Registers are numbered from the base of the current frame; a function's
+// parameters are its registers 0 to n-1, followed by its locals and temporaries.
+enum class opcode : uint8_t {
+    load_const,       // r[a] = constants[b]
+    move,             // r[a] = r[b]
+    add,              // r[a] = r[b] + r[c]
+    sub,              // r[a] = r[b] - r[c]
+    mul,              // r[a] = r[b] * r[c]
+    div,              // r[a] = r[b] / r[c], unsigned like the native 'div'
+    mod,              // r[a] = r[b] % r[c], signed like the native 'idiv'
+    eq,               // r[a] = r[b] == r[c], and so on for the other comparisons
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    logical_not,      // r[a] = r[b] == 0
+    jump,             // pc = a
+    jump_if_zero,     // if r[a] == 0: pc = b
+    jump_if_not_zero, // if r[a] != 0: pc = b
+    jump_if_equal,    // if r[a] == constants[b]: pc = c
+    zero,             // r[a .. a + b) = 0
+    check_index,      // if unsigned r[a] >= b: fail the bounds check
+    load_element,     // r[a] = r[b + r[c]]
+    store_element,    // r[a + r[b]] = r[c]
+    load_static,      // r[a] = statics[b + r[c]]
+    store_static,     // statics[a + r[b]] = r[c]
+    call,             // r[a] = functions[b](r[c], r[c + 1], ...), the callee's frame starts at r[c]
+    tail_call,        // Moves r[c], r[c + 1], ... to r[0], r[1], ... and jumps to functions[b]
+    ret,              // Returns r[a] to the caller
+    exit              // Stops with status r[a]
+};
+
+struct instruction {
+    opcode op;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+};
+
+// Entry point and frame layout of a compiled function
+struct bytecode_function {
+    std::string name;
+    uint32_t entry = 0;
+    uint32_t param_count = 0;
+    uint32_t frame_size = 0; // Registers used, parameters included
+};
+
+// Structure representing a compiled program. The main program is functions[0].
+struct bytecode_program {
+    std::vector<instruction> code;
+    std::vector<int64_t> constants;
+    std::vector<bytecode_function> functions;
+    size_t static_size = 0; // Elements of all static arrays together
+};
+
+// ============================= BYTECODE COMPILER =============================
+
+// Most registers a frame, and most elements all static arrays together, may take. A program that needs more is
+// rejected as it is compiled rather than failing to allocate its memory when it runs; 8-byte registers make these
+// 512 MiB and 1 GiB.
+constexpr size_t bytecode_max_frame = size_t{1} << 26;
+constexpr size_t bytecode_max_static = size_t{1} << 27;
+
+// The bytecode_compiler converts the parsed AST into a bytecode_program. It reports the same errors as the
+// generator and evaluates in the same order: the right operand of an arithmetic operator or a comparison before
+// the left one, the arguments of a call from left to right, and the value of an array store before its index.
+class bytecode_compiler {
+  private:
+    // Structure representing a variable: a register, or a run of registers or static elements for an array
+    struct variable {
+        std::string_view name;   // Interned, see symbol_interner
+        uint32_t reg = 0;        // First register, or first static element for a static array
+        size_t array_size = 0;   // 0 for scalars
+        bool is_static = false;
+    };
+
+    // What end_scope restores when a scope closes
+    struct scope_mark {
+        size_t variables = 0; // Size of m_variables when the scope began
+        uint32_t regs = 0;    // m_variable_regs when the scope began
+    };
+
+    // One step of expression compilation, see run_expr_tasks
+    struct expr_task {
+        enum class kind {
+            value,       // Evaluate expr into register dst
+            operand,     // Push the register holding the value of expr onto m_operands, see compile_operand
+            arithmetic,  // Pop the left then the right operand and emit op into dst
+            branch,      // Pop an operand and emit the conditional jump op on it, pushing the jump onto m_jumps
+            logical,     // Pop the jumps of both operands of && (op jump_if_zero) or || and set dst to 0 or 1
+            call,        // Call function index once the arguments from register first are evaluated into them
+            index,       // Pop the index and read the element of the array in term_index into dst
+            logical_not  // Pop an operand and set dst to 1 if it is 0, otherwise 0
+        } kind;
+        const node_expr *expr = nullptr;
+        const node_term_index *term_index = nullptr;
+        opcode op = opcode::move;
+        uint32_t dst = 0;
+        uint32_t index = 0; // Function of a call
+        uint32_t first = 0; // First argument register of a call
+        uint32_t top = 0;   // Lowest free register before the node, freed back to once it is done
+    };
+
+    // One step of the statement walk, see run_statement_tasks
+    struct statement_task {
+        enum class kind {
+            statement,  // Compile stmt
+            scope,      // Open scope and queue its statements
+            end_scope,  // Drop the variables of the innermost scope
+            release,    // Free the temporaries of the statement that queued it
+            if_then,    // The then-scope of stmt_if is done, jump is taken when the condition is false
+            if_else,    // The else-scope is done, jump skips over it
+            while_body, // The body is done, jump leaves the loop and target is the condition
+            match_arm   // The arms of stmt_match before index are done, see next_match_arm
+        } kind;
+        const node_statement *stmt = nullptr;
+        const node_scope *scope = nullptr;
+        const node_statement_if *stmt_if = nullptr;
+        const node_statement_match *stmt_match = nullptr;
+        std::vector<size_t> jumps; // Jump to each arm of a match, then the jumps that end its arms
+        size_t jump = 0;
+        uint32_t target = 0;
+        size_t index = 0;
+    };
+
+  public:
+    inline explicit bytecode_compiler(const node_program &prog) : m_prog(prog) {}
+
+    bytecode_program compile_program() {
+        m_out.functions.push_back({.name = "", .entry = 0, .param_count = 0});
+        for (const node_statement *stmt : m_prog.stmts) {
+            if (auto stmt_fn = std::get_if<node_statement_fn *>(&stmt->var)) {
+                std::string_view name = (*stmt_fn)->ident.value.value();
+                if (find_function(name) != 0) {
+                    report_error("Error: Function already exists: ", name);
+                }
+                m_function_index.emplace(name, static_cast<uint32_t>(m_out.functions.size()));
+                m_out.functions.push_back(
+                    {.name = std::string(name), .param_count = static_cast<uint32_t>((*stmt_fn)->params.size())});
+            }
+        }
+
+        // Main program, exiting with 0 if it runs off the end
+        for (const node_statement *stmt : m_prog.stmts) {
+            compile_statement(*stmt);
+        }
+        uint32_t status = temp();
+        emit({opcode::load_const, status, constant(0)});
+        emit({opcode::exit, status});
+        m_out.functions[0].frame_size = m_max_reg;
+
+        size_t index = 1;
+        for (const node_statement *stmt : m_prog.stmts) {
+            if (auto stmt_fn = std::get_if<node_statement_fn *>(&stmt->var)) {
+                compile_function(*stmt_fn, m_out.functions[index++]);
+            }
+        }
+        return std::move(m_out);
+    }
+
+  private:
+    // ============================= FUNCTIONS =============================
+
+    void compile_function(const node_statement_fn *stmt_fn, bytecode_function &fn) {
+        m_variables.clear();
+        m_variable_index.clear();
+        m_scopes.clear();
+        m_variable_regs = 0;
+        m_next_reg = 0;
+        m_max_reg = 0;
+        for (const token &param : stmt_fn->params) {
+            if (find_variable(param.value.value()) != nullptr) {
+                report_error("Error: Duplicate parameter ", param.value.value());
+            }
+            declare({.name = param.value.value(), .reg = temp()});
+        }
+        m_in_function = true;
+        fn.entry = static_cast<uint32_t>(m_out.code.size());
+        compile_scope(stmt_fn->body());
+        // Falling off the end of a function returns 0
+        uint32_t result = temp();
+        emit({opcode::load_const, result, constant(0)});
+        emit({opcode::ret, result});
+        fn.frame_size = m_max_reg;
+        m_in_function = false;
+    }
+
+    // Index into m_out.functions, 0 (the main program) when there is no such function
+    uint32_t find_function(std::string_view name) const {
+        auto it = m_function_index.find(name);
+        return it != m_function_index.end() ? it->second : 0;
+    }
+
+    uint32_t lookup_function(const node_term_call *term_call) const {
+        std::string_view name = term_call->ident.value.value();
+        uint32_t index = find_function(name);
+        if (index == 0) {
+            report_error("Error: Undeclared function ", name);
+        }
+        const bytecode_function &fn = m_out.functions[index];
+        if (fn.param_count != term_call->args.size()) {
+            report_error("Error: Function '", name, "' expects ", fn.param_count, " argument(s), got ",
+                         term_call->args.size());
+        }
+        return index;
+    }
+
+    // Evaluates the arguments into consecutive registers and returns the first of them
+    uint32_t compile_args(const node_term_call *term_call) {
+        uint32_t first = temps(term_call->args.size());
+        size_t base = m_expr_tasks.size();
+        queue_args(term_call, first);
+        run_expr_tasks(base);
+        return first;
+    }
+
+    // Queues the arguments so the first is evaluated first
+    void queue_args(const node_term_call *term_call, uint32_t first) {
+        for (size_t i = term_call->args.size(); i-- > 0;) {
+            m_expr_tasks.push_back(
+                {.kind = expr_task::kind::value, .expr = term_call->args[i], .dst = first + static_cast<uint32_t>(i)});
+        }
+    }
+
+    // ============================= EXPRESSIONS =============================
+
+    // Expressions are compiled without recursion, like the generator does, so how deeply they nest is limited by
+    // memory rather than the native stack. Visiting a node queues the step that finishes it and then its operands,
+    // which leave their registers on m_operands (and conditional jumps on m_jumps) for that step to take.
+
+    // Register holding the value of expr: the variable itself for a plain identifier, otherwise a new temporary
+    uint32_t compile_operand(const node_expr *expr) {
+        size_t base = m_expr_tasks.size();
+        m_expr_tasks.push_back({.kind = expr_task::kind::operand, .expr = expr});
+        run_expr_tasks(base);
+        return pop_operand();
+    }
+
+    // Evaluates expr into register dst
+    void compile_expr(const node_expr *expr, uint32_t dst) {
+        size_t base = m_expr_tasks.size();
+        m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = expr, .dst = dst});
+        run_expr_tasks(base);
+    }
+
+    // Takes the register an operand task left
+    uint32_t pop_operand() {
+        uint32_t reg = m_operands.back();
+        m_operands.pop_back();
+        return reg;
+    }
+
+    size_t pop_jump() {
+        size_t jump = m_jumps.back();
+        m_jumps.pop_back();
+        return jump;
+    }
+
+    // Runs the tasks queued above base until they are all done
+    void run_expr_tasks(size_t base) {
+        while (m_expr_tasks.size() > base) {
+            expr_task task = m_expr_tasks.back();
+            m_expr_tasks.pop_back();
+            switch (task.kind) {
+            case expr_task::kind::value:
+                if (auto term = std::get_if<node_term *>(&task.expr->var)) {
+                    visit_term(*term, task.dst);
+                } else {
+                    visit_bin_expr(std::get<node_binary_expr *>(task.expr->var), task.dst);
+                }
+                break;
+            case expr_task::kind::operand:
+                if (auto term = std::get_if<node_term *>(&task.expr->var)) {
+                    if (auto term_ident = std::get_if<node_term_identifier *>(&(*term)->var)) {
+                        m_operands.push_back(lookup_scalar((*term_ident)->identifier).reg);
+                        break;
+                    }
+                }
+                m_operands.push_back(temp());
+                m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = task.expr, .dst = m_operands.back()});
+                break;
+            case expr_task::kind::arithmetic: {
+                uint32_t l = pop_operand();
+                uint32_t r = pop_operand();
+                emit({task.op, task.dst, l, r});
+                m_next_reg = task.top;
+                break;
+            }
+            case expr_task::kind::branch:
+                m_jumps.push_back(emit({task.op, pop_operand()}));
+                break;
+            case expr_task::kind::logical: {
+                // dst = lhs && rhs (or ||), where either jump is taken once its operand decides the result
+                bool is_or = task.op == opcode::jump_if_not_zero;
+                size_t rhs_jump = pop_jump();
+                size_t lhs_jump = pop_jump();
+                emit({opcode::load_const, task.dst, constant(is_or ? 0 : 1)});
+                size_t end_jump = emit({opcode::jump});
+                patch_b(lhs_jump);
+                patch_b(rhs_jump);
+                emit({opcode::load_const, task.dst, constant(is_or ? 1 : 0)});
+                patch_a(end_jump);
+                m_next_reg = task.top;
+                break;
+            }
+            case expr_task::kind::call:
+                emit({opcode::call, task.dst, task.index, task.first});
+                m_next_reg = task.top;
+                break;
+            case expr_task::kind::index: {
+                const variable &var = lookup_array(task.term_index->ident);
+                uint32_t index = pop_operand();
+                emit({opcode::check_index, index, static_cast<uint32_t>(var.array_size)});
+                emit({var.is_static ? opcode::load_static : opcode::load_element, task.dst, var.reg, index});
+                m_next_reg = task.top;
+                break;
+            }
+            case expr_task::kind::logical_not:
+                emit({opcode::logical_not, task.dst, pop_operand()});
+                m_next_reg = task.top;
+                break;
+            }
+        }
+    }
+
+    // Compiles a term whose operands need no registers, or queues its operands and the step that finishes it
+    void visit_term(const node_term *term, uint32_t dst) {
+        struct term_visitor {
+            bytecode_compiler *comp;
+            uint32_t dst;
+
+            void operator()(const node_term_int_lit *term_int_lit) const {
+                std::string_view digits = term_int_lit->int_lit.value.value();
+                int64_t value;
+                if (std::from_chars(digits.data(), digits.data() + digits.size(), value).ec != std::errc()) {
+                    report_error("Error: Integer literal out of range: ", digits);
+                }
+                comp->emit({opcode::load_const, dst, comp->constant(value)});
+            }
+
+            void operator()(const node_term_identifier *term_ident) const {
+                comp->emit({opcode::move, dst, comp->lookup_scalar(term_ident->identifier).reg});
+            }
+
+            void operator()(const node_term_parentheses *term_paren) const {
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::value, .expr = term_paren->expr, .dst = dst});
+            }
+
+            void operator()(const node_term_call *term_call) const {
+                if (term_call->is_tail) {
+                    report_error("Error: Call to '", term_call->ident.value.value(),
+                                 "' is marked 'tail' but is not in tail position, so it cannot be optimized");
+                }
+                uint32_t top = comp->m_next_reg;
+                uint32_t fn = comp->lookup_function(term_call);
+                uint32_t first = comp->temps(term_call->args.size());
+                comp->m_expr_tasks.push_back(
+                    {.kind = expr_task::kind::call, .dst = dst, .index = fn, .first = first, .top = top});
+                comp->queue_args(term_call, first);
+            }
+
+            void operator()(const node_term_index *term_index) const {
+                comp->lookup_array(term_index->ident);
+                comp->m_expr_tasks.push_back(
+                    {.kind = expr_task::kind::index, .term_index = term_index, .dst = dst, .top = comp->m_next_reg});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::operand, .expr = term_index->index});
+            }
+
+            void operator()(const node_term_not *term_not) const {
+                comp->m_expr_tasks.push_back(
+                    {.kind = expr_task::kind::logical_not, .dst = dst, .top = comp->m_next_reg});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::operand, .expr = term_not->expr});
+            }
+        };
+
+        std::visit(term_visitor{.comp = this, .dst = dst}, term->var);
+    }
+
+    // Queues the operands of a binary expression and the step that combines them into dst
+    void visit_bin_expr(const node_binary_expr *bin_expr, uint32_t dst) {
+        struct binary_expr_visitor {
+            bytecode_compiler *comp;
+            uint32_t dst;
+
+            // The right operand is queued last, so it is evaluated first
+            void arithmetic(opcode op, const node_expr *lhs, const node_expr *rhs) const {
+                comp->m_expr_tasks.push_back(
+                    {.kind = expr_task::kind::arithmetic, .op = op, .dst = dst, .top = comp->m_next_reg});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::operand, .expr = lhs});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::operand, .expr = rhs});
+            }
+
+            void operator()(const node_binary_expr_add *add) const {
+                arithmetic(opcode::add, add->lhs, add->rhs);
+            }
+
+            void operator()(const node_binary_expr_minus *minus) const {
+                arithmetic(opcode::sub, minus->lhs, minus->rhs);
+            }
+
+            void operator()(const node_binary_expr_multiply *multiply) const {
+                arithmetic(opcode::mul, multiply->lhs, multiply->rhs);
+            }
+
+            void operator()(const node_binary_expr_divide *divide) const {
+                arithmetic(opcode::div, divide->lhs, divide->rhs);
+            }
+
+            void operator()(const node_binary_expr_modulus *modulus) const {
+                arithmetic(opcode::mod, modulus->lhs, modulus->rhs);
+            }
+
+            void operator()(const node_binary_expr_compare *compare) const {
+                static const opcode ops[] = {opcode::eq, opcode::ne, opcode::lt, opcode::le, opcode::gt, opcode::ge};
+                arithmetic(ops[static_cast<int>(compare->op)], compare->lhs, compare->rhs);
+            }
+
+            // Each operand is followed by a jump that skips the rest once it decides the result
+            void logical(const node_expr *lhs, const node_expr *rhs, bool is_or) const {
+                opcode decided = is_or ? opcode::jump_if_not_zero : opcode::jump_if_zero;
+                comp->m_expr_tasks.push_back(
+                    {.kind = expr_task::kind::logical, .op = decided, .dst = dst, .top = comp->m_next_reg});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::branch, .op = decided});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::operand, .expr = rhs});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::branch, .op = decided});
+                comp->m_expr_tasks.push_back({.kind = expr_task::kind::operand, .expr = lhs});
+            }
+
+            void operator()(const node_binary_expr_and *and_expr) const {
+                logical(and_expr->lhs, and_expr->rhs, false);
+            }
+
+            void operator()(const node_binary_expr_or *or_expr) const {
+                logical(or_expr->lhs, or_expr->rhs, true);
+            }
+        };
+
+        std::visit(binary_expr_visitor{.comp = this, .dst = dst}, bin_expr->var);
+    }
+
+    // ============================= STATEMENTS =============================
+
+    // Scopes are walked on m_statement_tasks in the same way, so blocks can nest to any depth too
+
+    void compile_scope(const node_scope *scope) {
+        size_t base = m_statement_tasks.size();
+        m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = scope});
+        run_statement_tasks(base);
+    }
+
+    void compile_statement(const node_statement &stmt) {
+        size_t base = m_statement_tasks.size();
+        m_statement_tasks.push_back({.kind = statement_task::kind::statement, .stmt = &stmt});
+        run_statement_tasks(base);
+    }
+
+    // Runs the tasks queued above base until they are all done
+    void run_statement_tasks(size_t base) {
+        while (m_statement_tasks.size() > base) {
+            statement_task task = std::move(m_statement_tasks.back());
+            m_statement_tasks.pop_back();
+            switch (task.kind) {
+            case statement_task::kind::statement:
+                // Temporaries are freed once the statement, and any scope it queued, is done
+                m_statement_tasks.push_back({.kind = statement_task::kind::release});
+                visit_statement(*task.stmt);
+                break;
+            case statement_task::kind::scope:
+                begin_scope();
+                m_statement_tasks.push_back({.kind = statement_task::kind::end_scope});
+                for (auto it = task.scope->stmts.rbegin(); it != task.scope->stmts.rend(); ++it) {
+                    m_statement_tasks.push_back({.kind = statement_task::kind::statement, .stmt = *it});
+                }
+                break;
+            case statement_task::kind::end_scope:
+                end_scope();
+                break;
+            case statement_task::kind::release:
+                release_temps();
+                break;
+            case statement_task::kind::if_then:
+                if (task.stmt_if->else_scope == nullptr) {
+                    patch_b(task.jump);
+                    break;
+                }
+                m_statement_tasks.push_back({.kind = statement_task::kind::if_else, .jump = emit({opcode::jump})});
+                patch_b(task.jump);
+                m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = task.stmt_if->else_scope});
+                break;
+            case statement_task::kind::if_else:
+                patch_a(task.jump);
+                break;
+            case statement_task::kind::while_body:
+                emit({opcode::jump, task.target});
+                patch_b(task.jump);
+                break;
+            case statement_task::kind::match_arm:
+                next_match_arm(std::move(task));
+                break;
+            }
+        }
+    }
+
+    // Compiles a statement, queueing the scopes it contains and the steps that follow them
+    void visit_statement(const node_statement &stmt) {
+        struct statement_visitor {
+            bytecode_compiler *comp;
+
+            void operator()(const node_statement_exit &stmt_exit) const {
+                comp->emit({opcode::exit, comp->compile_operand(stmt_exit.expr)});
+            }
+
+            void operator()(const node_statement_let &stmt_let) const {
+                comp->check_new(stmt_let.ident.value.value());
+                uint32_t reg = comp->temp();
+                comp->compile_expr(stmt_let.expr, reg);
+                comp->declare({.name = stmt_let.ident.value.value(), .reg = reg});
+            }
+
+            void operator()(const node_scope *scope) const {
+                comp->m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = scope});
+            }
+
+            void operator()(const node_statement_if *stmt_if) const {
+                size_t skip_then = comp->emit({opcode::jump_if_zero, comp->compile_operand(stmt_if->expr)});
+                comp->release_temps();
+                comp->m_statement_tasks.push_back(
+                    {.kind = statement_task::kind::if_then, .stmt_if = stmt_if, .jump = skip_then});
+                comp->m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = stmt_if->scope});
+            }
+
+            void operator()(const node_statement_while *stmt_while) const {
+                uint32_t cond = static_cast<uint32_t>(comp->m_out.code.size());
+                size_t leave = comp->emit({opcode::jump_if_zero, comp->compile_operand(stmt_while->expr)});
+                comp->release_temps();
+                comp->m_statement_tasks.push_back(
+                    {.kind = statement_task::kind::while_body, .jump = leave, .target = cond});
+                comp->m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = stmt_while->scope});
+            }
+
+            void operator()(const node_statement_match *stmt_match) const {
+                comp->compile_match(stmt_match);
+            }
+
+            void operator()(const node_statement_return *stmt_return) const {
+                if (!comp->m_in_function) {
+                    report_error("Error: 'return' outside of function");
+                }
+                if (auto term = std::get_if<node_term *>(&stmt_return->expr->var)) {
+                    if (auto term_call = std::get_if<node_term_call *>(&(*term)->var)) {
+                        uint32_t fn = comp->lookup_function(*term_call);
+                        comp->emit({opcode::tail_call, 0, fn, comp->compile_args(*term_call)});
+                        return;
+                    }
+                }
+                comp->emit({opcode::ret, comp->compile_operand(stmt_return->expr)});
+            }
+
+            // Function bodies are compiled after the main program by compile_program
+            void operator()(const node_statement_fn *) const {}
+
+            void operator()(const node_statement_array *stmt_array) const {
+                comp->check_new(stmt_array->ident.value.value());
+                // The parser limits sizes to 32 bits, an AST file is checked here so the size is not truncated
+                if (stmt_array->size > UINT32_MAX) {
+                    report_error("Error: Size of array '", stmt_array->ident.value.value(), "' out of range: ",
+                                 stmt_array->size);
+                }
+                variable var{.name = stmt_array->ident.value.value(), .array_size = stmt_array->size};
+                if (stmt_array->is_static) {
+                    if (stmt_array->size > bytecode_max_static - comp->m_out.static_size) {
+                        report_error("Error: Static arrays need more than ", bytecode_max_static,
+                                     " elements, too many for --interp");
+                    }
+                    var.is_static = true;
+                    var.reg = static_cast<uint32_t>(comp->m_out.static_size);
+                    comp->m_out.static_size += stmt_array->size;
+                } else {
+                    var.reg = comp->temps(stmt_array->size);
+                    comp->emit({opcode::zero, var.reg, static_cast<uint32_t>(stmt_array->size)});
+                }
+                comp->declare(var);
+            }
+
+            void operator()(const node_statement_assign *stmt_assign) const {
+                if (stmt_assign->index == nullptr) {
+                    comp->compile_expr(stmt_assign->expr, comp->lookup_scalar(stmt_assign->ident).reg);
+                    return;
+                }
+                const variable &var = comp->lookup_array(stmt_assign->ident);
+                uint32_t value = comp->compile_operand(stmt_assign->expr);
+                uint32_t index = comp->compile_operand(stmt_assign->index);
+                comp->emit({opcode::check_index, index, static_cast<uint32_t>(var.array_size)});
+                comp->emit({var.is_static ? opcode::store_static : opcode::store_element, var.reg, index, value});
+            }
+        };
+
+        std::visit(statement_visitor{.comp = this}, stmt.var);
+    }
+
+    // Checks the arms and emits the jump to each, then queues the first arm
+    void compile_match(const node_statement_match *stmt_match) {
+        std::unordered_set<int64_t> seen;
+        bool has_default = false;
+        for (const node_match_arm &arm : stmt_match->arms) {
+            if (!arm.value.has_value()) {
+                if (has_default) {
+                    report_error("Error: 'match' has more than one '_' arm");
+                }
+                has_default = true;
+            } else if (!seen.insert(arm.value.value()).second) {
+                report_error("Error: Duplicate 'match' arm ", arm.value.value());
+            }
+        }
+
+        uint32_t scrutinee = compile_operand(stmt_match->expr);
+        std::vector<size_t> arm_jumps(stmt_match->arms.size());
+        for (size_t i = 0; i < stmt_match->arms.size(); ++i) {
+            if (stmt_match->arms[i].value.has_value()) {
+                uint32_t value = constant(stmt_match->arms[i].value.value());
+                arm_jumps[i] = emit({opcode::jump_if_equal, scrutinee, value});
+            }
+        }
+        size_t default_jump = emit({opcode::jump});
+        release_temps();
+        m_statement_tasks.push_back({.kind = statement_task::kind::match_arm, .stmt_match = stmt_match,
+                                     .jumps = std::move(arm_jumps), .jump = default_jump});
+    }
+
+    // Ends the arm before task.index, if any, then starts the arm at it or, after the last one, patches the jumps
+    // that leave the match
+    void next_match_arm(statement_task task) {
+        const node_statement_match *stmt_match = task.stmt_match;
+        if (task.index > 0) {
+            task.jumps.push_back(emit({opcode::jump}));
+        }
+        if (task.index < stmt_match->arms.size()) {
+            const node_match_arm &arm = stmt_match->arms[task.index];
+            if (arm.value.has_value()) {
+                m_out.code[task.jumps[task.index]].c = static_cast<uint32_t>(m_out.code.size());
+            } else {
+                patch_a(task.jump);
+            }
+            ++task.index;
+            m_statement_tasks.push_back(std::move(task));
+            m_statement_tasks.push_back({.kind = statement_task::kind::scope, .scope = arm.scope});
+            return;
+        }
+        bool has_default = std::any_of(stmt_match->arms.cbegin(), stmt_match->arms.cend(),
+                                       [](const node_match_arm &arm) { return !arm.value.has_value(); });
+        if (!has_default) {
+            patch_a(task.jump);
+        }
+        for (size_t i = stmt_match->arms.size(); i < task.jumps.size(); ++i) {
+            patch_a(task.jumps[i]);
+        }
+    }
+
+    // ============================= HELPERS =============================
+
+    size_t emit(instruction inst) {
+        m_out.code.push_back(inst);
+        return m_out.code.size() - 1;
+    }
+
+    // Points a jump's target operand at the next instruction
+    void patch_a(size_t jump) {
+        m_out.code[jump].a = static_cast<uint32_t>(m_out.code.size());
+    }
+
+    void patch_b(size_t jump) {
+        m_out.code[jump].b = static_cast<uint32_t>(m_out.code.size());
+    }
+
+    uint32_t constant(int64_t value) {
+        auto [it, inserted] = m_constant_index.emplace(value, static_cast<uint32_t>(m_out.constants.size()));
+        if (inserted) {
+            m_out.constants.push_back(value);
+        }
+        return it->second;
+    }
+
+    // Allocates a register above every live variable and temporary
+    uint32_t temp() {
+        return temps(1);
+    }
+
+    // Allocates count consecutive registers and returns the first
+    uint32_t temps(size_t count) {
+        if (count > bytecode_max_frame - m_next_reg) {
+            report_error("Error: A frame needs more than ", bytecode_max_frame, " registers, too many for --interp");
+        }
+        uint32_t first = m_next_reg;
+        m_next_reg += static_cast<uint32_t>(count);
+        m_max_reg = std::max(m_max_reg, m_next_reg);
+        return first;
+    }
+
+    // Frees every temporary, leaving only the registers of declared variables
+    void release_temps() {
+        m_next_reg = m_variable_regs;
+    }
+
+    // Adds a variable to the innermost scope. A variable's registers start at the lowest free one when it is
+    // declared, so they lie above those of every variable declared before it.
+    void declare(const variable &var) {
+        m_variable_index.emplace(var.name, m_variables.size());
+        m_variables.push_back(var);
+        if (!var.is_static) {
+            m_variable_regs = var.reg + static_cast<uint32_t>(std::max<size_t>(var.array_size, 1));
+        }
+    }
+
+    void begin_scope() {
+        m_scopes.push_back({.variables = m_variables.size(), .regs = m_variable_regs});
+    }
+
+    void end_scope() {
+        for (size_t i = m_scopes.back().variables; i < m_variables.size(); ++i) {
+            m_variable_index.erase(m_variables[i].name);
+        }
+        m_variables.resize(m_scopes.back().variables);
+        m_variable_regs = m_scopes.back().regs;
+        m_scopes.pop_back();
+        release_temps();
+    }
+
+    const variable *find_variable(std::string_view name) const {
+        auto it = m_variable_index.find(name);
+        return it != m_variable_index.end() ? &m_variables[it->second] : nullptr;
+    }
+
+    void check_new(std::string_view name) const {
+        if (find_variable(name) != nullptr) {
+            report_error("Error: Identifier already exists: ", name);
+        }
+    }
+
+    const variable &lookup_scalar(const token &ident) const {
+        const variable *var = find_variable(ident.value.value());
+        if (var == nullptr) {
+            report_error("Error: Undeclared Identifier ", ident.value.value());
+        }
+        if (var->array_size > 0) {
+            report_error("Error: Array '", var->name, "' must be indexed");
+        }
+        return *var;
+    }
+
+    const variable &lookup_array(const token &ident) const {
+        const variable *var = find_variable(ident.value.value());
+        if (var == nullptr) {
+            report_error("Error: Undeclared Identifier ", ident.value.value());
+        }
+        if (var->array_size == 0) {
+            report_error("Error: '", var->name, "' is not an array");
+        }
+        return *var;
+    }
+
+    const node_program &m_prog;
+    bytecode_program m_out;
+    std::vector<variable> m_variables{};                               // Symbol table of the function being compiled
+    std::unordered_map<std::string_view, size_t> m_variable_index{};   // Where each name is in m_variables
+    std::vector<scope_mark> m_scopes{};                                // One for each open scope
+    std::unordered_map<std::string_view, uint32_t> m_function_index{}; // Index of each function by name
+    std::unordered_map<int64_t, uint32_t> m_constant_index{};          // Index of each value in m_out.constants
+    std::vector<expr_task> m_expr_tasks{};
+    std::vector<statement_task> m_statement_tasks{};
+    std::vector<uint32_t> m_operands{}; // Registers of the operands compiled so far, see expr_task
+    std::vector<size_t> m_jumps{};      // Jumps of && and || operands still to be patched
+    uint32_t m_variable_regs = 0;       // Registers taken by the variables in scope, which start at 0
+    uint32_t m_next_reg = 0;            // Lowest free register
+    uint32_t m_max_reg = 0;             // Registers used so far by the function being compiled
+    bool m_in_function = false;
+};
+
+// ============================= INTERPRETER =============================
+
+// Runs a bytecode_program with a computed-goto dispatch loop and returns the status it exits with
+class interpreter {
+  public:
+    inline explicit interpreter(const bytecode_program &prog) : m_prog(prog) {}
+
+    int64_t run() {
+        const instruction *code = m_prog.code.data();
+        const int64_t *constants = m_prog.constants.data();
+        std::vector<int64_t> statics(m_prog.static_size, 0);
+        std::vector<int64_t> stack(std::max<size_t>(m_prog.functions[0].frame_size, 1) + 1024, 0);
+        std::vector<frame> frames;
+        size_t base = 0;
+        int64_t *r = stack.data();
+        const instruction *ip = code + m_prog.functions[0].entry;
+
+        static const void *const dispatch[] = {
+            &&op_load_const,   &&op_move,         &&op_add,          &&op_sub,           &&op_mul,
+            &&op_div,          &&op_mod,          &&op_eq,           &&op_ne,            &&op_lt,
+            &&op_le,           &&op_gt,           &&op_ge,           &&op_logical_not,   &&op_jump,
+            &&op_jump_if_zero, &&op_jump_if_not_zero, &&op_jump_if_equal, &&op_zero,      &&op_check_index,
+            &&op_load_element, &&op_store_element, &&op_load_static, &&op_store_static,  &&op_call,
+            &&op_tail_call,    &&op_ret,          &&op_exit};
+        static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == static_cast<size_t>(opcode::exit) + 1);
+
+#define DISPATCH() goto *dispatch[static_cast<size_t>(ip->op)]
+#define NEXT()                                                                                                         \
+    do {                                                                                                               \
+        ++ip;                                                                                                          \
+        DISPATCH();                                                                                                    \
+    } while (0)
+// Arithmetic wraps like the hardware instructions do
+#define BINARY(expr)                                                                                                   \
+    do {                                                                                                               \
+        uint64_t x = static_cast<uint64_t>(r[ip->b]);                                                                  \
+        uint64_t y = static_cast<uint64_t>(r[ip->c]);                                                                  \
+        r[ip->a] = static_cast<int64_t>(expr);                                                                         \
+        NEXT();                                                                                                        \
+    } while (0)
+
+        DISPATCH();
+
+    op_load_const:
+        r[ip->a] = constants[ip->b];
+        NEXT();
+    op_move:
+        r[ip->a] = r[ip->b];
+        NEXT();
+    op_add:
+        BINARY(x + y);
+    op_sub:
+        BINARY(x - y);
+    op_mul:
+        BINARY(x * y);
+    op_div:
+        if (r[ip->c] == 0) {
+            raise(SIGFPE);
+        }
+        BINARY(x / y);
+    op_mod:
+        if (r[ip->c] == 0 || (r[ip->b] == INT64_MIN && r[ip->c] == -1)) {
+            raise(SIGFPE);
+        }
+        r[ip->a] = r[ip->b] % r[ip->c];
+        NEXT();
+    op_eq:
+        r[ip->a] = r[ip->b] == r[ip->c];
+        NEXT();
+    op_ne:
+        r[ip->a] = r[ip->b] != r[ip->c];
+        NEXT();
+    op_lt:
+        r[ip->a] = r[ip->b] < r[ip->c];
+        NEXT();
+    op_le:
+        r[ip->a] = r[ip->b] <= r[ip->c];
+        NEXT();
+    op_gt:
+        r[ip->a] = r[ip->b] > r[ip->c];
+        NEXT();
+    op_ge:
+        r[ip->a] = r[ip->b] >= r[ip->c];
+        NEXT();
+    op_logical_not:
+        r[ip->a] = r[ip->b] == 0;
+        NEXT();
+    op_jump:
+        ip = code + ip->a;
+        DISPATCH();
+    op_jump_if_zero:
+        ip = r[ip->a] == 0 ? code + ip->b : ip + 1;
+        DISPATCH();
+    op_jump_if_not_zero:
+        ip = r[ip->a] != 0 ? code + ip->b : ip + 1;
+        DISPATCH();
+    op_jump_if_equal:
+        ip = r[ip->a] == constants[ip->b] ? code + ip->c : ip + 1;
+        DISPATCH();
+    op_zero:
+        std::fill(r + ip->a, r + ip->a + ip->b, 0);
+        NEXT();
+    op_check_index:
+        if (static_cast<uint64_t>(r[ip->a]) >= ip->b) {
+            std::cerr << "Error: array index out of bounds" << std::endl;
+            return 1;
+        }
+        NEXT();
+    op_load_element:
+        r[ip->a] = r[ip->b + r[ip->c]];
+        NEXT();
+    op_store_element:
+        r[ip->a + r[ip->b]] = r[ip->c];
+        NEXT();
+    op_load_static:
+        r[ip->a] = statics[ip->b + r[ip->c]];
+        NEXT();
+    op_store_static:
+        statics[ip->a + r[ip->b]] = r[ip->c];
+        NEXT();
+    op_call: {
+        const bytecode_function &fn = m_prog.functions[ip->b];
+        frames.push_back({.ret = ip + 1, .base = base, .dst = ip->a});
+        base += ip->c;
+        if (base + fn.frame_size > stack.size()) {
+            stack.resize(std::max(stack.size() * 2, base + fn.frame_size));
+        }
+        r = stack.data() + base;
+        ip = code + fn.entry;
+        DISPATCH();
+    }
+    op_tail_call: {
+        const bytecode_function &fn = m_prog.functions[ip->b];
+        std::copy(r + ip->c, r + ip->c + fn.param_count, r); // Forward copy is safe, the arguments sit higher
+        if (base + fn.frame_size > stack.size()) {
+            stack.resize(std::max(stack.size() * 2, base + fn.frame_size));
+            r = stack.data() + base;
+        }
+        ip = code + fn.entry;
+        DISPATCH();
+    }
+    op_ret: {
+        int64_t value = r[ip->a];
+        frame caller = frames.back();
+        frames.pop_back();
+        base = caller.base;
+        r = stack.data() + base;
+        r[caller.dst] = value;
+        ip = caller.ret;
+        DISPATCH();
+    }
+    op_exit:
+        return r[ip->a];
+
+#undef BINARY
+#undef NEXT
+#undef DISPATCH
+    }
+
+  private:
+    // Where a call returns to
+    struct frame {
+        const instruction *ret;
+        size_t base;
+        uint32_t dst; // Register of the caller that receives the result
+    };
+
+    const bytecode_program &m_prog;
+};
@@ -0,0 +1,633 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "diagnostics.hpp"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h> // For mmap, mprotect and munmap
+#include <unistd.h>   // For sysconf
+
+// ============================= JIT =============================
+
+// Assembles the generator's NASM output (built with generator_options::jit) into an executable mapping and runs it
+// in-process. Only the instructions the generator emits are understood. Everything is mapped in the low 2GB
+// (MAP_32BIT) so labels can be used as 32-bit absolute displacements, as in "[static0 + rax*8]".
+class jit {
+  public:
+    inline explicit jit(std::string_view assembly) {
+        size_t pos = 0;
+        while (pos < assembly.size()) {
+            size_t end = assembly.find('\n', pos);
+            if (end == std::string_view::npos) {
+                end = assembly.size();
+            }
+            assemble_line(assembly.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        load();
+    }
+
+    inline jit(const jit &) = delete;
+    inline jit &operator=(const jit &) = delete;
+
+    inline ~jit() {
+        if (m_memory != nullptr) {
+            munmap(m_memory, m_mapped);
+        }
+    }
+
+    // Calls _start and returns the status passed to exit()
+    inline int64_t run() const {
+        auto entry = reinterpret_cast<int64_t (*)()>(m_memory + m_symbols.at("_start").offset);
+        return entry();
+    }
+
+  private:
+    enum class section { text, rodata, bss };
+
+    struct symbol {
+        section sec;
+        size_t offset;
+    };
+
+    enum class reloc_kind {
+        rel32, // Displacement from the end of the 4 bytes
+        abs32, // Absolute address, must fit in a sign-extended 32-bit displacement
+        abs64
+    };
+
+    struct relocation {
+        section sec; // Where the field lives
+        size_t offset;
+        std::string symbol;
+        int64_t addend;
+        reloc_kind kind;
+    };
+
+    enum class operand_kind { reg, mem, imm, label };
+
+    struct operand {
+        operand_kind kind;
+        int reg = -1;       // Register number, for reg
+        int size = 64;      // Register width in bits, 128 for xmm
+        int base = -1;      // Base register of mem, -1 for none (absolute symbol or displacement)
+        int index = -1;     // Index register of mem, -1 for none
+        int scale = 1;
+        int64_t value = 0;  // Immediate, or displacement of mem
+        std::string symbol; // Label of label, or of mem with an absolute address
+    };
+
+    // ============================= PARSING =============================
+
+    static inline std::string_view trim(std::string_view text) {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    [[noreturn]] inline void fail(std::string_view line) const {
+        report_error("Error: --run cannot assemble '", trim(line), "'");
+    }
+
+    static inline bool parse_int(std::string_view text, int64_t &value) {
+        text = trim(text);
+        bool negative = !text.empty() && text.front() == '-';
+        if (negative) {
+            text.remove_prefix(1);
+        }
+        int base = 10;
+        if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+            base = 16;
+            text.remove_prefix(2);
+        }
+        if (text.empty()) {
+            return false;
+        }
+        uint64_t magnitude = 0;
+        for (char c : text) {
+            int digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (base == 16 && c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else if (base == 16 && c >= 'A' && c <= 'F') {
+                digit = c - 'A' + 10;
+            } else {
+                return false;
+            }
+            magnitude = magnitude * base + digit;
+        }
+        value = negative ? static_cast<int64_t>(0 - magnitude) : static_cast<int64_t>(magnitude);
+        return true;
+    }
+
+    // Register number and width, or false if text is not a register
+    static inline bool parse_reg(std::string_view text, int &reg, int &size) {
+        static const char *const regs64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                             "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+        static const char *const regs32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+        static const char *const regs8[] = {"al", "cl", "dl", "bl"};
+        for (int i = 0; i < 16; ++i) {
+            if (text == regs64[i]) {
+                reg = i;
+                size = 64;
+                return true;
+            }
+        }
+        for (int i = 0; i < 8; ++i) {
+            if (text == regs32[i]) {
+                reg = i;
+                size = 32;
+                return true;
+            }
+        }
+        for (int i = 0; i < 4; ++i) {
+            if (text == regs8[i]) {
+                reg = i;
+                size = 8;
+                return true;
+            }
+        }
+        if (text.size() > 3 && text.substr(0, 3) == "xmm") {
+            int64_t n;
+            if (parse_int(text.substr(3), n) && n >= 0 && n < 16) {
+                reg = static_cast<int>(n);
+                size = 128;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline operand parse_operand(std::string_view text, std::string_view line) const {
+        text = trim(text);
+        if (text.substr(0, 6) == "QWORD ") {
+            text = trim(text.substr(6));
+        }
+        operand op{};
+        if (!text.empty() && text.front() == '[') {
+            if (text.back() != ']') {
+                fail(line);
+            }
+            op.kind = operand_kind::mem;
+            std::string_view inner = trim(text.substr(1, text.size() - 2));
+            bool negative = false; // Only a displacement may be subtracted, as in "[rbp - 16]"
+            while (!inner.empty()) {
+                size_t sign = inner.find_first_of("+-", 1);
+                std::string_view term = trim(inner.substr(0, sign));
+                int reg, size;
+                int64_t n;
+                size_t star = term.find('*');
+                if (star != std::string_view::npos) {
+                    if (negative || !parse_reg(trim(term.substr(0, star)), reg, size) ||
+                        !parse_int(term.substr(star + 1), n)) {
+                        fail(line);
+                    }
+                    op.index = reg;
+                    op.scale = static_cast<int>(n);
+                } else if (parse_reg(term, reg, size) && !negative) {
+                    op.base = reg;
+                } else if (parse_int(term, n)) {
+                    op.value += negative ? -n : n;
+                } else if (!negative) {
+                    op.symbol = term;
+                } else {
+                    fail(line);
+                }
+                if (sign == std::string_view::npos) {
+                    break;
+                }
+                negative = inner[sign] == '-';
+                inner = trim(inner.substr(sign + 1));
+            }
+            return op;
+        }
+        if (parse_reg(text, op.reg, op.size)) {
+            op.kind = operand_kind::reg;
+        } else if (parse_int(text, op.value)) {
+            op.kind = operand_kind::imm;
+        } else {
+            op.kind = operand_kind::label;
+            op.symbol = text;
+        }
+        return op;
+    }
+
+    static inline int condition_code(std::string_view cc) {
+        static const std::pair<const char *, int> codes[] = {
+            {"o", 0},  {"no", 1}, {"b", 2},   {"c", 2},  {"nae", 2}, {"ae", 3}, {"nb", 3},  {"nc", 3},
+            {"e", 4},  {"z", 4},  {"ne", 5},  {"nz", 5}, {"be", 6},  {"na", 6}, {"a", 7},   {"nbe", 7},
+            {"s", 8},  {"ns", 9}, {"p", 10},  {"np", 11}, {"l", 12}, {"nge", 12}, {"ge", 13}, {"nl", 13},
+            {"le", 14}, {"ng", 14}, {"g", 15}, {"nle", 15}};
+        for (const auto &[name, code] : codes) {
+            if (cc == name) {
+                return code;
+            }
+        }
+        return -1;
+    }
+
+    inline void assemble_line(std::string_view line) {
+        std::string_view text = trim(line);
+        if (text.empty() || text.front() == ';' || text.substr(0, 7) == "global ") {
+            return;
+        }
+        if (text.substr(0, 8) == "section ") {
+            std::string_view name = trim(text.substr(8));
+            if (name == ".text") {
+                m_section = section::text;
+            } else if (name == ".rodata") {
+                m_section = section::rodata;
+            } else if (name == ".bss") {
+                m_section = section::bss;
+            } else {
+                fail(line);
+            }
+            return;
+        }
+        if (text.substr(0, 6) == "align ") {
+            int64_t n;
+            if (!parse_int(text.substr(6), n) || n <= 0) {
+                fail(line);
+            }
+            while (position() % n != 0) {
+                if (m_section == section::bss) {
+                    m_bss_size++;
+                } else {
+                    bytes().push_back(m_section == section::text ? 0x90 : 0);
+                }
+            }
+            return;
+        }
+
+        // "label:" optionally followed by data on the same line
+        size_t colon = text.find(':');
+        if (colon != std::string_view::npos && text.find('[') > colon && text.find('"') > colon) {
+            std::string name(trim(text.substr(0, colon)));
+            if (!m_symbols.emplace(name, symbol{m_section, position()}).second) {
+                fail(line);
+            }
+            text = trim(text.substr(colon + 1));
+            if (text.empty()) {
+                return;
+            }
+        }
+
+        size_t space = text.find(' ');
+        std::string_view mnemonic = text.substr(0, space);
+        std::string_view rest = space == std::string_view::npos ? std::string_view() : trim(text.substr(space + 1));
+        if (mnemonic == "db" || mnemonic == "dq" || mnemonic == "resq") {
+            assemble_data(mnemonic, rest, line);
+            return;
+        }
+        if (m_section != section::text) {
+            fail(line);
+        }
+
+        std::vector<operand> ops;
+        size_t pos = 0;
+        while (pos < rest.size()) {
+            size_t comma = rest.find(',', pos);
+            if (comma == std::string_view::npos) {
+                comma = rest.size();
+            }
+            ops.push_back(parse_operand(rest.substr(pos, comma - pos), line));
+            pos = comma + 1;
+        }
+        assemble_instruction(mnemonic, ops, line);
+    }
+
+    inline void assemble_data(std::string_view directive, std::string_view rest, std::string_view line) {
+        if (directive == "resq") {
+            int64_t n;
+            if (m_section != section::bss || !parse_int(rest, n) || n < 0) {
+                fail(line);
+            }
+            m_bss_size += n * 8;
+            return;
+        }
+        if (m_section != section::rodata) {
+            fail(line);
+        }
+        size_t pos = 0;
+        while (pos < rest.size()) {
+            size_t end;
+            if (rest[pos] == '"') {
+                end = rest.find('"', pos + 1);
+                if (end == std::string_view::npos) {
+                    fail(line);
+                }
+                std::string_view str = rest.substr(pos + 1, end - pos - 1);
+                m_rodata.insert(m_rodata.end(), str.begin(), str.end());
+                end = rest.find(',', end);
+            } else {
+                end = rest.find(',', pos);
+                std::string_view item = trim(rest.substr(pos, end == std::string_view::npos ? end : end - pos));
+                int64_t n;
+                if (parse_int(item, n)) {
+                    emit(m_rodata, n, directive == "db" ? 1 : 8);
+                } else if (directive == "dq") {
+                    m_relocations.push_back(
+                        {section::rodata, m_rodata.size(), std::string(item), 0, reloc_kind::abs64});
+                    emit(m_rodata, 0, 8);
+                } else {
+                    fail(line);
+                }
+            }
+            if (end == std::string_view::npos) {
+                break;
+            }
+            pos = end + 1;
+            while (pos < rest.size() && rest[pos] == ' ') {
+                pos++;
+            }
+        }
+    }
+
+    // ============================= ENCODING =============================
+
+    inline std::vector<uint8_t> &bytes() {
+        return m_section == section::text ? m_text : m_rodata;
+    }
+
+    inline size_t position() const {
+        switch (m_section) {
+        case section::text:
+            return m_text.size();
+        case section::rodata:
+            return m_rodata.size();
+        default:
+            return m_bss_size;
+        }
+    }
+
+    static inline void emit(std::vector<uint8_t> &out, int64_t value, int size) {
+        for (int i = 0; i < size; ++i) {
+            out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    static inline bool fits_int8(int64_t value) {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    static inline bool fits_int32(int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    // Prefix, optional REX, opcode and ModRM/SIB/displacement for "opcode reg, rm"
+    inline void emit_rm(uint8_t prefix, bool rex_w, std::initializer_list<uint8_t> opcode, int reg, const operand &rm) {
+        if (prefix != 0) {
+            m_text.push_back(prefix);
+        }
+        int rm_low = rm.kind == operand_kind::reg ? rm.reg : rm.base;
+        uint8_t rex = 0x40 | (rex_w ? 8 : 0) | ((reg & 8) ? 4 : 0) | (rm.index >= 8 ? 2 : 0) |
+                      (rm_low >= 8 ? 1 : 0);
+        if (rex != 0x40) {
+            m_text.push_back(rex);
+        }
+        m_text.insert(m_text.end(), opcode.begin(), opcode.end());
+        if (rm.kind == operand_kind::reg) {
+            m_text.push_back(0xC0 | (reg & 7) << 3 | (rm.reg & 7));
+            return;
+        }
+
+        static const int scale_bits[] = {-1, 0, 1, -1, 2, -1, -1, -1, 3};
+        int scale = rm.index >= 0 ? scale_bits[rm.scale] : 0;
+        if (rm.base < 0) {
+            // Absolute disp32 through a SIB with no base, since plain rm=101 means RIP-relative in 64-bit mode
+            m_text.push_back(0x04 | (reg & 7) << 3);
+            m_text.push_back(scale << 6 | (rm.index >= 0 ? rm.index & 7 : 4) << 3 | 5);
+            if (!rm.symbol.empty()) {
+                m_relocations.push_back({section::text, m_text.size(), rm.symbol, rm.value, reloc_kind::abs32});
+            }
+            emit(m_text, rm.value, 4);
+            return;
+        }
+        if (!rm.symbol.empty()) {
+            fail(rm.symbol);
+        }
+        int mod = rm.value == 0 && (rm.base & 7) != 5 ? 0 : fits_int8(rm.value) ? 1 : 2;
+        if (rm.index >= 0 || (rm.base & 7) == 4) {
+            m_text.push_back(mod << 6 | (reg & 7) << 3 | 4);
+            m_text.push_back(scale << 6 | (rm.index >= 0 ? rm.index & 7 : 4) << 3 | (rm.base & 7));
+        } else {
+            m_text.push_back(mod << 6 | (reg & 7) << 3 | (rm.base & 7));
+        }
+        if (mod == 1) {
+            emit(m_text, rm.value, 1);
+        } else if (mod == 2) {
+            emit(m_text, rm.value, 4);
+        }
+    }
+
+    inline void emit_rel32(std::string_view target) {
+        m_relocations.push_back({section::text, m_text.size(), std::string(target), 0, reloc_kind::rel32});
+        emit(m_text, 0, 4);
+    }
+
+    inline void assemble_instruction(std::string_view mnemonic, const std::vector<operand> &ops,
+                                     std::string_view line) {
+        auto shape = [&](std::initializer_list<operand_kind> kinds) {
+            if (ops.size() != kinds.size()) {
+                return false;
+            }
+            size_t i = 0;
+            for (operand_kind kind : kinds) {
+                if (ops[i++].kind != kind) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto is_rm = [](const operand &op) { return op.kind == operand_kind::reg || op.kind == operand_kind::mem; };
+        auto is_gpr = [](const operand &op) { return op.kind == operand_kind::reg && op.size != 128; };
+        auto is_xmm = [](const operand &op) { return op.kind == operand_kind::reg && op.size == 128; };
+        using k = operand_kind;
+
+        static const std::pair<const char *, int> alu[] = {{"add", 0}, {"or", 1},  {"and", 4},
+                                                           {"sub", 5}, {"xor", 6}, {"cmp", 7}};
+        for (const auto &[name, n] : alu) {
+            if (mnemonic != name || ops.size() != 2) {
+                continue;
+            }
+            bool w = ops[0].kind == k::mem || ops[0].size == 64;
+            if (is_rm(ops[0]) && is_gpr(ops[1])) {
+                emit_rm(0, w, {static_cast<uint8_t>(0x01 + 8 * n)}, ops[1].reg, ops[0]);
+            } else if (is_gpr(ops[0]) && ops[1].kind == k::mem) {
+                emit_rm(0, w, {static_cast<uint8_t>(0x03 + 8 * n)}, ops[0].reg, ops[1]);
+            } else if (is_rm(ops[0]) && ops[1].kind == k::imm && fits_int8(ops[1].value)) {
+                emit_rm(0, w, {0x83}, n, ops[0]);
+                emit(m_text, ops[1].value, 1);
+            } else if (is_rm(ops[0]) && ops[1].kind == k::imm && fits_int32(ops[1].value)) {
+                emit_rm(0, w, {0x81}, n, ops[0]);
+                emit(m_text, ops[1].value, 4);
+            } else {
+                fail(line);
+            }
+            return;
+        }
+
+        if (mnemonic == "mov" && ops.size() == 2) {
+            if (is_rm(ops[0]) && is_gpr(ops[1])) {
+                emit_rm(0, ops[1].size == 64, {0x89}, ops[1].reg, ops[0]);
+            } else if (is_gpr(ops[0]) && ops[1].kind == k::mem) {
+                emit_rm(0, ops[0].size == 64, {0x8B}, ops[0].reg, ops[1]);
+            } else if (is_rm(ops[0]) && ops[1].kind == k::imm && fits_int32(ops[1].value)) {
+                emit_rm(0, true, {0xC7}, 0, ops[0]);
+                emit(m_text, ops[1].value, 4);
+            } else if (is_gpr(ops[0]) && ops[0].size == 64 && (ops[1].kind == k::imm || ops[1].kind == k::label)) {
+                m_text.push_back(ops[0].reg >= 8 ? 0x49 : 0x48);
+                m_text.push_back(0xB8 + (ops[0].reg & 7));
+                if (ops[1].kind == k::label) {
+                    m_relocations.push_back({section::text, m_text.size(), ops[1].symbol, 0, reloc_kind::abs64});
+                }
+                emit(m_text, ops[1].value, 8);
+            } else {
+                fail(line);
+            }
+            return;
+        }
+
+        if (mnemonic == "test" && ops.size() == 2 && is_rm(ops[0]) && is_gpr(ops[1])) {
+            emit_rm(0, ops[1].size == 64, {0x85}, ops[1].reg, ops[0]);
+        } else if (mnemonic == "push" && shape({k::reg}) && ops[0].size == 64) {
+            if (ops[0].reg >= 8) {
+                m_text.push_back(0x41);
+            }
+            m_text.push_back(0x50 + (ops[0].reg & 7));
+        } else if (mnemonic == "push" && shape({k::mem})) {
+            emit_rm(0, false, {0xFF}, 6, ops[0]);
+        } else if (mnemonic == "pop" && shape({k::reg}) && ops[0].size == 64) {
+            if (ops[0].reg >= 8) {
+                m_text.push_back(0x41);
+            }
+            m_text.push_back(0x58 + (ops[0].reg & 7));
+        } else if ((mnemonic == "mul" || mnemonic == "div" || mnemonic == "idiv" || mnemonic == "neg") &&
+                   ops.size() == 1 && is_rm(ops[0])) {
+            int n = mnemonic == "mul" ? 4 : mnemonic == "div" ? 6 : mnemonic == "idiv" ? 7 : 3;
+            emit_rm(0, true, {0xF7}, n, ops[0]);
+        } else if (mnemonic == "movzx" && ops.size() == 2 && is_gpr(ops[0]) && is_rm(ops[1])) {
+            emit_rm(0, ops[0].size == 64, {0x0F, 0xB6}, ops[0].reg, ops[1]);
+        } else if (mnemonic == "lea" && shape({k::reg, k::mem})) {
+            emit_rm(0, true, {0x8D}, ops[0].reg, ops[1]);
+        } else if (mnemonic == "leave" && ops.empty()) {
+            m_text.push_back(0xC9);
+        } else if (mnemonic == "cqo" && ops.empty()) {
+            m_text.insert(m_text.end(), {0x48, 0x99});
+        } else if (mnemonic == "syscall" && ops.empty()) {
+            m_text.insert(m_text.end(), {0x0F, 0x05});
+        } else if (mnemonic == "rep" && ops.size() == 1 && ops[0].symbol == "stosq") {
+            m_text.insert(m_text.end(), {0xF3, 0x48, 0xAB});
+        } else if (mnemonic == "ret" && ops.empty()) {
+            m_text.push_back(0xC3);
+        } else if (mnemonic == "ret" && shape({k::imm})) {
+            m_text.push_back(0xC2);
+            emit(m_text, ops[0].value, 2);
+        } else if (mnemonic == "call" && shape({k::label})) {
+            m_text.push_back(0xE8);
+            emit_rel32(ops[0].symbol);
+        } else if (mnemonic == "jmp" && shape({k::label})) {
+            m_text.push_back(0xE9);
+            emit_rel32(ops[0].symbol);
+        } else if (mnemonic == "jmp" && shape({k::mem})) {
+            emit_rm(0, false, {0xFF}, 4, ops[0]);
+        } else if (mnemonic.front() == 'j' && shape({k::label}) && condition_code(mnemonic.substr(1)) >= 0) {
+            m_text.push_back(0x0F);
+            m_text.push_back(0x80 + condition_code(mnemonic.substr(1)));
+            emit_rel32(ops[0].symbol);
+        } else if (mnemonic.substr(0, 3) == "set" && ops.size() == 1 && is_rm(ops[0]) &&
+                   condition_code(mnemonic.substr(3)) >= 0) {
+            emit_rm(0, false, {0x0F, static_cast<uint8_t>(0x90 + condition_code(mnemonic.substr(3)))}, 0, ops[0]);
+        } else if (mnemonic.substr(0, 4) == "cmov" && ops.size() == 2 && is_gpr(ops[0]) && is_rm(ops[1]) &&
+                   condition_code(mnemonic.substr(4)) >= 0) {
+            uint8_t opcode = 0x40 + condition_code(mnemonic.substr(4));
+            emit_rm(0, ops[0].size == 64, {0x0F, opcode}, ops[0].reg, ops[1]);
+        } else if (mnemonic == "movdqu" && ops.size() == 2 && is_xmm(ops[0]) && is_rm(ops[1])) {
+            emit_rm(0xF3, false, {0x0F, 0x6F}, ops[0].reg, ops[1]);
+        } else if (mnemonic == "movdqu" && ops.size() == 2 && ops[0].kind == k::mem && is_xmm(ops[1])) {
+            emit_rm(0xF3, false, {0x0F, 0x7F}, ops[1].reg, ops[0]);
+        } else if (mnemonic == "movq" && ops.size() == 2 && is_xmm(ops[0]) && is_gpr(ops[1])) {
+            emit_rm(0x66, true, {0x0F, 0x6E}, ops[0].reg, ops[1]);
+        } else if (mnemonic == "movq" && ops.size() == 2 && is_gpr(ops[0]) && is_xmm(ops[1])) {
+            emit_rm(0x66, true, {0x0F, 0x7E}, ops[1].reg, ops[0]);
+        } else if (mnemonic == "pshufd" && ops.size() == 3 && is_xmm(ops[0]) && is_rm(ops[1]) &&
+                   ops[2].kind == k::imm) {
+            emit_rm(0x66, false, {0x0F, 0x70}, ops[0].reg, ops[1]);
+            emit(m_text, ops[2].value, 1);
+        } else {
+            static const std::pair<const char *, uint8_t> sse2[] = {
+                {"paddq", 0xD4}, {"psubq", 0xFB}, {"pxor", 0xEF}, {"punpcklqdq", 0x6C}};
+            for (const auto &[name, opcode] : sse2) {
+                if (mnemonic == name && ops.size() == 2 && is_xmm(ops[0]) && is_rm(ops[1])) {
+                    emit_rm(0x66, false, {0x0F, opcode}, ops[0].reg, ops[1]);
+                    return;
+                }
+            }
+            fail(line);
+        }
+    }
+
+    // ============================= LOADING =============================
+
+    // Maps text, rodata and bss, resolves relocations and leaves the text read-only and executable
+    inline void load() {
+        if (m_symbols.find("_start") == m_symbols.end()) {
+            report_error("Error: --run found no label '_start'");
+        }
+        for (const relocation &reloc : m_relocations) {
+            if (m_symbols.find(reloc.symbol) == m_symbols.end()) {
+                report_error("Error: --run found no label '", reloc.symbol, "'");
+            }
+        }
+
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t text_size = (m_text.size() + page - 1) / page * page;
+        size_t bss_start = (m_rodata.size() + 7) / 8 * 8;
+        size_t data_size = bss_start + m_bss_size;
+        m_mapped = text_size + (data_size + page - 1) / page * page;
+        void *memory = mmap(nullptr, m_mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (memory == MAP_FAILED) {
+            report_error("Error: Unable to map memory for --run");
+        }
+        m_memory = static_cast<uint8_t *>(memory);
+        memcpy(m_memory, m_text.data(), m_text.size());
+        memcpy(m_memory + text_size, m_rodata.data(), m_rodata.size()); // bss follows, already zeroed
+
+        auto address = [&](section sec, size_t offset) -> uint64_t {
+            size_t start = sec == section::text ? 0 : sec == section::rodata ? text_size : text_size + bss_start;
+            return reinterpret_cast<uint64_t>(m_memory + start + offset);
+        };
+        for (const relocation &reloc : m_relocations) {
+            auto it = m_symbols.find(reloc.symbol);
+            uint64_t target = address(it->second.sec, it->second.offset) + reloc.addend;
+            uint64_t field = address(reloc.sec, reloc.offset);
+            int64_t value = reloc.kind == reloc_kind::rel32 ? static_cast<int64_t>(target - (field + 4)) : target;
+            memcpy(reinterpret_cast<void *>(field), &value, reloc.kind == reloc_kind::abs64 ? 8 : 4);
+        }
+
+        if (mprotect(m_memory, text_size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(m_memory, m_mapped); // The destructor does not run when the constructor throws
+            m_memory = nullptr;
+            report_error("Error: Unable to make --run code executable");
+        }
+    }
+
+    section m_section = section::text;
+    std::vector<uint8_t> m_text;
+    std::vector<uint8_t> m_rodata;
+    size_t m_bss_size = 0;
+    std::unordered_map<std::string, symbol> m_symbols;
+    std::vector<relocation> m_relocations;
+    uint8_t *m_memory = nullptr;
+    size_t m_mapped = 0;
+};
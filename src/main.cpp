@@ -1,15 +1,76 @@
+#include <exception>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <optional>
 #include <vector>
 #include <string>
+#include <fcntl.h>  // For open
+#include <unistd.h> // For close
 
 // Custom header files
-#include "tokenization.hpp"
-#include "parser.hpp"
-#include "generation.hpp"
-#include "storage.hpp"
+#include "querk.hpp"
+#include "compilation.hpp"
+#include "interp.hpp"
+#include "modules.hpp"
+#include "server.hpp"
+
+// Writes a compiled program to out.asm and links it, with the objects of the modules it imports, into out in the
+// working directory
+static int write_outputs(const compile_result &result) {
+    for (const diagnostic &diag : result.diagnostics) {
+        std::cerr << diag.message << std::endl;
+    }
+    if (!result.ok()) {
+        return EXIT_FAILURE;
+    }
+
+    // The buffer goes straight to the file descriptor, without a copy through a stream
+    int fd = open("out.asm", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Unable to create output file out.asm" << std::endl;
+        return EXIT_FAILURE;
+    }
+    bool written = result.assembly->write_to(fd);
+    close(fd);
+    if (!written) {
+        std::cerr << "Error: Unable to write output file out.asm" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Execute system commands to assemble and link the generated assembly code
+    system("rm -f out.o out");                // Remove old output files
+    system("nasm -f elf64 out.asm -o out.o"); // Assemble
+    std::string link = "ld -o out out.o";     // Link
+    for (const std::string &object : result.objects) {
+        link += " '" + object + "'";
+    }
+    system(link.c_str());
+
+    return EXIT_SUCCESS;
+}
+
+// Exit status of a program run in-process, which is querk's own
+static int report_run(const run_result &result) {
+    for (const diagnostic &diag : result.diagnostics) {
+        std::cerr << diag.message << std::endl;
+    }
+    return result.ok() ? static_cast<int>(result.status.value()) : EXIT_FAILURE; // Truncated like exit()
+}
+
+// Compiles a program to bytecode and interprets it, no assembly at all. Modules it imports are looked up from
+// base and compiled in.
+static int interpret(node_program &prog, const std::filesystem::path &base, const generator_options &options) {
+    std::optional<module_loader> modules;
+    if (!prog.imports.empty()) {
+        modules.emplace(prog, base, thread_count(options));
+    }
+    bytecode_compiler obj_compiler(prog);
+    bytecode_program bytecode = obj_compiler.compile_program();
+    interpreter obj_interpreter(bytecode);
+    return static_cast<int>(obj_interpreter.run()); // Truncated to the low byte like a real exit status
+}
+
 /*
 => int main(int argc, char *argv[]) is a standard function signature for the main function, and it is used to pass
    command-line arguments to the program when it is executed.
@@ -22,21 +83,87 @@
 => argc tells you how many arguments were passed while argv gives you access to each argument passed to the program.
 */
 int main(int argc, char *argv[]) {
-    // Check if exactly one argument (excluding program name) is provided
-    if (argc != 2) {
+    // Options start with "--", everything else is the input file
+    generator_options options;
+    std::vector<std::string> flags; // Code generation flags as given, forwarded by --client
+    const char *input_path = nullptr;
+    bool run = false;
+    bool interp = false;
+    bool emit = false;     // Write the parsed program to out.ast instead of compiling it
+    bool from_ast = false; // The input is an AST file written by --emit-ast
+    std::optional<std::string> server_path;
+    std::optional<std::string> client_path;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (parse_option(arg, options)) {
+            flags.push_back(arg);
+        } else if (arg == "--run") {
+            run = true;
+        } else if (arg == "--interp") {
+            interp = true;
+        } else if (arg == "--emit-ast") {
+            emit = true;
+        } else if (arg == "--from-ast") {
+            from_ast = true;
+        } else if (arg == "--server" || arg.rfind("--server=", 0) == 0) {
+            server_path = arg.size() > 9 ? arg.substr(9) : default_socket_path();
+        } else if (arg == "--client" || arg.rfind("--client=", 0) == 0) {
+            client_path = arg.size() > 9 ? arg.substr(9) : default_socket_path();
+        } else if (arg.rfind("--", 0) != 0 && input_path == nullptr) {
+            input_path = argv[i];
+        } else {
+            input_path = nullptr;
+            break;
+        }
+    }
+
+    // A compile server takes its input over the socket
+    if (server_path.has_value() && argc == 2) {
+        compile_server server(server_path.value());
+        return server.serve();
+    }
+
+    // Check if exactly one input file is provided
+    bool modes_conflict = ((run || interp || server_path.has_value() || from_ast) && client_path.has_value()) ||
+                          (emit && (run || interp || from_ast || client_path.has_value())) || (run && interp);
+    if (input_path == nullptr || server_path.has_value() || modes_conflict) {
         std::cerr << "Invalid Input. Correct syntax: " << std::endl;
-        std::cerr << "quark <input.qrk>" << std::endl;
+        std::cerr << "quark [--run | --interp | --client[=socket]] [--no-bounds-check] [--no-cmov]" << std::endl;
+        std::cerr << "      [--target=scalar|sse2|avx2] [--threads=N] <input.qrk>" << std::endl;
+        std::cerr << "quark [--run | --interp] [options] --from-ast <input.ast>" << std::endl;
+        std::cerr << "quark --emit-ast [--threads=N] <input.qrk>" << std::endl;
+        std::cerr << "quark --server[=socket]" << std::endl;
         return EXIT_FAILURE;
     }
 
+    // A saved program is loaded from its AST file rather than read as source
+    if (from_ast) {
+        if (run) {
+            return report_run(run_ast(input_path, options));
+        }
+        if (interp) {
+            try {
+                compilation unit;
+                return interpret(unit.load_ast(input_path), module_base(input_path), options);
+            } catch (const compile_error &error) {
+                std::cerr << error.what() << std::endl;
+                return EXIT_FAILURE;
+            } catch (const std::exception &error) {
+                std::cerr << "Error: --interp failed: " << error.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        return write_outputs(compile_ast(input_path, options));
+    }
+
     std::string contents;
     {
         std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in); // Open file in input mode
+        std::fstream input(input_path, std::ios::in); // Open file in input mode
 
         // Check if file opened successfully
         if (!input.is_open()) {
-            std::cerr << "Error: Unable to open file " << argv[1] << std::endl;
+            std::cerr << "Error: Unable to open file " << input_path << std::endl;
             return EXIT_FAILURE;
         }
 
@@ -50,35 +177,39 @@ int main(int argc, char *argv[]) {
         contents = contents_stream.str();
     }
 
-    // Tokenization process
-    tokenizer obj_tokenizer(std::move(contents));
-    std::vector<token> tokens = obj_tokenizer.tokenize();
+    // Hand the compilation to a running compile server
+    if (client_path.has_value()) {
+        compile_client client(client_path.value());
+        return client.compile(flags, input_path, contents);
+    }
 
-    // Parsing process
-    parser obj_parser(std::move(tokens));
-    std::optional<node_program *> prog = obj_parser.parse_prog();
+    // Parse only, saving the program for --from-ast
+    if (emit) {
+        std::vector<diagnostic> diagnostics = emit_ast(contents, "out.ast", options);
+        for (const diagnostic &diag : diagnostics) {
+            std::cerr << diag.message << std::endl;
+        }
+        return diagnostics.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    // Check if parsing resulted in an exit statement
-    if (!prog.has_value()) {
-        std::cerr << "Error: Ivalid Program" << std::endl;
-        return EXIT_FAILURE;
+    // Assemble and run in-process
+    if (run) {
+        return report_run(run_file(contents, input_path, options));
     }
 
-    // Code generation process
-    generator obj_generator(*prog.value());
-    {
-        std::fstream file("out.asm", std::ios::out);
-        if (!file.is_open()) {
-            std::cerr << "Error: Unable to create output file out.asm" << std::endl;
+    // Bytecode interpretation, no assembly at all
+    if (interp) {
+        try {
+            compilation unit(std::move(contents));
+            return interpret(unit.parse(thread_count(options)), module_base(input_path), options);
+        } catch (const compile_error &error) {
+            std::cerr << error.what() << std::endl;
+            return EXIT_FAILURE;
+        } catch (const std::exception &error) {
+            std::cerr << "Error: --interp failed: " << error.what() << std::endl;
             return EXIT_FAILURE;
         }
-        file << obj_generator.generate_program();
     }
 
-    // Execute system commands to assemble and link the generated assembly code
-    system("rm -f out.o out");                // Remove old output files
-    system("nasm -f elf64 out.asm -o out.o"); // Assemble
-    system("ld -o out out.o");                // Link
-
-    return EXIT_SUCCESS;
+    return write_outputs(compile_file(contents, input_path, options));
 }
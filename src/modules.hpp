@@ -0,0 +1,466 @@
+#pragma once
+
+#include <algorithm> // For sorting the modules a module can call
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>    // For system, to assemble module objects
+#include <filesystem> // For resolving imports and the module cache
+#include <fstream>
+#include <iomanip> // For hex hashes
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>    // For open
+#include <sys/file.h> // For flock
+#include <unistd.h>
+
+#include "compilation.hpp"
+#include "generation.hpp"
+#include "parser.hpp"
+#include "tokenization.hpp"
+
+// ============================= MODULES =============================
+
+// import "path.qrk"; at the top of a file makes the functions of another file callable from it. A module holds
+// only function definitions, after imports of its own, and import paths are resolved relative to the file that
+// names them. A module can call the functions of every module it imports, directly or through other modules.
+// Imports may not form a cycle, and no two modules of a program may define the same function.
+
+constexpr const char *module_cache_dir = ".querk-cache"; // Where module_builder keeps objects between builds
+
+// Directory the imports of the file at path are resolved against
+inline std::filesystem::path module_base(const std::string &path) {
+    std::filesystem::path parent = std::filesystem::path(path).parent_path();
+    return parent.empty() ? std::filesystem::path(".") : parent;
+}
+
+// FNV-1a, which unlike std::hash is the same from one build of querk to the next, since hashes are kept on disk
+inline std::string module_hash(std::string_view text) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 0x100000001b3;
+    }
+    std::ostringstream hex;
+    hex << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return hex.str();
+}
+
+// A module file found by following imports
+struct module_file {
+    std::string name;                    // Path as the importing file named it, for messages
+    std::filesystem::path path;          // Canonical path, the same for every import of the file
+    std::unique_ptr<compilation> unit;   // Holds the source, and the nodes of prog once parsed
+    std::vector<size_t> imports;         // Modules imported directly, as indices into the module list
+    std::vector<size_t> callable;        // Modules whose functions it can call, in list order
+    std::vector<std::string_view> calls; // Names of the functions it calls, interned in unit
+    node_program *prog = nullptr;        // Null until the module is parsed
+};
+
+// Tokenizes and parses a module, and checks that it only defines functions. Errors name the module.
+inline void parse_module(module_file &mod, unsigned threads) {
+    try {
+        const std::vector<token> &tokens = mod.unit->tokenize();
+        for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+            // An identifier followed by '(' is a call, unless it names the function 'fn' defines
+            if (tokens[i].type == tokentype::ident && tokens[i + 1].type == tokentype::open_paren &&
+                (i == 0 || tokens[i - 1].type != tokentype::fn)) {
+                mod.calls.push_back(tokens[i].value.value());
+            }
+        }
+        node_program &prog = mod.unit->parse(threads);
+        for (const node_statement *stmt : prog.stmts) {
+            if (!std::holds_alternative<node_statement_fn *>(stmt->var)) {
+                report_error("Error: A module may only define functions");
+            }
+        }
+        mod.prog = &prog;
+    } catch (const compile_error &error) {
+        report_error(mod.name, ": ", error.what());
+    }
+}
+
+// The modules a program imports, directly or not, each read once however many files import it. They are listed
+// in an order where every module comes after the modules it imports.
+class module_graph {
+  public:
+    // imports_of(mod) gives the import paths, as written, of a module whose source has been read
+    template <typename Imports>
+    inline module_graph(const arena_vector<token, 4> &imports, const std::filesystem::path &base,
+                        Imports &&imports_of) {
+        // Depth first on an explicit stack; a module is listed once everything it imports is
+        struct frame {
+            module_file mod;
+            std::filesystem::path base;
+            std::vector<std::string> imports;
+            size_t next = 0;
+        };
+        std::unordered_map<std::string, size_t> listed; // Path to index, for modules already listed
+        std::unordered_set<std::string> open;           // Paths of the modules on the stack
+        std::vector<frame> stack;
+        std::vector<std::string> root_imports;
+        for (const token &path : imports) {
+            root_imports.emplace_back(path.value.value());
+        }
+        stack.push_back({.base = base, .imports = std::move(root_imports)}); // The program itself, not listed
+
+        while (true) {
+            frame &top = stack.back();
+            if (top.next == top.imports.size()) {
+                if (stack.size() == 1) {
+                    m_callable = callable(top.mod.imports);
+                    return;
+                }
+                frame done = std::move(stack.back());
+                stack.pop_back();
+                open.erase(done.mod.path.string());
+                listed.emplace(done.mod.path.string(), m_modules.size());
+                done.mod.callable = callable(done.mod.imports);
+                stack.back().mod.imports.push_back(m_modules.size());
+                m_modules.push_back(std::move(done.mod));
+                continue;
+            }
+
+            const std::string &written = top.imports[top.next++];
+            std::filesystem::path path = top.base / written;
+            module_file mod{.name = path.lexically_normal().string()};
+            std::error_code error;
+            mod.path = std::filesystem::canonical(path, error);
+            if (error || !std::filesystem::is_regular_file(mod.path, error)) {
+                report_error("Error: Unable to open module ", mod.name);
+            }
+            if (auto it = listed.find(mod.path.string()); it != listed.end()) {
+                top.mod.imports.push_back(it->second);
+                continue;
+            }
+            if (open.contains(mod.path.string())) {
+                report_error("Error: Import cycle through module ", mod.name);
+            }
+            std::ifstream input(mod.path, std::ios::in | std::ios::binary);
+            std::stringstream contents;
+            contents << input.rdbuf();
+            if (!input) {
+                report_error("Error: Unable to open module ", mod.name);
+            }
+            mod.unit = std::make_unique<compilation>(contents.str());
+            open.insert(mod.path.string());
+            std::vector<std::string> mod_imports = imports_of(mod);
+            std::filesystem::path mod_base = std::filesystem::path(mod.name).parent_path();
+            stack.push_back({.mod = std::move(mod), .base = std::move(mod_base), .imports = std::move(mod_imports)});
+        }
+    }
+
+    inline std::vector<module_file> &modules() {
+        return m_modules;
+    }
+
+    // Modules whose functions the program can call
+    inline const std::vector<size_t> &callable() const {
+        return m_callable;
+    }
+
+  private:
+    // Modules reachable through the given imports of modules already listed, in list order
+    inline std::vector<size_t> callable(const std::vector<size_t> &imports) const {
+        std::vector<size_t> modules;
+        for (size_t index : imports) {
+            modules.push_back(index);
+            modules.insert(modules.end(), m_modules[index].callable.cbegin(), m_modules[index].callable.cend());
+        }
+        std::sort(modules.begin(), modules.end());
+        modules.erase(std::unique(modules.begin(), modules.end()), modules.end());
+        return modules;
+    }
+
+    std::vector<module_file> m_modules;
+    std::vector<size_t> m_callable;
+};
+
+// Checks that no two modules define the same function, given the functions each one defines
+inline void check_unique_functions(const std::vector<module_file> &modules,
+                                   const std::vector<std::vector<extern_function>> &interfaces) {
+    std::unordered_map<std::string_view, const module_file *> defined;
+    for (size_t i = 0; i < modules.size(); ++i) {
+        for (const extern_function &fn : interfaces[i]) {
+            if (!defined.emplace(fn.name, &modules[i]).second) {
+                report_error("Error: Function already exists: ", fn.name, " (in ", defined.at(fn.name)->name, " and ",
+                             modules[i].name, ")");
+            }
+        }
+    }
+}
+
+// Functions a parsed module defines
+inline std::vector<extern_function> module_functions(const node_program &prog) {
+    std::vector<extern_function> functions;
+    for (const node_statement *stmt : prog.stmts) {
+        const node_statement_fn *stmt_fn = std::get<node_statement_fn *>(stmt->var);
+        functions.push_back({.name = std::string(stmt_fn->ident.value.value()), .param_count = stmt_fn->params.size()});
+    }
+    return functions;
+}
+
+// Import paths of a parsed module
+inline std::vector<std::string> import_paths(const node_program &prog) {
+    std::vector<std::string> paths;
+    for (const token &path : prog.imports) {
+        paths.emplace_back(path.value.value());
+    }
+    return paths;
+}
+
+// Compiles imported modules into the program itself: the functions of every module go in front of its
+// statements, so it is generated as a whole. For --run, --interp and compile_source, which have no linker.
+class module_loader {
+  public:
+    inline module_loader(node_program &prog, const std::filesystem::path &base, unsigned threads)
+        : m_graph(prog.imports, base, [&](module_file &mod) {
+              parse_module(mod, threads);
+              return import_paths(*mod.prog);
+          }) {
+        // Generated as a whole, every function could call every other, so calls are held to what each module
+        // can call here, as they are when modules are compiled separately
+        std::vector<module_file> &modules = m_graph.modules();
+        std::vector<std::vector<extern_function>> interfaces;
+        for (const module_file &mod : modules) {
+            interfaces.push_back(module_functions(*mod.prog));
+        }
+        check_unique_functions(modules, interfaces);
+        for (size_t i = 0; i < modules.size(); ++i) {
+            std::unordered_set<std::string_view> callable;
+            for (size_t index : modules[i].callable) {
+                for (const extern_function &fn : interfaces[index]) {
+                    callable.insert(fn.name);
+                }
+            }
+            for (const extern_function &fn : interfaces[i]) {
+                callable.insert(fn.name);
+            }
+            for (std::string_view name : modules[i].calls) {
+                if (!callable.contains(name)) {
+                    report_error(modules[i].name, ": Error: Undeclared function ", name);
+                }
+            }
+        }
+
+        statement_list stmts;
+        for (const module_file &mod : m_graph.modules()) {
+            stmts.append(m_allocator, mod.prog->stmts.cbegin(), mod.prog->stmts.cend());
+        }
+        stmts.append(m_allocator, prog.stmts.cbegin(), prog.stmts.cend());
+        prog.stmts = stmts;
+    }
+
+  private:
+    module_graph m_graph;                     // Owns the nodes of the functions added to the program
+    storage_allocator m_allocator{1024 * 64}; // Holds the program's new statement list
+};
+
+// Holds a module cache exclusively while it lives. flock locks belong to the open file, so the compile server's
+// threads exclude one another as well as other querk processes building in the same directory.
+class module_cache_lock {
+  public:
+    inline explicit module_cache_lock(const std::filesystem::path &cache_dir) {
+        m_fd = open((cache_dir / "lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        int result = -1;
+        while (m_fd >= 0 && (result = flock(m_fd, LOCK_EX)) != 0 && errno == EINTR) {
+        }
+        if (result != 0) {
+            if (m_fd >= 0) {
+                close(m_fd);
+            }
+            report_error("Error: Unable to lock module cache ", cache_dir.string());
+        }
+    }
+
+    inline ~module_cache_lock() {
+        close(m_fd); // Releases the lock
+    }
+
+    inline module_cache_lock(const module_cache_lock &) = delete;
+    inline module_cache_lock &operator=(const module_cache_lock &) = delete;
+
+  private:
+    int m_fd;
+};
+
+// Compiles each module a program imports to an object of its own, kept in a cache directory from one build to the
+// next, for the program to be linked with. A module is compiled again only when its source or the options change
+// or the functions it can call do: changing a function body compiles that one module again, while adding or
+// removing a function, or changing its parameter count, also compiles the modules that can call it.
+//
+// Per module, the cache holds its assembly and object, its interface (the functions it defines, one
+// "name param_count" line each) and a stamp recording what the object was compiled from.
+class module_builder {
+  public:
+    inline module_builder(const generator_options &options, std::filesystem::path cache_dir)
+        : m_options(options), m_cache_dir(std::move(cache_dir)) {
+        m_options.jit = false; // Objects are linked into an executable of their own
+        m_options_key = std::to_string(m_options.bounds_checks) + std::to_string(m_options.cmov) +
+                        std::to_string(static_cast<int>(m_options.target));
+    }
+
+    // Brings the object of every module prog imports, directly or not, up to date with the sources found from
+    // base. Returns the functions prog can call.
+    inline std::vector<extern_function> build(const node_program &prog, const std::filesystem::path &base) {
+        std::error_code error;
+        std::filesystem::create_directories(m_cache_dir, error);
+        if (error) {
+            report_error("Error: Unable to create module cache ", m_cache_dir.string());
+        }
+        module_cache_lock lock(m_cache_dir); // Other builds into the cache wait until this one is done
+        std::vector<stamp> stamps; // Parallel to the modules, by the order imports_of sees them
+        std::unordered_map<std::string, size_t> stamp_of;
+        module_graph graph(prog.imports, base, [&](module_file &mod) {
+            stamp_of.emplace(mod.path.string(), stamps.size());
+            stamp &recorded = stamps.emplace_back(read_stamp(mod));
+            if (recorded.source == module_hash(mod.unit->source()) && recorded.options == m_options_key) {
+                return recorded.imports; // Unchanged, no need to parse it to find its imports
+            }
+            recorded.valid = false;
+            parse_module(mod, thread_count(m_options));
+            return import_paths(*mod.prog);
+        });
+
+        std::vector<module_file> &modules = graph.modules();
+        std::vector<std::vector<extern_function>> interfaces(modules.size());
+        m_objects.clear();
+        for (size_t i = 0; i < modules.size(); ++i) {
+            module_file &mod = modules[i];
+            std::vector<extern_function> externs = functions_of(mod.callable, interfaces);
+            std::string externs_hash = module_hash(interface_text(externs));
+            const stamp &recorded = stamps[stamp_of.at(mod.path.string())];
+            std::string file = cache_path(mod);
+            m_objects.push_back(file + ".o");
+
+            if (recorded.valid && recorded.externs == externs_hash && std::filesystem::exists(file + ".o", error) &&
+                read_interface(file + ".qi", interfaces[i])) {
+                continue;
+            }
+            if (mod.prog == nullptr) {
+                parse_module(mod, thread_count(m_options));
+            }
+            interfaces[i] = module_functions(*mod.prog);
+            compile(mod, file, externs);
+            write_file(file + ".qi", interface_text(interfaces[i]));
+            std::string text = "source " + module_hash(mod.unit->source()) + "\noptions " + m_options_key +
+                               "\nexterns " + externs_hash + "\n";
+            for (const std::string &path : import_paths(*mod.prog)) {
+                text += "import " + path + "\n";
+            }
+            write_file(file + ".stamp", text); // Last, so an interrupted build leaves no stamp behind
+        }
+
+        check_unique_functions(modules, interfaces); // They are all linked into the program
+        return functions_of(graph.callable(), interfaces);
+    }
+
+    // Objects of every module the last build covered, in link order
+    inline const std::vector<std::string> &objects() const {
+        return m_objects;
+    }
+
+  private:
+    // What a module's object was compiled from, as hashes
+    struct stamp {
+        bool valid = false;
+        std::string source;
+        std::string options;
+        std::string externs; // The functions it could call
+        std::vector<std::string> imports;
+    };
+
+    // Cache files of a module, without extension: its file name then a hash of its path, so that modules with the
+    // same file name in different directories do not share them
+    inline std::string cache_path(const module_file &mod) const {
+        std::string stem;
+        for (char c : mod.path.stem().string()) {
+            stem.push_back(std::isalnum(static_cast<unsigned char>(c)) ? c : '_');
+        }
+        return (m_cache_dir / (stem + "-" + module_hash(mod.path.string()))).string();
+    }
+
+    inline stamp read_stamp(const module_file &mod) const {
+        stamp recorded;
+        std::ifstream input(cache_path(mod) + ".stamp");
+        std::string key;
+        std::string value;
+        while (input >> key && input.get() == ' ' && std::getline(input, value)) {
+            if (key == "source") {
+                recorded.source = value;
+            } else if (key == "options") {
+                recorded.options = value;
+            } else if (key == "externs") {
+                recorded.externs = value;
+            } else if (key == "import") {
+                recorded.imports.push_back(value);
+            }
+        }
+        recorded.valid = input.eof();
+        return recorded;
+    }
+
+    // Reads the functions a module defines, returning false if its interface file is missing or damaged
+    static inline bool read_interface(const std::string &path, std::vector<extern_function> &functions) {
+        std::ifstream input(path);
+        std::string name;
+        size_t param_count;
+        while (input >> name >> param_count) {
+            functions.push_back({.name = name, .param_count = param_count});
+        }
+        return input.eof() && !input.bad();
+    }
+
+    static inline std::string interface_text(const std::vector<extern_function> &functions) {
+        std::string text;
+        for (const extern_function &fn : functions) {
+            text += fn.name + " " + std::to_string(fn.param_count) + "\n";
+        }
+        return text;
+    }
+
+    static inline void write_file(const std::string &path, std::string_view text) {
+        std::ofstream output(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        output << text;
+        if (!output.flush()) {
+            report_error("Error: Unable to write ", path);
+        }
+    }
+
+    // Functions the given modules define, in their order
+    static inline std::vector<extern_function>
+    functions_of(const std::vector<size_t> &modules, const std::vector<std::vector<extern_function>> &interfaces) {
+        std::vector<extern_function> functions;
+        for (size_t index : modules) {
+            functions.insert(functions.end(), interfaces[index].cbegin(), interfaces[index].cend());
+        }
+        return functions;
+    }
+
+    // Generates a module's assembly against the functions it can call and assembles it into file.o
+    inline void compile(const module_file &mod, const std::string &file, std::vector<extern_function> externs) const {
+        std::error_code error;
+        std::filesystem::remove(file + ".stamp", error); // Until the object is rebuilt, it is out of date
+        asm_buffer output;
+        try {
+            generator obj_generator(*mod.prog, m_options, std::move(externs));
+            obj_generator.generate_module(output);
+        } catch (const compile_error &error) {
+            report_error(mod.name, ": ", error.what());
+        }
+        write_file(file + ".asm", output.view());
+        std::string command = "nasm -f elf64 '" + file + ".asm' -o '" + file + ".o'";
+        if (std::system(command.c_str()) != 0) {
+            report_error("Error: Unable to assemble module ", mod.name);
+        }
+    }
+
+    generator_options m_options;
+    std::string m_options_key; // The options that change code, as stamps record them
+    std::filesystem::path m_cache_dir;
+    std::vector<std::string> m_objects;
+};
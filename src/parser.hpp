@@ -5,6 +5,12 @@
 #include <iostream> // Used for error logging
 #include <optional> // Used to represent optional values that may or may not be present
 #include <cassert>
+#include <charconv> // For reading integer literals without exceptions
+#include <cstdint>
+#include <algorithm>
+#include <atomic>   // For handing out chunks to parse
+#include <memory>   // For the worker parsers
+#include <thread>   // For parsing chunks in parallel
 
 #include "tokenization.hpp" // Includes the tokenization module for handling tokens
 #include "storage.hpp"
@@ -29,6 +35,28 @@ struct node_term_parentheses {
     node_expr *expr;
 };
 
+// Structure representing an array element read
+// Example: a[i] in let x = a[i];
+struct node_term_index {
+    token ident;     // Name of the array
+    node_expr *index;
+};
+
+// Structure representing logical negation, which yields 1 or 0
+// Example: !x in if (!x) { ... }
+struct node_term_not {
+    node_expr *expr;
+};
+
+// Structure representing a function call term
+// Example: f(1, x) in let y = f(1, x);
+// is_tail is set when the call is written as 'tail f(1, x)' and must compile to a jump
+struct node_term_call {
+    token ident;                       // Name of the called function
+    arena_vector<node_expr *, 4> args; // Argument expressions, left to right
+    bool is_tail = false;
+};
+
 // Structure representing addition in binary expression node
 // Example: 5+5 in  let x = 5 + 5;
 struct node_binary_expr_add {
@@ -64,18 +92,46 @@ struct node_binary_expr_modulus {
     node_expr *rhs;
 };
 
+// The six comparison operators, all signed
+enum class compare_op { eq, ne, lt, le, gt, ge };
+
+// Structure representing a comparison node, which yields 1 or 0
+// Example: x < 5 in if (x < 5) { ... }
+struct node_binary_expr_compare {
+    compare_op op;
+    node_expr *lhs;
+    node_expr *rhs;
+};
+
+// Structure representing a short-circuit logical and, which yields 1 or 0
+// Example: x > 0 && y > 0
+struct node_binary_expr_and {
+    node_expr *lhs;
+    node_expr *rhs;
+};
+
+// Structure representing a short-circuit logical or, which yields 1 or 0
+// Example: x == 0 || y == 0
+struct node_binary_expr_or {
+    node_expr *lhs;
+    node_expr *rhs;
+};
+
 // Structure representing an binary expression node
 // Example let x = 5 + 5;
 struct node_binary_expr {
     std::variant<node_binary_expr_add *, node_binary_expr_multiply *, node_binary_expr_minus *,
-                 node_binary_expr_divide *, node_binary_expr_modulus *>
+                 node_binary_expr_divide *, node_binary_expr_modulus *, node_binary_expr_compare *,
+                 node_binary_expr_and *, node_binary_expr_or *>
         var;
 };
 
 // Structure representing a term
 // Example: let x = 5;
 struct node_term {
-    std::variant<node_term_int_lit *, node_term_identifier *, node_term_parentheses *> var;
+    std::variant<node_term_int_lit *, node_term_identifier *, node_term_parentheses *, node_term_call *,
+                 node_term_index *, node_term_not *>
+        var;
 };
 
 // Structure representing a general expression node, which can be:
@@ -100,25 +156,104 @@ struct node_statement_let {
 
 struct node_statement;
 
+// Statements of a scope or program, in order
+using statement_list = arena_vector<node_statement *, 4>;
+
 struct node_scope {
-    std::vector<node_statement *> stmts;
+    statement_list stmts;
 };
 
 struct node_statement_if {
     node_expr *expr;
     node_scope *scope;
+    node_scope *else_scope = nullptr; // 'else { ... }', an 'else if' is an else scope holding just the if
+};
+
+// Structure representing a fixed-size integer array declaration
+// Example: let a[1024]; (stack) or static let a[1024]; (.bss)
+struct node_statement_array {
+    token ident;
+    size_t size;
+    bool is_static = false;
+};
+
+// Structure representing an assignment to an existing variable or array element
+// Example: x = x + 1; or a[i] = v;
+struct node_statement_assign {
+    token ident;
+    node_expr *index = nullptr; // Set when assigning to an array element
+    node_expr *expr;
+};
+
+// Structure representing a while loop
+// Example: while (n - i) { i = i + 1; }
+struct node_statement_while {
+    node_expr *expr;
+    node_scope *scope;
+};
+
+// One arm of a match: a constant to compare against, or the '_' wildcard
+struct node_match_arm {
+    std::optional<int64_t> value; // Empty for '_'
+    node_scope *scope;
+};
+
+// Structure representing a multi-way branch on one value
+// Example: match (x) { 1 => { ... } 2 => { ... } _ => { ... } }
+struct node_statement_match {
+    node_expr *expr;
+    arena_vector<node_match_arm, 4> arms;
+};
+
+// Structure representing a return statement node
+// Example: return n - 1;
+struct node_statement_return {
+    node_expr *expr;
+};
+
+struct node_statement_fn;
+
+// Source of function bodies that are built the first time they are used rather than with the rest of the tree.
+// An AST file is loaded this way (see ast_reader).
+class body_loader {
+  public:
+    virtual node_scope *load_body(const node_statement_fn &stmt_fn) = 0;
+
+  protected:
+    ~body_loader() = default;
+};
+
+// Structure representing a function definition node (top level only)
+// Example: fn add(a, b) { return a + b; }
+struct node_statement_fn {
+    token ident;                         // Function name
+    arena_vector<token, 4> params;       // Parameter names, left to right
+    mutable node_scope *scope = nullptr; // Function body, once built; read it through body()
+    body_loader *loader = nullptr;       // Builds the body on first use, if it was not built with the tree
+    uint64_t body_record = 0;            // Where loader finds the body
+
+    node_scope *body() const {
+        return loader != nullptr ? loader->load_body(*this) : scope;
+    }
 };
 
 // A node_statement can be one of the following:
 // 1. node_statement_exit (for exit() statements)
 // 2. node_statement_let (for let statements)
+// 3. node_scope (for nested { } blocks)
+// 4. node_statement_if, node_statement_while, node_statement_return, node_statement_fn
+// 5. node_statement_array, node_statement_assign
 struct node_statement {
-    std::variant<node_statement_exit, node_statement_let, node_scope *, node_statement_if *> var;
+    std::variant<node_statement_exit, node_statement_let, node_scope *, node_statement_if *, node_statement_return *,
+                 node_statement_fn *, node_statement_array *, node_statement_assign *, node_statement_while *,
+                 node_statement_match *>
+        var;
 };
 
 // Structure representing a complete program containing multiple statements
 struct node_program {
-    std::vector<node_statement> stmts; // Stores a list of statements in the program
+    arena_vector<token, 4> imports; // Paths of the modules it imports, as written
+    statement_list stmts;           // Stores a list of statements in the program
 };
 
 // ============================= PARSER CLASS =============================
@@ -126,135 +261,171 @@ struct node_program {
 // The parser class is responsible for converting a list of tokens into an Abstract Syntax Tree (AST)
 class parser {
   public:
-    // Constructor: Initializes the parser with a vector of tokens
-    inline explicit parser(std::vector<token> tokens) : m_tokens(std::move(tokens)), m_allocator(1024 * 1024 * 4) {}
+    // Constructor: Reads the tokens in place and allocates nodes in the arena, both owned by the caller and kept
+    // for as long as the tree is used
+    inline parser(const std::vector<token> &tokens, storage_allocator &arena)
+        : m_tokens(tokens), m_end(m_tokens.size()), m_allocator(arena) {}
 
     std::optional<node_binary_expr *> parse_bin_expr() {
         if (auto lhs = parse_expr()) {
             // Implementation missing
         } else {
-            std::cerr << "Error: Operator not supported yet" << std::endl;
-            exit(EXIT_FAILURE);
+            report_error("Error: Operator not supported yet");
         }
         return {};
     }
 
-    std::optional<node_term *> parse_term() {
-        // If the next token is an integer literal, parse it as node_term_int_lit
-        if (auto int_lit = try_consume(tokentype::int_lit)) {
-            auto v_term_int_lit = m_allocator.alloc<node_term_int_lit>();
-            v_term_int_lit->int_lit = int_lit.value();
-            auto term = m_allocator.alloc<node_term>();
-            term->var = v_term_int_lit;
-            return term;
-        }
-        // If the next token is an identifier, parse it as node_expr_identifier
-        else if (auto ident = try_consume(tokentype::ident)) {
-            auto v_term_ident = m_allocator.alloc<node_term_identifier>();
-            v_term_ident->identifier = ident.value();
-            auto term = m_allocator.alloc<node_term>();
-            term->var = v_term_ident;
-            return term;
-        } else if (auto open_paren = try_consume(tokentype::open_paren)) {
-            auto expr = parse_expr();
-            if (!expr.has_value()) {
-                std::cerr << "Error: Expected expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            try_consume(tokentype::close_paren, "Error: Expected ')'");
-            auto term_paren = m_allocator.alloc<node_term_parentheses>();
-            term_paren->expr = expr.value();
-            auto term = m_allocator.alloc<node_term>();
-            term->var = term_paren;
-            return term;
-        } else {
-            return {};
-        }
-    }
-
-    std::optional<node_expr *> parse_expr(int min_prec = 0) {
-        std::optional<node_term *> term_lhs = parse_term();
-        if (!term_lhs.has_value()) {
-            return {};
-        }
-
-        auto expr_lhs = m_allocator.alloc<node_expr>();
-        expr_lhs->var = term_lhs.value();
+    // Parses an expression with explicit operand and operator stacks instead of recursion, so nesting depth is
+    // bounded by heap memory rather than the native stack. Brackets, '!', argument lists and array indices each
+    // open a frame; an operator is reduced once the next one binds no tighter, which keeps operators of equal
+    // precedence left-associative.
+    std::optional<node_expr *> parse_expr() {
+        m_operands.clear();
+        m_operators.clear();
+        m_frames.clear();
+        m_frames.push_back({expr_frame::kind::top, 0});
 
-        // precedence calculator
         while (true) {
-            std::optional<token> curr_tkn = peek();
-            std::optional<int> prec;
-            if (curr_tkn.has_value()) {
-                prec = binary_precedence(curr_tkn->type);
-                if (!prec.has_value() || prec.value() < min_prec) {
-                    break;
+            // Expecting an operand: open frames until a whole term has been read
+            node_term *term;
+            if (auto int_lit = try_consume(tokentype::int_lit)) {
+                auto v_term_int_lit = m_allocator.alloc<node_term_int_lit>();
+                v_term_int_lit->int_lit = int_lit.value();
+                term = m_allocator.alloc<node_term>();
+                term->var = v_term_int_lit;
+            }
+            // '!' negates the term that follows it
+            else if (try_consume(tokentype::logical_not)) {
+                m_frames.push_back({expr_frame::kind::logical_not, m_operators.size()});
+                continue;
+            }
+            // An identifier followed by '(' is a function call, 'tail f(...)' one that must compile to a jump
+            else if (peek_call() || peek_type() == tokentype::tail) {
+                bool is_tail = try_consume(tokentype::tail).has_value();
+                if (is_tail && !peek_call()) {
+                    report_error("Error: Expected function call after 'tail'");
                 }
-            } else {
-                break;
+                auto v_term_call = m_allocator.alloc<node_term_call>();
+                v_term_call->ident = consume();
+                v_term_call->is_tail = is_tail;
+                consume(); // '('
+                if (!try_consume(tokentype::close_paren)) {
+                    m_frames.push_back({expr_frame::kind::call, m_operators.size(), v_term_call});
+                    continue;
+                }
+                term = m_allocator.alloc<node_term>();
+                term->var = v_term_call;
             }
-            token op = consume();
-            int v_next_min_prec = prec.value() + 1;
-            auto expr_rhs = parse_expr(v_next_min_prec);
-            if (!expr_rhs.has_value()) {
-                std::cerr << "Error: Unable to parse expression" << std::endl;
-                exit(EXIT_FAILURE);
+            // An identifier followed by '[' reads an array element
+            else if (peek_type() == tokentype::ident && peek_type(1) == tokentype::open_square) {
+                auto v_term_index = m_allocator.alloc<node_term_index>();
+                v_term_index->ident = consume();
+                consume(); // '['
+                m_frames.push_back({expr_frame::kind::index, m_operators.size(), nullptr, v_term_index});
+                continue;
             }
-
-            auto expr = m_allocator.alloc<node_binary_expr>();
-            auto expr_lhs2 = m_allocator.alloc<node_expr>();
-            if (op.type == tokentype::plus) {
-                auto add = m_allocator.alloc<node_binary_expr_add>();
-                expr_lhs2->var = expr_lhs->var;
-                add->lhs = expr_lhs2;
-                add->rhs = expr_rhs.value();
-                expr->var = add;
-            } else if (op.type == tokentype::star) {
-                auto multi = m_allocator.alloc<node_binary_expr_multiply>();
-                expr_lhs2->var = expr_lhs->var;
-                multi->lhs = expr_lhs2;
-                multi->rhs = expr_rhs.value();
-                expr->var = multi;
-            } else if (op.type == tokentype::minus) {
-                auto minus = m_allocator.alloc<node_binary_expr_minus>();
-                expr_lhs2->var = expr_lhs->var;
-                minus->lhs = expr_lhs2;
-                minus->rhs = expr_rhs.value();
-                expr->var = minus;
-            } else if (op.type == tokentype::div) {
-                auto div = m_allocator.alloc<node_binary_expr_divide>();
-                expr_lhs2->var = expr_lhs->var;
-                div->lhs = expr_lhs2;
-                div->rhs = expr_rhs.value();
-                expr->var = div;
-            } else if (op.type == tokentype::modu) {
-                auto modu = m_allocator.alloc<node_binary_expr_modulus>();
-                expr_lhs2->var = expr_lhs->var;
-                modu->lhs = expr_lhs2;
-                modu->rhs = expr_rhs.value();
-                expr->var = modu;
+            // If the next token is an identifier, parse it as node_expr_identifier
+            else if (auto ident = try_consume(tokentype::ident)) {
+                auto v_term_ident = m_allocator.alloc<node_term_identifier>();
+                v_term_ident->identifier = ident.value();
+                term = m_allocator.alloc<node_term>();
+                term->var = v_term_ident;
+            } else if (try_consume(tokentype::open_paren)) {
+                m_frames.push_back({expr_frame::kind::paren, m_operators.size()});
+                continue;
             } else {
-                assert(false);
+                const expr_frame &frame = m_frames.back();
+                if (m_operators.size() > frame.operators) {
+                    report_error("Error: Unable to parse expression");
+                }
+                switch (frame.kind) {
+                case expr_frame::kind::top:
+                    return {};
+                case expr_frame::kind::paren:
+                    report_error("Error: Expected expression");
+                case expr_frame::kind::logical_not:
+                    report_error("Error: Expected term after '!'");
+                case expr_frame::kind::call:
+                    report_error("Error: Invalid argument in call to '", frame.call->ident.value.value(), "'");
+                case expr_frame::kind::index:
+                    report_error("Error: Invalid array index");
+                }
             }
-            expr_lhs->var = expr;
-        }
 
-        return expr_lhs;
+            // Operand read: close the frames it completes until an operator or ',' asks for the next one
+            while (true) {
+                push_term(term);
+                const expr_frame frame = m_frames.back();
+                std::optional<int> prec;
+                if (auto type = peek_type()) {
+                    prec = binary_precedence(type.value());
+                }
+                if (prec.has_value()) {
+                    while (m_operators.size() > frame.operators &&
+                           binary_precedence(m_operators.back()).value() >= prec.value()) {
+                        reduce_operator();
+                    }
+                    m_operators.push_back(consume().type);
+                    break;
+                }
+                while (m_operators.size() > frame.operators) {
+                    reduce_operator();
+                }
+                node_expr *expr = m_operands.back();
+                m_operands.pop_back();
+                m_frames.pop_back();
+
+                if (frame.kind == expr_frame::kind::top) {
+                    return expr;
+                } else if (frame.kind == expr_frame::kind::paren) {
+                    try_consume(tokentype::close_paren, "Error: Expected ')'");
+                    auto term_paren = m_allocator.alloc<node_term_parentheses>();
+                    term_paren->expr = expr;
+                    term = m_allocator.alloc<node_term>();
+                    term->var = term_paren;
+                } else if (frame.kind == expr_frame::kind::call) {
+                    frame.call->args.push_back(m_allocator, expr);
+                    if (try_consume(tokentype::comma)) {
+                        m_frames.push_back(frame);
+                        break;
+                    }
+                    try_consume(tokentype::close_paren, "Error: Expected ')' after arguments");
+                    term = m_allocator.alloc<node_term>();
+                    term->var = frame.call;
+                } else {
+                    assert(frame.kind == expr_frame::kind::index);
+                    try_consume(tokentype::close_square, "Error: Expected ']'");
+                    frame.index->index = expr;
+                    term = m_allocator.alloc<node_term>();
+                    term->var = frame.index;
+                }
+            }
+        }
     }
 
+    // Scopes are parsed without recursion, so they can nest to any depth: a statement holding a scope only opens
+    // it on m_scope_frames, and parse_open_scopes fills the innermost open scope until its '}'.
     std::optional<node_scope *> parse_scope() {
         if (!try_consume(tokentype::open_curly).has_value()) {
             return {};
         }
         auto scope = m_allocator.alloc<node_scope>();
-        while (auto stmt = parse_statement()) {
-            scope->stmts.push_back(stmt.value());
-        }
-        try_consume(tokentype::close_curly, "Error: Expected '}'");
+        size_t base = m_scope_frames.size();
+        m_scope_frames.push_back({scope});
+        parse_open_scopes(base);
         return scope;
     }
 
+    // Parses a whole statement, including any scopes inside it
     std::optional<node_statement *> parse_statement() {
+        size_t base = m_scope_frames.size();
+        auto stmt = open_statement();
+        parse_open_scopes(base);
+        return stmt;
+    }
+
+    // Parses a statement, leaving the scopes it holds open on m_scope_frames
+    std::optional<node_statement *> open_statement() {
         if (peek().has_value() && peek().value().type == tokentype::exit) {
             try_consume(tokentype::exit, "Error: Expected 'exit' keyword");
             try_consume(tokentype::open_paren, "Error: Expected '(' after 'exit'");
@@ -263,8 +434,7 @@ class parser {
             if (auto expr = parse_expr()) {
                 stmt_exit->expr = expr.value();
             } else {
-                std::cerr << "Error: Invalid expression inside 'exit()'" << std::endl;
-                exit(EXIT_FAILURE);
+                report_error("Error: Invalid expression inside 'exit()'");
             }
             try_consume(tokentype::close_paren, "Error: Expected ')' after expression in 'exit()'");
             try_consume(tokentype::semi, "Error: Missing semicolon after 'exit()'");
@@ -273,6 +443,57 @@ class parser {
             return stmt;
         }
 
+        // Handle array declarations: let a[N]; or static let a[N];
+        if (peek().has_value() && (peek().value().type == tokentype::static_ ||
+                                   (peek().value().type == tokentype::let && peek(2).has_value() &&
+                                    peek(2).value().type == tokentype::open_square))) {
+            auto stmt_array = m_allocator.alloc<node_statement_array>();
+            stmt_array->is_static = try_consume(tokentype::static_).has_value();
+            try_consume(tokentype::let, "Error: Expected 'let' after 'static'");
+            stmt_array->ident = try_consume(tokentype::ident, "Error: Expected array name");
+            try_consume(tokentype::open_square, "Error: Expected '[' after array name");
+            auto size = try_consume(tokentype::int_lit, "Error: Expected constant array size");
+            // Sizes fit in 32 bits, the width of the interpreter's instruction operands
+            std::string_view digits = size.value.value();
+            if (std::from_chars(digits.data(), digits.data() + digits.size(), stmt_array->size).ec != std::errc() ||
+                stmt_array->size > UINT32_MAX) {
+                report_error("Error: Size of array '", stmt_array->ident.value.value(), "' out of range: ", digits);
+            }
+            if (stmt_array->size == 0) {
+                report_error("Error: Array '", stmt_array->ident.value.value(), "' must have a non-zero size");
+            }
+            try_consume(tokentype::close_square, "Error: Expected ']' after array size");
+            try_consume(tokentype::semi, "Error: Missing semicolon after array declaration");
+            auto stmt = m_allocator.alloc<node_statement>();
+            stmt->var = stmt_array;
+            return stmt;
+        }
+
+        // Handle assignments: x = expr; or a[i] = expr;
+        if (peek().has_value() && peek().value().type == tokentype::ident && peek(1).has_value() &&
+            (peek(1).value().type == tokentype::equals || peek(1).value().type == tokentype::open_square)) {
+            auto stmt_assign = m_allocator.alloc<node_statement_assign>();
+            stmt_assign->ident = consume();
+            if (try_consume(tokentype::open_square)) {
+                if (auto index = parse_expr()) {
+                    stmt_assign->index = index.value();
+                } else {
+                    report_error("Error: Invalid array index");
+                }
+                try_consume(tokentype::close_square, "Error: Expected ']'");
+            }
+            try_consume(tokentype::equals, "Error: Expected '=' in assignment");
+            if (auto expr = parse_expr()) {
+                stmt_assign->expr = expr.value();
+            } else {
+                report_error("Error: Invalid expression in assignment");
+            }
+            try_consume(tokentype::semi, "Error: Missing semicolon after assignment");
+            auto stmt = m_allocator.alloc<node_statement>();
+            stmt->var = stmt_assign;
+            return stmt;
+        }
+
         // Handle let statements
         if (peek().has_value() && peek().value().type == tokentype::let) {
             try_consume(tokentype::let, "Error: Expected 'let' keyword");
@@ -285,90 +506,453 @@ class parser {
             if (auto expr = parse_expr()) {
                 stmt_let->expr = expr.value();
             } else {
-                std::cerr << "Error: Invalid expression in 'let' statement" << std::endl;
-                exit(EXIT_FAILURE);
+                report_error("Error: Invalid expression in 'let' statement");
             }
 
             try_consume(tokentype::semi, "Error: Missing semicolon after 'let' statement");
             auto stmt = m_allocator.alloc<node_statement>();
             stmt->var = *stmt_let;
             return stmt;
-        } else if (peek().has_value() && peek().value().type == tokentype::open_curly) {
-            if (auto scope = parse_scope()) {
-                auto stmt = m_allocator.alloc<node_statement>();
-                stmt->var = scope.value();
-                return stmt;
-            } else {
-                std::cerr << "Error: Invalid scope" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-
+        } else if (auto scope = open_scope()) {
+            auto stmt = m_allocator.alloc<node_statement>();
+            stmt->var = scope.value();
+            return stmt;
         } else if (auto if_ = try_consume(tokentype::if_)) {
             try_consume(tokentype::open_paren, "Error: Expected'('");
             auto stmt_if = m_allocator.alloc<node_statement_if>();
             if (auto expr = parse_expr()) {
                 stmt_if->expr = expr.value();
             } else {
-                std::cerr << "Error: Invalid expression in 'let' statement" << std::endl;
-                exit(EXIT_FAILURE);
+                report_error("Error: Invalid expression in 'let' statement");
             }
             try_consume(tokentype::close_paren, "Error: Expected')'");
-            if (auto scope = parse_scope()) {
+            // An 'else' is looked for once the then-scope is closed
+            if (auto scope = open_scope(stmt_if)) {
                 stmt_if->scope = scope.value();
             } else {
-                std::cerr << "Error: Invalid scope" << std::endl;
-                exit(EXIT_FAILURE);
+                report_error("Error: Invalid scope");
             }
             auto stmt = m_allocator.alloc<node_statement>();
             stmt->var = stmt_if;
             return stmt;
+        } else if (try_consume(tokentype::while_)) {
+            try_consume(tokentype::open_paren, "Error: Expected '(' after 'while'");
+            auto stmt_while = m_allocator.alloc<node_statement_while>();
+            if (auto expr = parse_expr()) {
+                stmt_while->expr = expr.value();
+            } else {
+                report_error("Error: Invalid expression in 'while' condition");
+            }
+            try_consume(tokentype::close_paren, "Error: Expected ')'");
+            if (auto scope = open_scope()) {
+                stmt_while->scope = scope.value();
+            } else {
+                report_error("Error: Invalid scope");
+            }
+            auto stmt = m_allocator.alloc<node_statement>();
+            stmt->var = stmt_while;
+            return stmt;
+        } else if (try_consume(tokentype::match)) {
+            try_consume(tokentype::open_paren, "Error: Expected '(' after 'match'");
+            auto stmt_match = m_allocator.alloc<node_statement_match>();
+            if (auto expr = parse_expr()) {
+                stmt_match->expr = expr.value();
+            } else {
+                report_error("Error: Invalid expression in 'match'");
+            }
+            try_consume(tokentype::close_paren, "Error: Expected ')'");
+            try_consume(tokentype::open_curly, "Error: Expected '{' after 'match (...)'");
+            open_match_arm(stmt_match);
+            auto stmt = m_allocator.alloc<node_statement>();
+            stmt->var = stmt_match;
+            return stmt;
+        } else if (try_consume(tokentype::return_)) {
+            auto stmt_return = m_allocator.alloc<node_statement_return>();
+            if (auto expr = parse_expr()) {
+                stmt_return->expr = expr.value();
+            } else {
+                report_error("Error: Invalid expression in 'return' statement");
+            }
+            try_consume(tokentype::semi, "Error: Missing semicolon after 'return' statement");
+            auto stmt = m_allocator.alloc<node_statement>();
+            stmt->var = stmt_return;
+            return stmt;
         }
 
         return {};
     }
 
-    std::optional<node_program *> parse_prog() {
+    // Function definitions are only allowed at the top level
+    std::optional<node_statement *> parse_fn() {
+        if (!try_consume(tokentype::fn).has_value()) {
+            return {};
+        }
+        auto stmt_fn = m_allocator.alloc<node_statement_fn>();
+        stmt_fn->ident = try_consume(tokentype::ident, "Error: Expected function name after 'fn'");
+        try_consume(tokentype::open_paren, "Error: Expected '(' after function name");
+        if (!try_consume(tokentype::close_paren)) {
+            do {
+                stmt_fn->params.push_back(m_allocator,
+                                          try_consume(tokentype::ident, "Error: Expected parameter name"));
+            } while (try_consume(tokentype::comma));
+            try_consume(tokentype::close_paren, "Error: Expected ')' after parameters");
+        }
+        if (auto scope = parse_scope()) {
+            stmt_fn->scope = scope.value();
+        } else {
+            report_error("Error: Expected '{' to begin function body");
+        }
+        auto stmt = m_allocator.alloc<node_statement>();
+        stmt->var = stmt_fn;
+        return stmt;
+    }
+
+    // Inputs of at least parallel_tokens tokens are split at top-level statement boundaries and the pieces parsed
+    // on up to `threads` threads, each in its own fork of the arena. The pieces are stitched back together in order,
+    // giving the same program as parsing on one thread. Nodes stay valid for as long as the arena lives.
+    std::optional<node_program *> parse_prog(unsigned threads = std::thread::hardware_concurrency()) {
         auto prog = m_allocator.alloc<node_program>();
+        m_index = 0;
+        parse_imports(prog->imports);
+        const size_t body = m_index;
+        if (threads > 1 && m_tokens.size() - body >= parallel_tokens && parse_parallel(prog->stmts, threads, body)) {
+            return prog;
+        }
+        m_index = body;
+        parse_statements(prog->stmts);
+        return prog;
+    }
+
+  private:
+    static constexpr size_t parallel_tokens = 1 << 16; // Smaller inputs are parsed faster on one thread
+
+    // Worker reading the tokens of its parent, over ranges given by parse_parallel
+    inline explicit parser(const parser *parent, storage_allocator &arena)
+        : m_tokens(parent->m_tokens), m_end(0), m_allocator(arena) {}
+
+    // Imports come first in a file: import "path.qrk";
+    void parse_imports(arena_vector<token, 4> &imports) {
+        while (try_consume(tokentype::import)) {
+            imports.push_back(m_allocator,
+                              try_consume(tokentype::string_lit, "Error: Expected module path after 'import'"));
+            if (imports.back().value.value().empty()) {
+                report_error("Error: Empty module path in 'import'");
+            }
+            try_consume(tokentype::semi, "Error: Missing semicolon after 'import'");
+        }
+    }
+
+    // Parses top-level statements until the end of the tokens this parser may read
+    void parse_statements(statement_list &stmts) {
         while (peek().has_value()) {
-            if (auto stmt = parse_statement()) {
-                prog->stmts.push_back(*stmt.value());
+            if (peek_type() == tokentype::import) {
+                report_error("Error: Imports must come before any other statement");
+            }
+            if (auto fn = parse_fn()) {
+                stmts.push_back(m_allocator, fn.value());
+            } else if (auto stmt = parse_statement()) {
+                stmts.push_back(m_allocator, stmt.value());
             } else {
-                std::cerr << "Error: Invalid statement in program" << std::endl;
-                exit(EXIT_FAILURE);
+                report_error("Error: Invalid statement in program");
             }
         }
-        return prog;
     }
 
-  private:
-    const std::vector<token> m_tokens;
+    // Token offsets that start a chunk of the top-level statements from begin on, roughly chunk_tokens apart,
+    // ending with the token count. A statement ends at a ';' or '}' outside any brackets, except for an if's '}'
+    // followed by 'else'. No statement looks past its own end, so a chunk parses the same on its own as in
+    // sequence with the others.
+    std::vector<size_t> split_top_level(size_t begin, size_t chunk_tokens) const {
+        std::vector<size_t> starts = {begin};
+        int depth = 0; // Open (, [ and {
+        for (size_t i = begin; i + 1 < m_tokens.size(); ++i) {
+            switch (m_tokens[i].type) {
+            case tokentype::open_paren:
+            case tokentype::open_square:
+            case tokentype::open_curly:
+                ++depth;
+                continue;
+            case tokentype::close_paren:
+            case tokentype::close_square:
+                --depth;
+                continue;
+            case tokentype::close_curly:
+                if (--depth == 0 && m_tokens[i + 1].type == tokentype::else_) {
+                    continue;
+                }
+                break;
+            case tokentype::semi:
+                break;
+            default:
+                continue;
+            }
+            if (depth == 0 && i + 1 - starts.back() >= chunk_tokens) {
+                starts.push_back(i + 1);
+            }
+        }
+        starts.push_back(m_tokens.size());
+        return starts;
+    }
+
+    // Parses the chunks of the statements from begin on, on worker threads, into stmts. Returns false if any chunk
+    // failed, in which case the caller parses again on one thread: a malformed program may be split in the wrong
+    // places, and the sequential parse reports the same error it always would.
+    bool parse_parallel(statement_list &stmts, unsigned threads, size_t begin) {
+        std::vector<size_t> starts = split_top_level(begin, (m_tokens.size() - begin) / (threads * 4) + 1);
+        size_t chunks = starts.size() - 1;
+        if (chunks < 2) {
+            return false;
+        }
+        threads = static_cast<unsigned>(std::min<size_t>(threads, chunks));
+
+        std::vector<statement_list> parsed(chunks); // In the storage of the worker that parsed each chunk
+        std::vector<char> failed(chunks, false);
+        std::atomic<size_t> next = 0;
+        std::vector<std::unique_ptr<parser>> workers; // Their nodes live on in the forks of the arena
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.push_back(std::unique_ptr<parser>(new parser(this, m_allocator.fork())));
+        }
+        auto work = [&](parser &worker) {
+            for (size_t chunk = next++; chunk < chunks; chunk = next++) {
+                worker.m_index = starts[chunk];
+                worker.m_end = starts[chunk + 1];
+                try {
+                    worker.parse_statements(parsed[chunk]);
+                } catch (...) {
+                    failed[chunk] = true;
+                }
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; ++i) {
+            pool.emplace_back(work, std::ref(*workers[i]));
+        }
+        work(*workers[0]);
+        for (std::thread &thread : pool) {
+            thread.join();
+        }
+
+        for (char chunk_failed : failed) {
+            if (chunk_failed) {
+                return false;
+            }
+        }
+        size_t total = 0;
+        for (const statement_list &chunk : parsed) {
+            total += chunk.size();
+        }
+        stmts.reserve(m_allocator, total);
+        for (const statement_list &chunk : parsed) {
+            stmts.append(m_allocator, chunk.begin(), chunk.end());
+        }
+        return true;
+    }
+
+    // Scope whose statements are being parsed, and what to look for after its '}'
+    struct scope_frame {
+        node_scope *scope;
+        node_statement_if *stmt_if = nullptr;       // Then-scope of this if, which may be followed by an else
+        node_statement_match *stmt_match = nullptr; // Arm of this match, which may be followed by more arms
+    };
+
+    // Consumes '{' and opens a scope for parse_open_scopes to fill
+    std::optional<node_scope *> open_scope(node_statement_if *stmt_if = nullptr,
+                                           node_statement_match *stmt_match = nullptr) {
+        if (!try_consume(tokentype::open_curly).has_value()) {
+            return {};
+        }
+        auto scope = m_allocator.alloc<node_scope>();
+        m_scope_frames.push_back({scope, stmt_if, stmt_match});
+        return scope;
+    }
+
+    // Parses statements into the innermost open scope, closing scopes as their '}' is reached, until only the
+    // scopes up to base are left open
+    void parse_open_scopes(size_t base) {
+        while (m_scope_frames.size() > base) {
+            node_scope *scope = m_scope_frames.back().scope;
+            if (auto stmt = open_statement()) {
+                scope->stmts.push_back(m_allocator, stmt.value());
+                continue;
+            }
+            try_consume(tokentype::close_curly, "Error: Expected '}'");
+            scope_frame closed = m_scope_frames.back();
+            m_scope_frames.pop_back();
+
+            if (closed.stmt_match != nullptr) {
+                open_match_arm(closed.stmt_match);
+            } else if (closed.stmt_if != nullptr && try_consume(tokentype::else_)) {
+                // 'else if' is an else scope holding just the if, which opens its own then-scope
+                if (peek_type() == tokentype::if_) {
+                    auto else_scope = m_allocator.alloc<node_scope>();
+                    else_scope->stmts.push_back(m_allocator, open_statement().value());
+                    closed.stmt_if->else_scope = else_scope;
+                } else if (auto else_scope = open_scope()) {
+                    closed.stmt_if->else_scope = else_scope.value();
+                } else {
+                    report_error("Error: Expected '{' or 'if' after 'else'");
+                }
+            }
+        }
+    }
+
+    // Opens the scope of the next arm of a match, or consumes the '}' that ends the match
+    void open_match_arm(node_statement_match *stmt_match) {
+        if (try_consume(tokentype::close_curly)) {
+            return;
+        }
+        node_match_arm arm;
+        if (!try_consume(tokentype::underscore)) {
+            bool negative = try_consume(tokentype::minus).has_value();
+            auto value = try_consume(tokentype::int_lit, "Error: Expected integer constant or '_' in 'match'");
+            std::string text = (negative ? "-" : "") + std::string(value.value.value());
+            int64_t pattern;
+            auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), pattern);
+            if (error != std::errc()) {
+                report_error("Error: Integer constant out of range in 'match': ", text);
+            }
+            arm.value = pattern;
+        }
+        try_consume(tokentype::arrow, "Error: Expected '=>' after 'match' pattern");
+        if (auto scope = open_scope(nullptr, stmt_match)) {
+            arm.scope = scope.value();
+        } else {
+            report_error("Error: Expected '{' after '=>'");
+        }
+        stmt_match->arms.push_back(m_allocator, arm);
+    }
+
+    // Construct whose end also ends an expression: the whole expression, '( ... )', the term after '!', one
+    // argument of a call or an array index
+    struct expr_frame {
+        enum class kind { top, paren, logical_not, call, index } kind;
+        size_t operators;                 // Operator stack height when the frame was opened
+        node_term_call *call = nullptr;   // Call whose arguments are being read
+        node_term_index *index = nullptr; // Array read whose index is being read
+    };
+
+    [[nodiscard]] bool peek_call() const {
+        return peek_type() == tokentype::ident && peek_type(1) == tokentype::open_paren;
+    }
+
+    // Pushes a finished term as an operand, first applying every '!' that was waiting for it
+    void push_term(node_term *term) {
+        auto expr = m_allocator.alloc<node_expr>();
+        expr->var = term;
+        while (m_frames.back().kind == expr_frame::kind::logical_not) {
+            m_frames.pop_back();
+            auto v_term_not = m_allocator.alloc<node_term_not>();
+            v_term_not->expr = expr;
+            auto term_not = m_allocator.alloc<node_term>();
+            term_not->var = v_term_not;
+            expr = m_allocator.alloc<node_expr>();
+            expr->var = term_not;
+        }
+        m_operands.push_back(expr);
+    }
+
+    template <typename T> T *make_binary(node_expr *lhs, node_expr *rhs) {
+        auto node = m_allocator.alloc<T>();
+        node->lhs = lhs;
+        node->rhs = rhs;
+        return node;
+    }
+
+    // Replaces the top two operands with the top operator applied to them
+    void reduce_operator() {
+        tokentype op = m_operators.back();
+        m_operators.pop_back();
+        node_expr *rhs = m_operands.back();
+        m_operands.pop_back();
+        node_expr *lhs = m_operands.back();
+
+        auto bin_expr = m_allocator.alloc<node_binary_expr>();
+        if (op == tokentype::plus) {
+            bin_expr->var = make_binary<node_binary_expr_add>(lhs, rhs);
+        } else if (op == tokentype::star) {
+            bin_expr->var = make_binary<node_binary_expr_multiply>(lhs, rhs);
+        } else if (op == tokentype::minus) {
+            bin_expr->var = make_binary<node_binary_expr_minus>(lhs, rhs);
+        } else if (op == tokentype::div) {
+            bin_expr->var = make_binary<node_binary_expr_divide>(lhs, rhs);
+        } else if (op == tokentype::modu) {
+            bin_expr->var = make_binary<node_binary_expr_modulus>(lhs, rhs);
+        } else if (op == tokentype::logical_and) {
+            bin_expr->var = make_binary<node_binary_expr_and>(lhs, rhs);
+        } else if (op == tokentype::logical_or) {
+            bin_expr->var = make_binary<node_binary_expr_or>(lhs, rhs);
+        } else if (auto op_compare = compare_operator(op)) {
+            auto compare = make_binary<node_binary_expr_compare>(lhs, rhs);
+            compare->op = op_compare.value();
+            bin_expr->var = compare;
+        } else {
+            assert(false);
+        }
+        auto expr = m_allocator.alloc<node_expr>();
+        expr->var = bin_expr;
+        m_operands.back() = expr;
+    }
+
+    static std::optional<compare_op> compare_operator(tokentype type) {
+        switch (type) {
+        case tokentype::double_equals:
+            return compare_op::eq;
+        case tokentype::not_equals:
+            return compare_op::ne;
+        case tokentype::less:
+            return compare_op::lt;
+        case tokentype::less_equals:
+            return compare_op::le;
+        case tokentype::greater:
+            return compare_op::gt;
+        case tokentype::greater_equals:
+            return compare_op::ge;
+        default:
+            return {};
+        }
+    }
+
+    const std::vector<token> &m_tokens; // Shared by the workers of parse_parallel
     size_t m_index = 0;
+    size_t m_end; // One past the last token this parser may read
 
     [[nodiscard]] std::optional<token> peek(int offset = 0) const {
-        if (m_index + offset >= m_tokens.size())
+        if (m_index + offset >= m_end)
             return {};
         return m_tokens.at(m_index + offset);
     }
 
+    // Type of a token ahead, without copying the token
+    [[nodiscard]] std::optional<tokentype> peek_type(int offset = 0) const {
+        if (m_index + offset >= m_end)
+            return {};
+        return m_tokens[m_index + offset].type;
+    }
+
     token consume() {
         return m_tokens.at(m_index++);
     }
 
-    inline token try_consume(tokentype type, const std::string &err_msg) {
-        if (peek().has_value() && peek().value().type == type) {
+    inline token try_consume(tokentype type, const char *err_msg) { // Not a std::string, to not allocate per call
+        if (peek_type() == type) {
             return consume();
         } else {
-            std::cerr << err_msg << std::endl;
-            exit(EXIT_FAILURE);
+            report_error(err_msg);
         }
     }
 
     inline std::optional<token> try_consume(tokentype type) {
-        if (peek().has_value() && peek().value().type == type) {
+        if (peek_type() == type) {
             return consume();
         }
         return {};
     }
 
-    storage_allocator m_allocator;
+    storage_allocator &m_allocator; // Owned by the caller, or forked from it for a worker
+
+    // Working stacks of parse_expr, kept between calls so their storage is reused
+    std::vector<node_expr *> m_operands;
+    std::vector<tokentype> m_operators;
+    std::vector<expr_frame> m_frames;
+    std::vector<scope_frame> m_scope_frames; // Scopes being parsed, innermost last
 };
@@ -0,0 +1,183 @@
+#include "querk.hpp"
+
+#include <exception> // For errors other than compile_error
+
+#include "ast_file.hpp"
+#include "compilation.hpp"
+#include "jit.hpp"
+#include "modules.hpp"
+
+bool parse_option(const std::string &arg, generator_options &options) {
+    if (arg == "--no-bounds-check") {
+        options.bounds_checks = false;
+    } else if (arg == "--no-cmov") {
+        options.cmov = false;
+    } else if (arg == "--target=scalar") {
+        options.target = simd_target::scalar;
+    } else if (arg == "--target=sse2") {
+        options.target = simd_target::sse2;
+    } else if (arg == "--target=avx2") {
+        options.target = simd_target::avx2;
+    } else if (arg.rfind("--threads=", 0) == 0) {
+        const char *count = arg.c_str() + 10;
+        char *end;
+        unsigned long threads = std::strtoul(count, &end, 10);
+        if (*count < '1' || *count > '9' || *end != '\0' || threads > 1024) {
+            return false;
+        }
+        options.threads = static_cast<unsigned>(threads);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Program to compile: source text, or the path of an AST file written by emit_ast
+struct program_input {
+    std::string_view source;
+    const std::string *ast_path = nullptr;
+    std::filesystem::path base = ".";               // Directory its imports are resolved against
+    std::vector<std::string> *objects = nullptr;    // If set, imports are built separately and their objects go here
+    std::filesystem::path cache = module_cache_dir; // Where those objects are kept
+    shared_symbol_interner *symbols = nullptr;      // If set, spellings are shared with other compilations
+};
+
+// Message for an exception other than compile_error, such as std::bad_alloc, which must not escape libquerk either
+static std::string internal_error(const std::exception &error) {
+    return std::string("Error: Internal compiler error: ") + error.what();
+}
+
+// Runs every phase up to code generation, recording which phase a compile_error came from
+static std::optional<asm_buffer> generate(const program_input &input, const generator_options &options,
+                                          std::vector<diagnostic> &diagnostics) {
+    const char *phase = "tokenizer";
+    try {
+        compilation unit{std::string(input.source), node_arenas(), input.symbols};
+        node_program *prog;
+        if (input.ast_path != nullptr) {
+            phase = "ast";
+            prog = &unit.load_ast(*input.ast_path);
+        } else {
+            unit.tokenize();
+
+            phase = "parser";
+            prog = &unit.parse(thread_count(options));
+        }
+
+        phase = "module";
+        std::optional<module_loader> modules; // Owns the nodes of imported functions compiled into the program
+        std::vector<extern_function> externs;
+        if (!prog->imports.empty() && input.objects != nullptr) {
+            module_builder builder(options, input.cache);
+            externs = builder.build(*prog, input.base);
+            *input.objects = builder.objects();
+        } else if (!prog->imports.empty()) {
+            modules.emplace(*prog, input.base, thread_count(options));
+        }
+
+        phase = "generator";
+        generator obj_generator(*prog, options, std::move(externs));
+        asm_buffer output;
+        obj_generator.generate_program(output);
+        return output;
+    } catch (const compile_error &error) {
+        diagnostics.push_back({.phase = phase, .message = error.what()});
+        return std::nullopt;
+    } catch (const std::exception &error) {
+        diagnostics.push_back({.phase = phase, .message = internal_error(error)});
+        return std::nullopt;
+    }
+}
+
+static compile_result compile_input(program_input input, const generator_options &options) {
+    compile_result result;
+    input.objects = &result.objects;
+    result.assembly = generate(input, options, result.diagnostics);
+    return result;
+}
+
+static run_result run_input(const program_input &input, generator_options options) {
+    run_result result;
+    if (options.target == simd_target::avx2) {
+        result.diagnostics.push_back({.phase = "jit", .message = "Error: --run does not support --target=avx2"});
+        return result;
+    }
+    options.jit = true;
+    std::optional<asm_buffer> assembly = generate(input, options, result.diagnostics);
+    if (!assembly.has_value()) {
+        return result;
+    }
+    try {
+        jit program(assembly->view());
+        result.status = program.run();
+    } catch (const compile_error &error) {
+        result.diagnostics.push_back({.phase = "jit", .message = error.what()});
+    } catch (const std::exception &error) {
+        result.diagnostics.push_back({.phase = "jit", .message = internal_error(error)});
+    }
+    return result;
+}
+
+compile_result compile_source(std::string_view source, const generator_options &options) {
+    compile_result result;
+    result.assembly = generate({.source = source}, options, result.diagnostics);
+    return result;
+}
+
+run_result run_source(std::string_view source, generator_options options) {
+    return run_input({.source = source}, options);
+}
+
+compile_result compile_file(std::string_view source, const std::string &path, const generator_options &options) {
+    return compile_input({.source = source, .base = module_base(path)}, options);
+}
+
+compile_result compile_file(std::string_view source, const std::string &path, const generator_options &options,
+                            const std::string &working_dir, shared_symbol_interner *symbols) {
+    std::filesystem::path dir(working_dir);
+    return compile_input(
+        {.source = source, .base = dir / module_base(path), .cache = dir / module_cache_dir, .symbols = symbols},
+        options);
+}
+
+run_result run_file(std::string_view source, const std::string &path, generator_options options) {
+    return run_input({.source = source, .base = module_base(path)}, options);
+}
+
+compile_result compile_ast(const std::string &path, const generator_options &options) {
+    return compile_input({.ast_path = &path, .base = module_base(path)}, options);
+}
+
+run_result run_ast(const std::string &path, generator_options options) {
+    return run_input({.ast_path = &path, .base = module_base(path)}, options);
+}
+
+std::vector<diagnostic> emit_ast(std::string_view source, const std::string &path, const generator_options &options) {
+    std::vector<diagnostic> diagnostics;
+    const char *phase = "tokenizer";
+    try {
+        compilation unit{std::string(source)};
+        unit.tokenize();
+
+        phase = "parser";
+        node_program &prog = unit.parse(thread_count(options));
+
+        phase = "ast";
+        if (!ast_writer(prog).write_to(path)) {
+            report_error("Error: Unable to write AST file ", path);
+        }
+    } catch (const compile_error &error) {
+        diagnostics.push_back({.phase = phase, .message = error.what()});
+    } catch (const std::exception &error) {
+        diagnostics.push_back({.phase = phase, .message = internal_error(error)});
+    }
+    return diagnostics;
+}
+
+void configure_arenas(const arena_options &options) {
+    node_arenas().configure(options);
+}
+
+arena_pool::stats arena_statistics() {
+    return node_arenas().statistics();
+}
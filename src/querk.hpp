@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "emitter.hpp"
+#include "generation.hpp"
+
+// ============================= LIBQUERK =============================
+
+// Compiles programs from memory to memory inside the calling process. Nothing here prints, exits or throws:
+// problems with the program come back as diagnostics, and so does any other failure such as running out of memory,
+// so one process can compile any number of programs.
+
+// Problem found while compiling
+struct diagnostic {
+    std::string phase; // Part of the compiler that found it: "tokenizer", "parser", "ast", "module", "generator" or
+                       // "jit"
+    std::string message; // As querk prints it, e.g. "Error: Undeclared Identifier x"
+};
+
+// Outcome of compile_source: the NASM assembly of the program, or the diagnostics explaining why there is none
+struct compile_result {
+    std::optional<asm_buffer> assembly;
+    std::vector<std::string> objects; // Objects of the modules it imports to link it with, from compile_file
+    std::vector<diagnostic> diagnostics;
+
+    bool ok() const {
+        return assembly.has_value();
+    }
+};
+
+// Outcome of run_source: the status the program exited with, or the diagnostics explaining why it did not run
+struct run_result {
+    std::optional<int64_t> status;
+    std::vector<diagnostic> diagnostics;
+
+    bool ok() const {
+        return status.has_value();
+    }
+};
+
+// Applies a querk code generation flag such as "--no-cmov" or "--target=avx2" to options; false if arg is not one
+bool parse_option(const std::string &arg, generator_options &options);
+
+// Compiles source to NASM assembly. Modules it imports (see modules.hpp) are looked up from the working directory
+// and compiled into the same assembly.
+compile_result compile_source(std::string_view source, const generator_options &options = {});
+
+// Compiles source and runs it in-process like querk --run. The program's own output, such as a failed bounds
+// check, still goes to the process's stdout and stderr.
+run_result run_source(std::string_view source, generator_options options = {});
+
+// Compiles source read from the file at path, the same text querk writes to out.asm. Modules it imports are
+// looked up next to that file and each compiled to an object of its own in .querk-cache, where it is reused while
+// neither its source nor the functions it can call change; the objects to link with come back in objects.
+compile_result compile_file(std::string_view source, const std::string &path, const generator_options &options = {});
+
+// compile_file on behalf of a process whose working directory is working_dir, such as a compile server's client:
+// a relative path is taken from there and the module objects are kept in its .querk-cache. Spellings are taken
+// from symbols, if given, which must outlive the call.
+compile_result compile_file(std::string_view source, const std::string &path, const generator_options &options,
+                            const std::string &working_dir, shared_symbol_interner *symbols = nullptr);
+
+// run_source for source read from the file at path, with the modules it imports looked up next to that file
+run_result run_file(std::string_view source, const std::string &path, generator_options options = {});
+
+// Parses source and saves the program to an AST file at path (see ast_file.hpp), so later compilations can skip
+// tokenizing and parsing. Returns the diagnostics, empty on success.
+std::vector<diagnostic> emit_ast(std::string_view source, const std::string &path,
+                                 const generator_options &options = {});
+
+// compile_file and run_file for a program loaded from an AST file written by emit_ast
+compile_result compile_ast(const std::string &path, const generator_options &options = {});
+run_result run_ast(const std::string &path, generator_options options = {});
+
+// The arenas compilations in this process take their nodes from (see arena_pool in storage.hpp). A long-running
+// host such as the compile server can have their blocks pre-faulted, and watch how much memory they hold.
+void configure_arenas(const arena_options &options);
+arena_pool::stats arena_statistics();
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <cerrno>
+#include <charconv> // For reading the flag count
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem> // For the client's working directory
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <csignal>      // For ignoring SIGPIPE
+#include <fcntl.h>      // For open
+#include <sys/socket.h> // For the Unix domain socket
+#include <sys/stat.h>   // For chmod
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "querk.hpp"
+
+// ============================= COMPILE SERVER =============================
+
+// Wire format: every message is a sequence of fields, each a 32-bit length followed by that many bytes.
+//  - Request:  flag count, the flags, the client's working directory, the input path, the source
+//  - Response: exit status, diagnostics, out.asm, out (empty when nasm or ld did not produce it)
+// The server bounds the flag count and every field of a request, and answers one it cannot read with status 1.
+
+// Socket used when --server or --client is given without a path
+inline std::string default_socket_path() {
+    return "/tmp/querk-" + std::to_string(getuid()) + ".sock";
+}
+
+inline bool write_all(int fd, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool read_all(int fd, void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool send_field(int fd, std::string_view field) {
+    uint32_t size = static_cast<uint32_t>(field.size());
+    return write_all(fd, &size, sizeof(size)) && write_all(fd, field.data(), field.size());
+}
+
+// Fails on a field longer than max_size without reading it, so a bad length cannot make the reader allocate
+inline bool recv_field(int fd, std::string &field, uint32_t max_size = UINT32_MAX) {
+    uint32_t size;
+    if (!read_all(fd, &size, sizeof(size)) || size > max_size) {
+        return false;
+    }
+    field.resize(size);
+    return read_all(fd, field.data(), size);
+}
+
+// Whole file, or an empty string if it does not exist
+inline std::string read_file(const std::string &path) {
+    std::ifstream input(path, std::ios::binary);
+    std::stringstream contents;
+    contents << input.rdbuf();
+    return contents.str();
+}
+
+// Listens on a Unix domain socket and compiles each request it receives. Connections are served concurrently,
+// one thread each, and results are cached by flags and source, so an unchanged program is answered without
+// compiling it again. Programs are compiled in-process with compile_file as if in the client's working directory:
+// imports are found next to the client's input file and their objects kept in the client's .querk-cache, the same
+// as a local build. A program that imports is compiled on every request, since its modules may have changed;
+// module_builder then rebuilds only what did. Every compilation takes its identifiers and literals from one
+// shared_symbol_interner that lives as long as the server, so names that requests repeat are stored once. Only
+// nasm and ld are run as separate commands, in a private directory per request.
+class compile_server {
+  public:
+    inline explicit compile_server(std::string path) : m_path(std::move(path)) {}
+
+    inline compile_server(const compile_server &) = delete;
+    inline compile_server &operator=(const compile_server &) = delete;
+
+    // Serves requests until the process is killed; returns only if the socket cannot be set up
+    inline int serve() {
+        signal(SIGPIPE, SIG_IGN); // A client going away must not take the server with it
+        configure_arenas({.populate = true, .huge_pages = true}); // Requests reuse arenas already faulted in
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (listener < 0 || m_path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Error: Unable to create socket " << m_path << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::memcpy(addr.sun_path, m_path.c_str(), m_path.size() + 1);
+        unlink(m_path.c_str()); // Left behind by a previous server
+        if (bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+            std::cerr << "Error: Unable to listen on " << m_path << std::endl;
+            close(listener);
+            return EXIT_FAILURE;
+        }
+        std::cerr << "querk: serving on " << m_path << std::endl;
+
+        while (true) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                continue;
+            }
+            // Nothing a request does may end the process: an exception is answered as an error and the server
+            // carries on with the other connections
+            std::thread([this, client] {
+                try {
+                    handle(client);
+                } catch (const std::exception &error) {
+                    send_error(client, std::string("Error: Compile server failed: ") + error.what());
+                }
+                close(client);
+            }).detach();
+        }
+    }
+
+  private:
+    struct result {
+        std::string status;
+        std::string diagnostics;
+        std::string assembly;
+        std::string binary;
+        // Follows from the flags and source alone. Not so for a program linked with module objects, which may
+        // have changed, nor for one that failed, perhaps because a module it imports is missing.
+        bool cacheable = false;
+    };
+
+    // Status 1 with the message as the only diagnostic, for a request that was not compiled
+    static inline void send_error(int client, const std::string &message) {
+        send_field(client, "1") && send_field(client, message + "\n") && send_field(client, "") &&
+            send_field(client, "");
+    }
+
+    inline void handle(int client) {
+        std::string count;
+        size_t flag_count = 0;
+        if (!recv_field(client, count, max_flag_size) ||
+            std::from_chars(count.data(), count.data() + count.size(), flag_count).ec != std::errc() ||
+            flag_count > max_flags) {
+            send_error(client, "Error: Malformed request to compile server");
+            return;
+        }
+        std::vector<std::string> flags(flag_count);
+        std::string working_dir, path, source;
+        for (std::string &flag : flags) {
+            if (!recv_field(client, flag, max_flag_size)) {
+                send_error(client, "Error: Malformed request to compile server");
+                return;
+            }
+        }
+        if (!recv_field(client, working_dir, max_path_size) || !recv_field(client, path, max_path_size)) {
+            send_error(client, "Error: Malformed request to compile server");
+            return;
+        }
+        if (!recv_field(client, source, max_source_size)) {
+            send_error(client, "Error: Malformed request to compile server, or source larger than " +
+                                   std::to_string(max_source_size >> 20) + " MiB");
+            return;
+        }
+
+        std::string key;
+        for (const std::string &flag : flags) {
+            key += flag;
+            key += '\n';
+        }
+        key += '\0';
+        key += source;
+
+        result res;
+        bool cached;
+        {
+            std::lock_guard<std::mutex> lock(m_cache_mutex);
+            auto it = m_cache.find(key);
+            cached = it != m_cache.end();
+            if (cached) {
+                res = it->second;
+            }
+        }
+        if (!cached) {
+            res = compile(flags, working_dir, path, source);
+            if (res.cacheable) {
+                std::lock_guard<std::mutex> lock(m_cache_mutex);
+                if (m_cache.size() >= max_cached) {
+                    m_cache.clear();
+                }
+                m_cache.emplace(std::move(key), res);
+            }
+        }
+
+        send_field(client, res.status) && send_field(client, res.diagnostics) && send_field(client, res.assembly) &&
+            send_field(client, res.binary);
+    }
+
+    // Same outcome as querk compiling the program locally, with out.asm and out read back into the result
+    inline result compile(const std::vector<std::string> &flags, const std::string &working_dir,
+                          const std::string &path, const std::string &source) {
+        result res;
+        generator_options options;
+        for (const std::string &flag : flags) {
+            if (!parse_option(flag, options)) {
+                return {.status = "1", .diagnostics = "Error: Unsupported option " + flag + "\n"};
+            }
+        }
+        compile_result compiled = compile_file(source, path, options, working_dir, &m_symbols);
+        res.cacheable = compiled.ok() && compiled.objects.empty();
+        for (const diagnostic &diag : compiled.diagnostics) {
+            res.diagnostics += diag.message + "\n";
+        }
+        if (!compiled.ok()) {
+            res.status = "1";
+            return res;
+        }
+        res.status = "0";
+        res.assembly = compiled.assembly->view();
+
+        char dir[] = "/tmp/querk-XXXXXX";
+        if (mkdtemp(dir) == nullptr) {
+            res.diagnostics += "Error: Unable to create a working directory\n";
+            return res;
+        }
+        const std::string base = std::string(dir) + "/";
+        std::ofstream(base + "out.asm", std::ios::binary) << res.assembly;
+        std::string commands = "cd " + base + " && nasm -f elf64 out.asm -o out.o > diagnostics 2>&1 && " +
+                               "ld -o out out.o";
+        for (const std::string &object : compiled.objects) {
+            commands += " '" + object + "'";
+        }
+        commands += " >> diagnostics 2>&1";
+        system(commands.c_str());
+        res.diagnostics += read_file(base + "diagnostics");
+        res.binary = read_file(base + "out");
+        for (const char *name : {"diagnostics", "out.asm", "out.o", "out"}) {
+            unlink((base + name).c_str());
+        }
+        rmdir(dir);
+        return res;
+    }
+
+    static constexpr size_t max_cached = 4096;             // The cache starts over once it holds this many results
+    static constexpr size_t max_flags = 64;                // Flags in one request
+    static constexpr uint32_t max_flag_size = 256;         // Bytes in one flag, and in the flag count
+    static constexpr uint32_t max_path_size = 4096;        // Bytes in the working directory and the input path
+    static constexpr uint32_t max_source_size = 256 << 20; // Bytes of source in one request
+    static constexpr size_t max_symbol_bytes = 64 << 20;   // Bytes of spellings kept in m_symbols
+
+    std::string m_path;
+    std::mutex m_cache_mutex;
+    std::unordered_map<std::string, result> m_cache;
+    shared_symbol_interner m_symbols{max_symbol_bytes}; // Shared by every request's compilation
+};
+
+// ============================= COMPILE CLIENT =============================
+
+// Sends one compilation to a compile_server and reproduces what querk would have done locally: out.asm and out
+// in the working directory, diagnostics on stderr and the same exit status
+class compile_client {
+  public:
+    inline explicit compile_client(std::string path) : m_path(std::move(path)) {}
+
+    // path is the input file, whose imports the server looks up next to it like a local build would
+    inline int compile(const std::vector<std::string> &flags, const std::string &path,
+                       const std::string &source) const {
+        int server = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (server < 0 || m_path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Error: Unable to create socket " << m_path << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::memcpy(addr.sun_path, m_path.c_str(), m_path.size() + 1);
+        if (connect(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+            std::cerr << "Error: Unable to connect to compile server at " << m_path << std::endl;
+            close(server);
+            return EXIT_FAILURE;
+        }
+
+        // A server that rejects the request answers and stops reading, so the answer is read even when sending
+        // the rest failed
+        signal(SIGPIPE, SIG_IGN);
+        bool sent = send_field(server, std::to_string(flags.size()));
+        for (const std::string &flag : flags) {
+            sent = sent && send_field(server, flag);
+        }
+        std::error_code error;
+        std::filesystem::path working_dir = std::filesystem::current_path(error);
+        sent = sent && !error && send_field(server, working_dir.string()) &&
+               send_field(server, (working_dir / path).lexically_normal().string()) && send_field(server, source);
+        std::string status, diagnostics, assembly, binary;
+        bool received = recv_field(server, status) && recv_field(server, diagnostics) &&
+                        recv_field(server, assembly) && recv_field(server, binary);
+        close(server);
+        if (!received) {
+            std::cerr << "Error: " << (sent ? "Lost connection to" : "Unable to send the program to")
+                      << " compile server at " << m_path << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::cerr << diagnostics;
+        unlink("out");
+        if (!assembly.empty()) {
+            std::ofstream("out.asm", std::ios::binary) << assembly;
+        }
+        if (!binary.empty()) {
+            std::ofstream("out", std::ios::binary) << binary;
+            chmod("out", 0755);
+        }
+        return std::atoi(status.c_str());
+    }
+
+  private:
+    std::string m_path;
+};
@@ -1,31 +1,524 @@
 #pragma once
 
-#include <cstdlib> // For malloc and free
-#include <cstddef> // For std::byte
-#include <new>     // For placement new
+#include <algorithm>     // For std::max
+#include <cstdlib>       // For malloc and free
+#include <cstddef>       // For std::byte
+#include <cstdint>       // For uintptr_t
+#include <cstring>       // For memcpy
+#include <iterator>      // For std::reverse_iterator
+#include <memory>        // For the forked allocators
+#include <mutex>         // For the arena pool
+#include <new>           // For placement new and std::bad_alloc
+#include <optional>
+#include <shared_mutex>  // For the shared interner
+#include <string_view>   // For interned symbols
+#include <type_traits>   // For the element requirements of arena_vector
+#include <unordered_set> // For looking up interned symbols
+#include <vector>        // For the list of blocks
+#include <sys/mman.h>    // For mapped blocks
 
+// Where the blocks of an arena come from. By default they are malloc'd; an arena kept for reuse (see arena_pool) may
+// map them instead, faulting their pages in up front and asking for transparent huge pages, so that later
+// compilations start on memory that is already there.
+struct arena_options {
+    bool populate = false;   // Fault every page of a block in when it is mapped (MAP_POPULATE)
+    bool huge_pages = false; // Back blocks with transparent huge pages where the kernel allows (MADV_HUGEPAGE)
+};
+
+// Bump allocator for AST nodes. Memory comes in blocks of the size given to the constructor; when one is full
+// another is chained on, so inputs of any size fit without moving nodes that were already handed out. reset
+// forgets every node at once and keeps the blocks for the next use.
 class storage_allocator {
   public:
-    inline explicit storage_allocator(size_t bytes) : m_size(bytes) {
-        m_buffer = reinterpret_cast<std::byte *>(malloc(m_size));
-        m_offset = m_buffer;
+    inline explicit storage_allocator(size_t bytes, arena_options options = {}) : m_size(bytes), m_options(options) {
+        add_block(m_size);
     }
 
     template <typename T> inline T *alloc() {
-        void *offset = m_offset;
-        m_offset += sizeof(T);
-        return reinterpret_cast<T *>(offset);
+        return new (allocate(sizeof(T), alignof(T))) T(); // Construct in place so members start out valid
+    }
+
+    // Uninitialised room for count elements, for types that need no constructor
+    template <typename T> inline T *alloc_array(size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return reinterpret_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    // Allocator for another thread, freed along with this one and reset with it. Forking is not thread-safe, but
+    // the two may then be used on different threads at once.
+    inline storage_allocator &fork() {
+        if (m_forks_used == m_forks.size()) {
+            m_forks.push_back(std::make_unique<storage_allocator>(m_size, m_options));
+        }
+        return *m_forks[m_forks_used++];
+    }
+
+    // Drops everything allocated so far, forks included, so the blocks serve what is allocated next. Blocks past
+    // the first keep_bytes are given back; the time taken does not depend on how much was allocated in the rest.
+    inline void reset(size_t keep_bytes = SIZE_MAX) {
+        m_high_water = high_water();
+        for (size_t i = 0; i < m_forks_used; ++i) {
+            m_forks[i]->reset(keep_bytes);
+        }
+        m_forks_used = 0;
+        size_t kept = 0;
+        size_t blocks = 0;
+        while (blocks < m_blocks.size() && (blocks == 0 || kept + m_blocks[blocks].size() <= keep_bytes)) {
+            kept += m_blocks[blocks++].size();
+        }
+        while (m_blocks.size() > blocks) {
+            release(m_blocks.back());
+            m_blocks.pop_back();
+        }
+        m_reserved = kept;
+        use_block(0);
+        m_used_before = 0;
+    }
+
+    // Bytes handed out since the arena was made or last reset, forks included
+    inline size_t used() const {
+        size_t bytes = m_used_before + static_cast<size_t>(m_offset - m_blocks[m_current].begin);
+        for (size_t i = 0; i < m_forks_used; ++i) {
+            bytes += m_forks[i]->used();
+        }
+        return bytes;
+    }
+
+    // Most bytes in use at once, over every use of the arena
+    inline size_t high_water() const {
+        return std::max(m_high_water, used());
+    }
+
+    // Bytes of blocks held, forks included
+    inline size_t reserved() const {
+        size_t bytes = m_reserved;
+        for (const std::unique_ptr<storage_allocator> &fork : m_forks) {
+            bytes += fork->reserved();
+        }
+        return bytes;
     }
 
     inline storage_allocator(const storage_allocator &) = delete;
     inline storage_allocator &operator=(const storage_allocator &) = delete;
 
     inline ~storage_allocator() {
-        free(m_buffer);
+        for (const block &b : m_blocks) {
+            release(b);
+        }
     }
 
   private:
-    size_t m_size;
-    std::byte *m_buffer;
+    struct block {
+        std::byte *begin;
+        std::byte *end;
+
+        inline size_t size() const {
+            return static_cast<size_t>(end - begin);
+        }
+    };
+
+    inline std::byte *allocate(size_t bytes, size_t alignment) {
+        std::byte *offset = align(m_offset, alignment);
+        if (offset + bytes > m_end) {
+            next_block(bytes + alignment);
+            offset = align(m_offset, alignment);
+        }
+        m_offset = offset + bytes;
+        return offset;
+    }
+
+    static inline std::byte *align(std::byte *ptr, size_t alignment) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        return ptr + ((alignment - addr % alignment) % alignment);
+    }
+
+    // Moves on to a block of at least bytes: the next kept one that is large enough, or a new one
+    inline void next_block(size_t bytes) {
+        m_used_before += static_cast<size_t>(m_offset - m_blocks[m_current].begin);
+        for (size_t i = m_current + 1; i < m_blocks.size(); ++i) {
+            if (m_blocks[i].size() >= bytes) {
+                use_block(i);
+                return;
+            }
+        }
+        add_block(std::max(bytes, m_size));
+    }
+
+    inline void use_block(size_t index) {
+        m_current = index;
+        m_offset = m_blocks[index].begin;
+        m_end = m_blocks[index].end;
+    }
+
+    inline void add_block(size_t bytes) {
+        std::byte *memory;
+        if (m_options.populate || m_options.huge_pages) {
+            // Huge pages have to be asked for before the pages are faulted in, so populating is done by hand then
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | (m_options.huge_pages ? 0 : MAP_POPULATE);
+            void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (mapping == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            memory = static_cast<std::byte *>(mapping);
+            if (m_options.huge_pages) {
+                madvise(mapping, bytes, MADV_HUGEPAGE); // Only advice, blocks work the same without
+                for (size_t page = 0; m_options.populate && page < bytes; page += 4096) {
+                    static_cast<volatile std::byte *>(mapping)[page] = std::byte{0};
+                }
+            }
+        } else {
+            memory = reinterpret_cast<std::byte *>(malloc(bytes));
+        }
+        m_blocks.push_back({memory, memory + bytes});
+        m_reserved += bytes;
+        use_block(m_blocks.size() - 1);
+    }
+
+    inline void release(const block &b) const {
+        if (m_options.populate || m_options.huge_pages) {
+            munmap(b.begin, b.size());
+        } else {
+            free(b.begin);
+        }
+    }
+
+    size_t m_size; // Bytes per block
+    arena_options m_options;
+    std::vector<block> m_blocks;
+    size_t m_current = 0;     // Block being allocated from
+    size_t m_used_before = 0; // Bytes allocated in the blocks before it
+    size_t m_reserved = 0;    // Bytes of all blocks
+    size_t m_high_water = 0;  // Most bytes used before the last reset
+    std::vector<std::unique_ptr<storage_allocator>> m_forks;
+    size_t m_forks_used = 0; // Forks handed out since the last reset, the rest wait to be reused
     std::byte *m_offset;
+    std::byte *m_end;
+};
+
+// Arenas kept from one compilation to the next. Taking one gives an arena whose blocks were already allocated and
+// touched, and giving it back resets it, so a batch build or the compile server pays a reset per file instead of
+// allocating and freeing every block. Safe to use from several threads.
+class arena_pool {
+  public:
+    // Usage over the life of the pool
+    struct stats {
+        size_t arenas = 0;     // Arenas made, the most that were ever in use at once
+        size_t acquired = 0;   // Times an arena was taken
+        size_t reused = 0;     // Times the arena taken was one given back before
+        size_t high_water = 0; // Most bytes one use of an arena took, forks included
+        size_t reserved = 0;   // Bytes held by the arenas waiting in the pool
+    };
+
+    // An arena taken from the pool, given back when this goes away
+    class lease {
+      public:
+        inline lease(lease &&other) noexcept : m_pool(other.m_pool), m_arena(std::move(other.m_arena)) {}
+        inline lease &operator=(lease &&) = delete;
+
+        inline ~lease() {
+            if (m_arena) {
+                m_pool->release(std::move(m_arena));
+            }
+        }
+
+        inline storage_allocator &operator*() const {
+            return *m_arena;
+        }
+
+        inline storage_allocator *operator->() const {
+            return m_arena.get();
+        }
+
+      private:
+        friend class arena_pool;
+
+        inline lease(arena_pool *pool, std::unique_ptr<storage_allocator> arena)
+            : m_pool(pool), m_arena(std::move(arena)) {}
+
+        arena_pool *m_pool;
+        std::unique_ptr<storage_allocator> m_arena;
+    };
+
+    // Arenas get blocks of block_bytes. At most max_idle wait in the pool, each keeping up to keep_bytes of
+    // blocks, so one unusually large input does not pin its memory for good.
+    inline explicit arena_pool(size_t block_bytes, arena_options options = {}, size_t max_idle = 16,
+                               size_t keep_bytes = 64 * 1024 * 1024)
+        : m_block_bytes(block_bytes), m_options(options), m_max_idle(max_idle), m_keep_bytes(keep_bytes) {}
+
+    inline arena_pool(const arena_pool &) = delete;
+    inline arena_pool &operator=(const arena_pool &) = delete;
+
+    // Applies to arenas made from now on; the ones waiting in the pool are freed
+    inline void configure(arena_options options) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_options = options;
+        m_idle.clear();
+    }
+
+    inline lease acquire() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_stats.acquired;
+        if (!m_idle.empty()) {
+            std::unique_ptr<storage_allocator> arena = std::move(m_idle.back());
+            m_idle.pop_back();
+            ++m_stats.reused;
+            return lease(this, std::move(arena));
+        }
+        ++m_stats.arenas;
+        arena_options options = m_options;
+        lock.unlock(); // Populating a block can take a while
+        return lease(this, std::make_unique<storage_allocator>(m_block_bytes, options));
+    }
+
+    inline stats statistics() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        stats current = m_stats;
+        for (const std::unique_ptr<storage_allocator> &arena : m_idle) {
+            current.reserved += arena->reserved();
+        }
+        return current;
+    }
+
+  private:
+    inline void release(std::unique_ptr<storage_allocator> arena) {
+        size_t high_water = arena->used();
+        arena->reset(m_keep_bytes);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.high_water = std::max(m_stats.high_water, high_water);
+        if (m_idle.size() < m_max_idle) {
+            m_idle.push_back(std::move(arena));
+        }
+    }
+
+    size_t m_block_bytes;
+    arena_options m_options;
+    size_t m_max_idle;
+    size_t m_keep_bytes;
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<storage_allocator>> m_idle; // Reset, most recently given back last
+    stats m_stats;
+};
+
+// List inside an AST node. The first N elements are kept in the node itself, which covers most scopes and calls;
+// longer lists spill into the arena, doubling as they grow. Nothing is ever freed on its own: the storage goes away
+// with the arena, so elements must be trivially copyable and need no destructor. Growing takes the allocator the
+// node came from.
+//
+// Copies of a spilled list share its storage, which stays valid as long as the arena does. A copy starts out full,
+// so growing it moves it to storage of its own and it never writes where the original may.
+template <typename T, size_t N> class arena_vector {
+    static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>);
+
+  public:
+    using value_type = T;
+    using iterator = T *;
+    using const_iterator = const T *;
+    using reverse_iterator = std::reverse_iterator<T *>;
+    using const_reverse_iterator = std::reverse_iterator<const T *>;
+
+    inline arena_vector() = default;
+
+    inline arena_vector(const arena_vector &other) {
+        *this = other;
+    }
+
+    inline arena_vector &operator=(const arena_vector &other) {
+        if (this == &other) {
+            return *this;
+        }
+        m_size = other.m_size;
+        if (other.spilled()) {
+            m_data = other.m_data;
+            m_capacity = other.m_size;
+        } else {
+            m_data = m_inline;
+            m_capacity = N;
+            std::memcpy(m_inline, other.m_inline, sizeof(T) * m_size);
+        }
+        return *this;
+    }
+
+    inline void push_back(storage_allocator &allocator, const T &value) {
+        if (m_size == m_capacity) {
+            reserve(allocator, std::max(m_capacity * 2, N));
+        }
+        m_data[m_size++] = value;
+    }
+
+    // Appends the elements of [first, last), which must not lie in this list
+    inline void append(storage_allocator &allocator, const T *first, const T *last) {
+        size_t count = last - first;
+        if (m_size + count > m_capacity) {
+            reserve(allocator, std::max<size_t>(m_size + count, m_capacity * 2));
+        }
+        std::memcpy(m_data + m_size, first, sizeof(T) * count);
+        m_size += count;
+    }
+
+    // Grows or shrinks to count elements, new ones value-initialised
+    inline void resize(storage_allocator &allocator, size_t count) {
+        reserve(allocator, count);
+        for (size_t i = m_size; i < count; ++i) {
+            m_data[i] = T();
+        }
+        m_size = count;
+    }
+
+    inline void reserve(storage_allocator &allocator, size_t capacity) {
+        if (capacity <= m_capacity) {
+            return;
+        }
+        T *data = allocator.alloc_array<T>(capacity);
+        std::memcpy(data, m_data, sizeof(T) * m_size);
+        m_data = data;
+        m_capacity = capacity;
+    }
+
+    inline size_t size() const {
+        return m_size;
+    }
+
+    inline bool empty() const {
+        return m_size == 0;
+    }
+
+    inline T &operator[](size_t index) {
+        return m_data[index];
+    }
+
+    inline const T &operator[](size_t index) const {
+        return m_data[index];
+    }
+
+    inline const T &front() const {
+        return m_data[0];
+    }
+
+    inline const T &back() const {
+        return m_data[m_size - 1];
+    }
+
+    inline T *begin() {
+        return m_data;
+    }
+
+    inline T *end() {
+        return m_data + m_size;
+    }
+
+    inline const T *begin() const {
+        return m_data;
+    }
+
+    inline const T *end() const {
+        return m_data + m_size;
+    }
+
+    inline const T *cbegin() const {
+        return m_data;
+    }
+
+    inline const T *cend() const {
+        return m_data + m_size;
+    }
+
+    inline const_reverse_iterator rbegin() const {
+        return const_reverse_iterator(end());
+    }
+
+    inline const_reverse_iterator rend() const {
+        return const_reverse_iterator(begin());
+    }
+
+  private:
+    inline bool spilled() const {
+        return m_data != m_inline;
+    }
+
+    T *m_data = m_inline;
+    size_t m_size = 0;
+    size_t m_capacity = N;
+    T m_inline[N]{};
+};
+
+// Spellings shared by compilations that run at the same time and one after another, as a compile server's do, so
+// the names its clients send again and again are stored once for as long as it lives. Lookups take a shared lock
+// and additions an exclusive one. It stops taking new spellings once they fill max_bytes, since a server never
+// knows when they are no longer used; the compilations keep such spellings themselves.
+class shared_symbol_interner {
+  public:
+    inline explicit shared_symbol_interner(size_t max_bytes) : m_max_bytes(max_bytes) {}
+
+    inline shared_symbol_interner(const shared_symbol_interner &) = delete;
+    inline shared_symbol_interner &operator=(const shared_symbol_interner &) = delete;
+
+    // The stored spelling of text, added if it is new and there is room for it
+    inline std::optional<std::string_view> intern(std::string_view text) {
+        {
+            std::shared_lock lock(m_mutex);
+            auto it = m_symbols.find(text);
+            if (it != m_symbols.end()) {
+                return *it;
+            }
+        }
+        std::unique_lock lock(m_mutex);
+        auto it = m_symbols.find(text);
+        if (it != m_symbols.end()) {
+            return *it; // Added by another compilation in the meantime
+        }
+        if (text.size() > m_max_bytes - m_bytes) {
+            return {};
+        }
+        m_bytes += text.size();
+        char *copy = m_storage.alloc_array<char>(text.size());
+        std::memcpy(copy, text.data(), text.size());
+        return *m_symbols.emplace(copy, text.size()).first;
+    }
+
+    inline size_t size() const {
+        std::shared_lock lock(m_mutex);
+        return m_symbols.size();
+    }
+
+  private:
+    mutable std::shared_mutex m_mutex;
+    storage_allocator m_storage{1024 * 64};
+    std::unordered_set<std::string_view> m_symbols;
+    size_t m_bytes = 0; // Of all the spellings in m_symbols
+    size_t m_max_bytes;
+};
+
+// Identifiers and literals of a program, each spelling stored once. The views handed out point into blocks that
+// never move, so they stay valid for as long as the interner lives, and equal spellings get the same view. Given a
+// shared interner, which must outlive this one, spellings are taken from there and only kept here once it is full.
+class symbol_interner {
+  public:
+    inline explicit symbol_interner(shared_symbol_interner *shared = nullptr) : m_shared(shared) {}
+
+    inline symbol_interner(const symbol_interner &) = delete;
+    inline symbol_interner &operator=(const symbol_interner &) = delete;
+
+    inline std::string_view intern(std::string_view text) {
+        auto it = m_symbols.find(text);
+        if (it != m_symbols.end()) {
+            return *it;
+        }
+        if (m_shared != nullptr) {
+            if (std::optional<std::string_view> shared = m_shared->intern(text)) {
+                return *m_symbols.insert(shared.value()).first; // Found here next time, without the lock
+            }
+        }
+        char *copy = m_storage.alloc_array<char>(text.size());
+        std::memcpy(copy, text.data(), text.size());
+        return *m_symbols.emplace(copy, text.size()).first;
+    }
+
+    inline size_t size() const {
+        return m_symbols.size();
+    }
+
+  private:
+    shared_symbol_interner *m_shared;
+    storage_allocator m_storage{1024 * 64};
+    std::unordered_set<std::string_view> m_symbols;
 };
@@ -0,0 +1,83 @@
+#!/bin/bash
+# Compiles and runs one program of tests/programs in one mode, and checks that it exits with the status its
+# '// exit: N' line gives and, if it has an '// error: text' line, that text appears among the diagnostics.
+#   run_program.sh <querk> <program.qrk> native|run|interp|no-cmov|scalar|client|ast
+# Modes that assemble with nasm and link with ld are skipped (status 77) where those are not installed.
+
+querk=$(realpath "$1")
+program=$(realpath "$2")
+mode=$3
+
+expected=$(sed -n 's|^// exit: *\([0-9]*\).*|\1|p' "$program" | head -n 1)
+error=$(sed -n 's|^// error: *||p' "$program" | head -n 1)
+if [ -z "$expected" ]; then
+    echo "$program has no '// exit: N' line"
+    exit 1
+fi
+
+case $mode in
+    native | no-cmov | scalar | client)
+        if ! command -v nasm > /dev/null || ! command -v ld > /dev/null; then
+            echo "nasm or ld not found, skipping $mode"
+            exit 77
+        fi
+        ;;
+esac
+
+# querk writes out.asm, out and .querk-cache to the working directory
+work=$(mktemp -d)
+server=
+cleanup() {
+    if [ -n "$server" ]; then
+        kill "$server" 2> /dev/null
+        wait "$server" 2> /dev/null
+    fi
+    rm -rf "$work"
+}
+trap cleanup EXIT
+cd "$work" || exit 1
+
+# Runs the compiler, then out if it built one; the status is out's, or the compiler's if it failed
+compile_and_run() {
+    "$querk" "$@" "$program" 2>> diagnostics || return
+    ./out 2>> diagnostics
+}
+
+case $mode in
+    native) compile_and_run ;;
+    run) "$querk" --run "$program" 2>> diagnostics ;;
+    interp) "$querk" --interp "$program" 2>> diagnostics ;;
+    no-cmov) compile_and_run --no-cmov ;;
+    scalar) compile_and_run --target=scalar ;;
+    client)
+        # The server reports that it is serving once it listens, which is after the socket file appears
+        "$querk" --server="$work/socket" 2> server &
+        server=$!
+        for _ in $(seq 200); do
+            grep -q "serving on" server && break
+            sleep 0.05
+        done
+        compile_and_run --client="$work/socket"
+        ;;
+    ast)
+        # Imports are found next to out.ast, so the files beside the program are copied next to it
+        cp -r "$(dirname "$program")/." "$work"
+        "$querk" --emit-ast "$program" 2>> diagnostics && "$querk" --from-ast --run out.ast 2>> diagnostics
+        ;;
+    *)
+        echo "Unknown mode $mode"
+        exit 1
+        ;;
+esac
+status=$?
+
+cat diagnostics
+if [ "$status" -ne "$expected" ]; then
+    echo "$(basename "$program") ($mode): exit status $status, expected $expected"
+    exit 1
+fi
+if [ -n "$error" ] && ! grep -qF -- "$error" diagnostics; then
+    echo "$(basename "$program") ($mode): diagnostics do not contain '$error'"
+    exit 1
+fi
+exit 0
@@ -2,11 +2,17 @@
              // compilation
 
 #include <cctype>
+#include <charconv> // For checking that integer literals fit
+#include <cstdint>
 #include <iostream>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "diagnostics.hpp" // Errors are thrown as compile_error
+#include "storage.hpp"     // Token spellings are interned
+
 // Enum representing different types of tokens
 enum class tokentype {
     exit,
@@ -24,26 +30,60 @@ enum class tokentype {
     modu,
     open_curly,
     close_curly,
-    if_
+    if_,
+    fn,
+    return_,
+    tail,
+    comma,
+    while_,
+    static_,
+    open_square,
+    close_square,
+    double_equals,
+    not_equals,
+    less,
+    less_equals,
+    greater,
+    greater_equals,
+    logical_and,
+    logical_or,
+    logical_not,
+    else_,
+    match,
+    arrow,
+    underscore,
+    import,
+    string_lit
 };
 
 // Token structure representing a token with its type and optional value
 struct token {
-    tokentype type;                   // Type of the token
-    std::optional<std::string> value; // Optional string value, used only for
-                                      // identifiers and integer literals
+    tokentype type;                        // Type of the token
+    std::optional<std::string_view> value; // Optional interned spelling, used only for
+                                           // identifiers, integer and string literals
 };
 
-std::optional<int> binary_precedence(tokentype type) {
+inline std::optional<int> binary_precedence(tokentype type) {
     switch (type) {
 
+    case tokentype::logical_or:
+        return 0;
+    case tokentype::logical_and:
+        return 1;
+    case tokentype::double_equals:
+    case tokentype::not_equals:
+    case tokentype::less:
+    case tokentype::less_equals:
+    case tokentype::greater:
+    case tokentype::greater_equals:
+        return 2;
     case tokentype::minus:
     case tokentype::plus:
-        return 0;
+        return 3;
     case tokentype::div:
     case tokentype::modu:
     case tokentype::star:
-        return 1;
+        return 4;
     default:
         return {};
     }
@@ -51,15 +91,12 @@ std::optional<int> binary_precedence(tokentype type) {
 
 class tokenizer {
   public:
-    // Constructor: Initializes tokenizer with source code string
-    inline tokenizer(std::string src)
-        : m_src(std::move(
-              src)) // Move the input string to avoid unnecessary copying
-    {}
+    // Constructor: Reads the source in place, spellings of identifiers and literals go to the interner. Both must
+    // outlive the tokens.
+    inline tokenizer(std::string_view src, symbol_interner &symbols) : m_src(src), m_symbols(symbols) {}
 
     // Function to tokenize the input source code
     inline std::vector<token> tokenize() {
-        std::string tkn;           // Stores characters of the current token
         std::vector<token> tokens; // Stores all parsed tokens
 
         // Loop while there are characters to process
@@ -92,14 +129,15 @@ class tokenizer {
             // For words
             char current = peek().value();
             if (std::isalpha(current)) { // Check if character is alphabetic
-                tkn.push_back(
-                    consume()); // Append character and advance position
+                size_t start = m_index;
+                consume();
 
                 // Continue consuming alphanumeric characters (identifiers or
                 // keywords)
                 while (peek().has_value() && std::isalnum(peek().value())) {
-                    tkn.push_back(consume());
+                    consume();
                 }
+                std::string_view tkn = m_src.substr(start, m_index - start);
 
                 // Check for keywords
                 if (tkn == "exit" || tkn == "let") {
@@ -108,13 +146,27 @@ class tokenizer {
                                                   : tokentype::let});
                 } else if (tkn == "if") {
                     tokens.push_back({.type = tokentype::if_});
-                    tkn.clear();
+                } else if (tkn == "fn") {
+                    tokens.push_back({.type = tokentype::fn});
+                } else if (tkn == "return") {
+                    tokens.push_back({.type = tokentype::return_});
+                } else if (tkn == "tail") {
+                    tokens.push_back({.type = tokentype::tail});
+                } else if (tkn == "while") {
+                    tokens.push_back({.type = tokentype::while_});
+                } else if (tkn == "static") {
+                    tokens.push_back({.type = tokentype::static_});
+                } else if (tkn == "else") {
+                    tokens.push_back({.type = tokentype::else_});
+                } else if (tkn == "match") {
+                    tokens.push_back({.type = tokentype::match});
+                } else if (tkn == "import") {
+                    tokens.push_back({.type = tokentype::import});
                 }
 
                 else {
-                    tokens.push_back({.type = tokentype::ident, .value = tkn});
+                    tokens.push_back({.type = tokentype::ident, .value = m_symbols.intern(tkn)});
                 }
-                tkn.clear();
                 continue;
             }
 
@@ -132,9 +184,84 @@ class tokenizer {
                 consume();
                 tokens.push_back({.type = tokentype::semi});
                 break;
+            case ',':
+                consume();
+                tokens.push_back({.type = tokentype::comma});
+                break;
             case '=':
                 consume();
-                tokens.push_back({.type = tokentype::equals});
+                if (peek().has_value() && peek().value() == '=') {
+                    consume();
+                    tokens.push_back({.type = tokentype::double_equals});
+                } else if (peek().has_value() && peek().value() == '>') {
+                    consume();
+                    tokens.push_back({.type = tokentype::arrow});
+                } else {
+                    tokens.push_back({.type = tokentype::equals});
+                }
+                break;
+            case '_':
+                consume();
+                tokens.push_back({.type = tokentype::underscore});
+                break;
+            case '"':
+                // String literals name modules to import, they have no escapes and end on the same line
+                consume();
+                {
+                    size_t start = m_index;
+                    while (peek().has_value() && peek().value() != '"' && peek().value() != '\n') {
+                        consume();
+                    }
+                    if (!peek().has_value() || peek().value() != '"') {
+                        report_error("Error: Unterminated string literal");
+                    }
+                    std::string_view text = m_src.substr(start, m_index - start);
+                    consume();
+                    tokens.push_back({.type = tokentype::string_lit, .value = m_symbols.intern(text)});
+                }
+                break;
+            case '!':
+                consume();
+                if (peek().has_value() && peek().value() == '=') {
+                    consume();
+                    tokens.push_back({.type = tokentype::not_equals});
+                } else {
+                    tokens.push_back({.type = tokentype::logical_not});
+                }
+                break;
+            case '&':
+                consume();
+                if (!peek().has_value() || peek().value() != '&') {
+                    report_error("Error: Unrecognized character '&', did you mean '&&'?");
+                }
+                consume();
+                tokens.push_back({.type = tokentype::logical_and});
+                break;
+            case '|':
+                consume();
+                if (!peek().has_value() || peek().value() != '|') {
+                    report_error("Error: Unrecognized character '|', did you mean '||'?");
+                }
+                consume();
+                tokens.push_back({.type = tokentype::logical_or});
+                break;
+            case '<':
+                consume();
+                if (peek().has_value() && peek().value() == '=') {
+                    consume();
+                    tokens.push_back({.type = tokentype::less_equals});
+                } else {
+                    tokens.push_back({.type = tokentype::less});
+                }
+                break;
+            case '>':
+                consume();
+                if (peek().has_value() && peek().value() == '=') {
+                    consume();
+                    tokens.push_back({.type = tokentype::greater_equals});
+                } else {
+                    tokens.push_back({.type = tokentype::greater});
+                }
                 break;
             case '+':
                 consume();
@@ -164,21 +291,32 @@ class tokenizer {
                 consume();
                 tokens.push_back({.type = tokentype::close_curly});
                 break;
+            case '[':
+                consume();
+                tokens.push_back({.type = tokentype::open_square});
+                break;
+            case ']':
+                consume();
+                tokens.push_back({.type = tokentype::close_square});
+                break;
             default:
                 if (std::isdigit(current)) {
-                    tkn.push_back(consume());
+                    size_t start = m_index;
+                    consume();
                     while (peek().has_value() && std::isdigit(peek().value())) {
-                        tkn.push_back(consume());
+                        consume();
+                    }
+                    // Every value is a signed 64-bit integer, so a literal has to fit in one
+                    std::string_view digits = m_src.substr(start, m_index - start);
+                    int64_t value;
+                    if (std::from_chars(digits.data(), digits.data() + digits.size(), value).ec != std::errc()) {
+                        report_error("Error: Integer literal out of range: ", digits);
                     }
-                    tokens.push_back(
-                        {.type = tokentype::int_lit, .value = tkn});
-                    tkn.clear();
+                    tokens.push_back({.type = tokentype::int_lit, .value = m_symbols.intern(digits)});
                 } else if (std::isspace(current)) {
                     consume();
                 } else {
-                    std::cerr << "Error: Unrecognized character '" << current
-                              << "'" << std::endl;
-                    exit(EXIT_FAILURE);
+                    report_error("Error: Unrecognized character '", current, "'");
                 }
             }
         }
@@ -191,17 +329,16 @@ class tokenizer {
         if (m_index + offset >= m_src.length()) {
             return {}; // Return empty optional if out of bounds
         } else {
-            return m_src.at(m_index +
-                            offset); // Return character at current position
+            return m_src[m_index + offset]; // Return character at current position
         }
     }
 
     // Function to consume a character and move to the next one
     inline char consume() {
-        return m_src.at(
-            m_index++); // Return current character and increment index
+        return m_src[m_index++]; // Return current character and increment index
     }
 
-    const std::string m_src; // Source code string
-    size_t m_index = 0;      // Current position in the source code
+    std::string_view m_src;      // Source code, owned by the caller
+    symbol_interner &m_symbols; // Where spellings of identifiers and literals are kept
+    size_t m_index = 0;         // Current position in the source code
 };